@@ -1,12 +1,14 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -272,9 +274,8 @@ void thread_fs_script(void *arg)
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
+	struct fs_dirent stat;
 	char *diskname, *filename;
-	int fs_fd;
-	int stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -285,52 +286,412 @@ void thread_fs_stat(void *arg)
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_fd = fs_open(filename);
-	if (fs_fd < 0) {
-		fs_umount();
-		die("Cannot open file");
-	}
-
-	stat = fs_stat(fs_fd);
-	if (stat < 0) {
-		fs_close(fs_fd);
+	if (fs_stat_name(filename, &stat)) {
 		fs_umount();
 		die("Cannot stat file");
 	}
-	if (!stat) {
-		fs_close(fs_fd);
-		fs_umount();
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (!stat.size) {
 		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
 	}
 
-	if (fs_close(fs_fd)) {
-		fs_umount();
-		die("Cannot close file");
+	printf("Size of file '%s' is %zu bytes\n", filename, stat.size);
+	printf("%zu data blocks in %zu fragments\n", stat.block_count,
+		   stat.fragments);
+}
+
+/* Operations of a compiled script */
+enum script_opcode {
+	OP_MOUNT,
+	OP_UMOUNT,
+	OP_CREATE,
+	OP_DELETE,
+	OP_OPEN,
+	OP_CLOSE,
+	OP_SEEK,
+	OP_WRITE,
+	OP_READ,
+};
+
+static const struct {
+	const char *name;
+	enum script_opcode code;
+	int nargs;
+} script_keywords[] = {
+	{ "MOUNT",	OP_MOUNT,	0 },
+	{ "UMOUNT",	OP_UMOUNT,	0 },
+	{ "CREATE",	OP_CREATE,	1 },
+	{ "DELETE",	OP_DELETE,	1 },
+	{ "OPEN",	OP_OPEN,	1 },
+	{ "CLOSE",	OP_CLOSE,	0 },
+	{ "SEEK",	OP_SEEK,	1 },
+	{ "WRITE",	OP_WRITE,	2 },
+	{ "READ",	OP_READ,	3 },
+};
+
+/*
+ * One parsed script line. @data holds the preloaded DATA or FILE source of a
+ * WRITE or READ, followed by a zero byte, and @arg the SEEK offset or READ
+ * length.
+ */
+struct script_op {
+	enum script_opcode code;
+	char *line;
+	char *filename;
+	int arg;
+	char *data;
+	int data_size;
+
+	/* Timing over all replays, in nanoseconds */
+	long long total_ns;
+	long long min_ns;
+	long long max_ns;
+	long failures;
+};
+
+/* Load a DATA or FILE source once, so that replays only touch libfs */
+void script_load_source(struct script_op *op, char *source, char *description)
+{
+	struct stat st;
+	int data_fd;
+
+	if (!source || !description)
+		die("Missing data source in '%s'", op->line);
+
+	if (strcmp(source, "DATA") == 0) {
+		op->data_size = strlen(description);
+		op->data = strdup(description);
+		if (!op->data)
+			die_perror("strdup");
+	} else if (strcmp(source, "FILE") == 0) {
+		data_fd = open(description, O_RDONLY);
+		if (data_fd < 0)
+			die_perror("open");
+		if (fstat(data_fd, &st))
+			die_perror("fstat");
+		if (!S_ISREG(st.st_mode))
+			die("Not a regular file: %s\n", description);
+
+		op->data_size = st.st_size;
+		op->data = calloc(op->data_size + 1, sizeof(char));
+		if (!op->data)
+			die_perror("calloc");
+		if (read(data_fd, op->data, op->data_size) != op->data_size)
+			die_perror("read");
+		close(data_fd);
+	} else {
+		die("Invalid data description");
 	}
+}
 
-	if (fs_umount())
-		die("cannot unmount diskname");
+/* Parse a whole script into an array of operations */
+struct script_op *script_compile(const char *script, int *count)
+{
+	struct script_op *ops = NULL;
+	struct script_op *op;
+	FILE *fd_script;
+	char line_buffer[1024];
+	char *args[4];
+	size_t i;
+	int n = 0;
+	int j;
+
+	fd_script = fopen(script, "r");
+	if (!fd_script)
+		die_perror("fopen");
 
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	while (fgets(line_buffer, sizeof(line_buffer), fd_script) != NULL) {
+		/* Accept both LF and CRLF line endings */
+		line_buffer[strcspn(line_buffer, "\r\n")] = '\0';
+
+		ops = realloc(ops, (n + 1) * sizeof(*ops));
+		if (!ops)
+			die_perror("realloc");
+		op = &ops[n];
+		memset(op, 0, sizeof(*op));
+		op->min_ns = -1;
+
+		/* Keep a printable copy of the line for the timing report */
+		op->line = strdup(line_buffer);
+		if (!op->line)
+			die_perror("strdup");
+		for (j = 0; op->line[j]; j++)
+			if (op->line[j] == '\t')
+				op->line[j] = ' ';
+
+		args[0] = strtok(line_buffer, "\t");
+		for (j = 1; j < 4; j++)
+			args[j] = args[j - 1] ? strtok(NULL, "\t") : NULL;
+
+		/* Like script mode, stop at the first empty line */
+		if (!args[0]) {
+			free(op->line);
+			break;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(script_keywords); i++)
+			if (!strcmp(args[0], script_keywords[i].name))
+				break;
+		if (i == ARRAY_SIZE(script_keywords))
+			die("Unknown script command '%s'", args[0]);
+		op->code = script_keywords[i].code;
+		for (j = 1; j <= script_keywords[i].nargs; j++)
+			if (!args[j])
+				die("Missing argument in '%s'", op->line);
+
+		switch (op->code) {
+		case OP_CREATE:
+		case OP_DELETE:
+		case OP_OPEN:
+			op->filename = strdup(args[1]);
+			if (!op->filename)
+				die_perror("strdup");
+			break;
+		case OP_SEEK:
+			op->arg = atoi(args[1]);
+			break;
+		case OP_WRITE:
+			script_load_source(op, args[1], args[2]);
+			break;
+		case OP_READ:
+			op->arg = atoi(args[1]);
+			if (op->arg < 0)
+				die("invalid data read length");
+			script_load_source(op, args[2], args[3]);
+			break;
+		default:
+			break;
+		}
+		n++;
+	}
+
+	fclose(fd_script);
+	*count = n;
+	return ops;
 }
 
-void thread_fs_cat(void *arg)
+/*
+ * Run one operation. Returns 0 on success, 1 when a READ did not match its
+ * source, and dies on errors that would stop script mode as well.
+ */
+int script_run_op(struct script_op *op, char *diskname, int *fs_fd,
+				  char *mounted, char *read_buf)
+{
+	int count;
+
+	switch (op->code) {
+	case OP_MOUNT:
+		if (fs_mount(diskname))
+			die("Cannot mount disk");
+		*mounted = 1;
+		break;
+	case OP_UMOUNT:
+		if (*mounted && fs_umount())
+			die("Cannot unmount");
+		*mounted = 0;
+		break;
+	case OP_CREATE:
+		if (fs_create(op->filename)) {
+			fs_umount();
+			die("Cannot create file");
+		}
+		break;
+	case OP_DELETE:
+		if (fs_delete(op->filename)) {
+			fs_umount();
+			die("Cannot delete file");
+		}
+		break;
+	case OP_OPEN:
+		*fs_fd = fs_open(op->filename);
+		if (*fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+		break;
+	case OP_CLOSE:
+		if (fs_close(*fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+		break;
+	case OP_SEEK:
+		if (fs_lseek(*fs_fd, op->arg)) {
+			fs_umount();
+			die("Cannot seek to position");
+		}
+		break;
+	case OP_WRITE:
+		if (fs_write(*fs_fd, op->data, op->data_size) < 0) {
+			fs_umount();
+			die("write error");
+		}
+		break;
+	case OP_READ:
+		memset(read_buf, 0, op->arg + 1);
+		count = fs_read(*fs_fd, read_buf, op->arg);
+		if (count < 0) {
+			fs_umount();
+			die("read error");
+		}
+		/* Same check as script mode, zero byte included */
+		if (op->data_size > op->arg
+			|| memcmp(op->data, read_buf, op->data_size + 1))
+			return 1;
+		break;
+	}
+
+	return 0;
+}
+
+long long elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000LL
+		+ (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Replay a script several times. The script is parsed once and its data
+ * sources preloaded, so that the timings only cover the libfs calls.
+ */
+void thread_fs_replay(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fs_fd;
-	int stat, read;
+	char *diskname, *read_buf;
+	struct script_op *ops, *op;
+	struct timespec start, end, run_start, run_end;
+	long long run_ns = 0;
+	int fs_fd = -1;
+	char mounted = 0;
+	int count, iterations, i, j, max_read = 0;
+	long failures = 0;
 
 	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+		die("Usage: <diskname> <script filename> [<iterations>]");
 
 	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
+	iterations = t_arg->argc > 2 ? atoi(t_arg->argv[2]) : 1;
+	if (iterations < 1)
+		die("invalid number of iterations");
+
+	ops = script_compile(t_arg->argv[1], &count);
+	for (j = 0; j < count; j++)
+		if (ops[j].code == OP_READ && ops[j].arg > max_read)
+			max_read = ops[j].arg;
+	read_buf = malloc(max_read + 1);
+	if (!read_buf)
+		die_perror("malloc");
+
+	for (i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &run_start);
+		for (j = 0; j < count; j++) {
+			long long ns;
+
+			op = &ops[j];
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			op->failures += script_run_op(op, diskname, &fs_fd, &mounted,
+										  read_buf);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			ns = elapsed_ns(&start, &end);
+			op->total_ns += ns;
+			if (op->min_ns < 0 || ns < op->min_ns)
+				op->min_ns = ns;
+			if (ns > op->max_ns)
+				op->max_ns = ns;
+		}
 
-	if (fs_mount(diskname))
-		die("Cannot mount diskname");
+		/* Each replay starts from an unmounted disk */
+		if (mounted && fs_umount())
+			die("Cannot unmount diskname");
+		mounted = 0;
+		clock_gettime(CLOCK_MONOTONIC, &run_end);
+		run_ns += elapsed_ns(&run_start, &run_end);
+	}
+
+	printf("Replayed %d ops %d times in %.3f ms (%.0f ops/s)\n", count,
+		   iterations, run_ns / 1e6,
+		   run_ns ? (double)count * iterations * 1e9 / run_ns : 0);
+	printf("%4s %10s %10s %10s  %s\n", "op", "avg(us)", "min(us)", "max(us)",
+		   "command");
+	for (j = 0; j < count; j++) {
+		op = &ops[j];
+		printf("%4d %10.2f %10.2f %10.2f  %s", j + 1,
+			   op->total_ns / 1e3 / iterations, op->min_ns / 1e3,
+			   op->max_ns / 1e3, op->line);
+		if (op->failures)
+			printf("  (%ld mismatched reads)", op->failures);
+		printf("\n");
+		failures += op->failures;
+
+		free(op->line);
+		free(op->filename);
+		free(op->data);
+	}
+
+	free(ops);
+	free(read_buf);
+
+	if (failures)
+		die("%ld reads returned unexpected data", failures);
+}
+
+/*
+ * Collect the file names of a batch command: the remaining arguments, or one
+ * name per line on stdin when the only one given is "-"
+ */
+char **get_file_list(int argc, char **argv, int *count)
+{
+	char line_buffer[PATH_MAX];
+	char **files = NULL;
+	int n = 0;
+
+	if (argc != 1 || strcmp(argv[0], "-")) {
+		*count = argc;
+		return argv;
+	}
+
+	while (fgets(line_buffer, sizeof(line_buffer), stdin) != NULL) {
+		char *nl = strchr(line_buffer, '\n');
+		if (nl)
+			*nl = '\0';
+		if (!line_buffer[0])
+			continue;
+
+		files = realloc(files, (n + 1) * sizeof(char *));
+		if (!files)
+			die_perror("realloc");
+		files[n] = strdup(line_buffer);
+		if (!files[n++])
+			die_perror("strdup");
+	}
+
+	*count = n;
+	return files;
+}
+
+/* Free what get_file_list() allocated, which is nothing for names in @argv */
+void free_file_list(char **files, int count, char **argv)
+{
+	int i;
+
+	if (files == argv)
+		return;
+	for (i = 0; i < count; i++)
+		free(files[i]);
+	free(files);
+}
+
+void cat_file(char *filename)
+{
+	int fs_fd;
+	int stat, ret;
+	long read;
 
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
@@ -345,93 +706,128 @@ void thread_fs_cat(void *arg)
 	}
 	if (!stat) {
 		/* Nothing to read, file is empty */
+		fs_close(fs_fd);
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
 
-	read = fs_read(fs_fd, buf, stat);
+	printf("Content of the file:\n");
+
+	/* Have the content copied straight from the image to stdout */
+	fflush(stdout);
+	read = 0;
+	while (read < stat) {
+		ret = fs_sendfile(fs_fd, STDOUT_FILENO, read, stat - read);
+		if (ret <= 0)
+			break;
+		read += ret;
+	}
+	printf("Read file '%s' (%ld/%d bytes)\n", filename, read, stat);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
 	}
+	if (read != stat) {
+		fs_umount();
+		die("Short read on file '%s' (%ld/%d bytes)", filename, read, stat);
+	}
+}
 
-	if (fs_umount())
-		die("cannot unmount diskname");
+void thread_fs_cat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, **files;
+	int i, count;
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
+	if (t_arg->argc < 2)
+		die("need <diskname> <filename>... (or - to read names from stdin)");
 
-	free(buf);
+	diskname = t_arg->argv[0];
+	files = get_file_list(t_arg->argc - 1, &t_arg->argv[1], &count);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	for (i = 0; i < count; i++)
+		cat_file(files[i]);
+	free_file_list(files, count, &t_arg->argv[1]);
+
+	if (fs_umount())
+		die("cannot unmount diskname");
 }
 
 void thread_fs_rm(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename;
+	char *diskname, **files;
+	int i, count;
 
 	if (t_arg->argc < 2)
-		die("need <diskname> <filename>");
+		die("need <diskname> <filename>... (or - to read names from stdin)");
 
 	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
+	files = get_file_list(t_arg->argc - 1, &t_arg->argv[1], &count);
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_delete(filename)) {
-		fs_umount();
-		die("Cannot delete file");
+	for (i = 0; i < count; i++) {
+		if (fs_delete(files[i])) {
+			fs_umount();
+			die("Cannot delete file");
+		}
+		printf("Removed file '%s'\n", files[i]);
 	}
+	free_file_list(files, count, &t_arg->argv[1]);
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
-
-	printf("Removed file '%s'\n", filename);
 }
 
-void thread_fs_add(void *arg)
+/* Host file opened for the add command */
+struct host_file {
+	int fd;
+	size_t size;
+};
+
+/*
+ * Open a host file, asking the kernel to start reading it in right away so
+ * that it loads while the previous file is being written
+ */
+void host_file_open(const char *filename, struct host_file *hf)
 {
-	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fd, fs_fd;
 	struct stat st;
-	int written;
-
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
-
-	diskname = t_arg->argv[0];
-	filename = t_arg->argv[1];
 
-	/* Open file on host computer */
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
+	hf->fd = open(filename, O_RDONLY);
+	if (hf->fd < 0) {
+		fs_umount();
 		die_perror("open");
-	if (fstat(fd, &st))
+	}
+	if (fstat(hf->fd, &st)) {
+		fs_umount();
 		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
+	}
+	if (!S_ISREG(st.st_mode)) {
+		fs_umount();
 		die("Not a regular file: %s\n", filename);
+	}
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
+	hf->size = st.st_size;
+	posix_fadvise(hf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(hf->fd, 0, 0, POSIX_FADV_WILLNEED);
+}
 
-	/* Now, deal with our filesystem:
-	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
-	 */
-	if (fs_mount(diskname))
-		die("Cannot mount diskname");
+void host_file_close(struct host_file *hf)
+{
+	close(hf->fd);
+}
+
+void add_file(char *filename, struct host_file *hf)
+{
+	int fs_fd;
+	int ret = 0;
+	long written = 0;
 
 	if (fs_create(filename)) {
 		fs_umount();
@@ -444,21 +840,428 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	/* Have the content copied straight from the host file to the image */
+	while (written < (long)hf->size) {
+		ret = fs_recvfile(fs_fd, hf->fd, written, hf->size - written);
+		if (ret <= 0)
+			break;
+		written += ret;
+	}
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
 	}
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot write file '%s'", filename);
+	}
+
+	printf("Wrote file '%s' (%ld/%zu bytes)\n", filename, written,
+		   hf->size);
+}
+
+void thread_fs_add(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, **files;
+	struct host_file current, next;
+	int i, count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>... (or - to read names from stdin)");
+
+	diskname = t_arg->argv[0];
+	files = get_file_list(t_arg->argc - 1, &t_arg->argv[1], &count);
+	if (!count)
+		return;
+
+	/* Now, deal with our filesystem:
+	 * - mount once, then for each host file create a new file, copy content
+	 *   of host file into this new file, close the new file, and finally
+	 *   umount
+	 * - the next host file is opened before the current one is written, so
+	 *   its content loads in the background
+	 * - content is copied by fs_recvfile(), straight from the host file to
+	 *   the image when it can, so memory use does not depend on file size
+	 */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	host_file_open(files[0], &next);
+	for (i = 0; i < count; i++) {
+		current = next;
+		if (i + 1 < count)
+			host_file_open(files[i + 1], &next);
+
+		add_file(files[i], &current);
+		host_file_close(&current);
+	}
+	free_file_list(files, count, &t_arg->argv[1]);
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
+}
+
+/* Operations issued by the load generator */
+enum load_opcode {
+	LOAD_CREATE,
+	LOAD_DELETE,
+	LOAD_OPEN,
+	LOAD_CLOSE,
+	LOAD_READ,
+	LOAD_WRITE,
+	LOAD_SEEK,
+	LOAD_APPEND,
+	LOAD_OPS,
+};
+
+static const char *load_op_names[LOAD_OPS] = {
+	"create", "delete", "open", "close", "read", "write", "seek", "append"
+};
+
+/* Files are wrapped back to offset 0 once they reach this size */
+#define LOAD_MAX_FILE (256 * 1024)
+#define LOAD_IO_SIZE 4096
+
+/*
+ * Appends go to one log file all clients share, through FS_OPEN_APPEND fds of
+ * their own, a record at a time. Records are small enough to stay buffered,
+ * and the log is truncated back to empty once it reaches LOAD_MAX_FILE.
+ */
+#define LOAD_LOG "load.log"
+#define LOAD_RECORD 128
+
+/*
+ * libfs keeps its state in globals and is not thread-safe, so clients take
+ * this lock around every call. Latencies include the time spent waiting on
+ * it, which is what a finer grained libfs would improve.
+ */
+static pthread_mutex_t libfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes appended to the log since it was last truncated, under libfs_lock */
+static size_t load_log_size;
+
+struct load_client {
+	pthread_t thread;
+	int id;
+	int ops;
+	const int *mix;
+	int mix_total;
+	unsigned int seed;
+
+	/* Latency of every op issued, in nanoseconds, per op type */
+	long long *latency[LOAD_OPS];
+	int count[LOAD_OPS];
+	long errors;
+};
+
+/* Pick an op from the mix, then adjust it to what the file state allows */
+enum load_opcode load_pick(struct load_client *c, char exists, int fs_fd)
+{
+	int i, r = rand_r(&c->seed) % c->mix_total;
+
+	for (i = 0; i < LOAD_OPS - 1 && r >= c->mix[i]; i++)
+		r -= c->mix[i];
+
+	switch (i) {
+	case LOAD_CREATE:
+		if (!exists)
+			return LOAD_CREATE;
+		return fs_fd < 0 ? LOAD_OPEN : LOAD_CLOSE;
+	case LOAD_DELETE:
+		if (!exists)
+			return LOAD_CREATE;
+		return fs_fd < 0 ? LOAD_DELETE : LOAD_CLOSE;
+	case LOAD_OPEN:
+		if (!exists)
+			return LOAD_CREATE;
+		return fs_fd < 0 ? LOAD_OPEN : LOAD_CLOSE;
+	case LOAD_CLOSE:
+		if (fs_fd >= 0)
+			return LOAD_CLOSE;
+		return exists ? LOAD_OPEN : LOAD_CREATE;
+	case LOAD_APPEND:
+		return LOAD_APPEND;
+	default:
+		if (fs_fd >= 0)
+			return i;
+		return exists ? LOAD_OPEN : LOAD_CREATE;
+	}
+}
+
+void *load_client_run(void *arg)
+{
+	struct load_client *c = arg;
+	char filename[FS_FILENAME_LEN];
+	char *buf;
+	struct timespec start, end;
+	enum load_opcode op;
+	char exists = 0;
+	int fs_fd = -1, log_fd = -1;
+	int i, ret;
+
+	snprintf(filename, sizeof(filename), "load.%d", c->id);
+	buf = malloc(LOAD_IO_SIZE);
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 'a' + c->id % 26, LOAD_IO_SIZE);
+
+	for (i = 0; i < LOAD_OPS; i++) {
+		c->latency[i] = malloc(c->ops * sizeof(long long));
+		if (!c->latency[i])
+			die_perror("malloc");
+	}
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
-		   st.st_size);
+	for (i = 0; i < c->ops; i++) {
+		op = load_pick(c, exists, fs_fd);
 
-	munmap(buf, st.st_size);
-	close(fd);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(&libfs_lock);
+		switch (op) {
+		case LOAD_CREATE:
+			ret = fs_create(filename);
+			exists = !ret;
+			break;
+		case LOAD_DELETE:
+			ret = fs_delete(filename);
+			exists = ret != 0;
+			break;
+		case LOAD_OPEN:
+			fs_fd = fs_open(filename);
+			ret = fs_fd < 0;
+			break;
+		case LOAD_CLOSE:
+			ret = fs_close(fs_fd);
+			fs_fd = -1;
+			break;
+		case LOAD_READ:
+			ret = fs_read(fs_fd, buf, LOAD_IO_SIZE) < 0;
+			break;
+		case LOAD_WRITE:
+			if (fs_stat(fs_fd) >= LOAD_MAX_FILE)
+				fs_lseek(fs_fd, 0);
+			ret = fs_write(fs_fd, buf, LOAD_IO_SIZE) < 0;
+			break;
+		case LOAD_SEEK:
+			ret = fs_lseek(fs_fd, rand_r(&c->seed) % (fs_stat(fs_fd) + 1));
+			break;
+		default:
+			if (log_fd < 0)
+				log_fd = fs_open_flags(LOAD_LOG, FS_OPEN_APPEND);
+			if (log_fd >= 0 && load_log_size + LOAD_RECORD > LOAD_MAX_FILE) {
+				fs_truncate(log_fd, 0);
+				load_log_size = 0;
+			}
+			ret = log_fd < 0 || fs_write(log_fd, buf, LOAD_RECORD) != LOAD_RECORD;
+			if (!ret)
+				load_log_size += LOAD_RECORD;
+			break;
+		}
+		pthread_mutex_unlock(&libfs_lock);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (ret)
+			c->errors++;
+		c->latency[op][c->count[op]++] = elapsed_ns(&start, &end);
+	}
+
+	/* Leave the image as it was found */
+	pthread_mutex_lock(&libfs_lock);
+	if (fs_fd >= 0)
+		fs_close(fs_fd);
+	if (log_fd >= 0)
+		fs_close(log_fd);
+	if (exists)
+		fs_delete(filename);
+	pthread_mutex_unlock(&libfs_lock);
+
+	free(buf);
+	return NULL;
+}
+
+int compare_latency(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+void print_latency(const char *name, long long *latency, int count)
+{
+	if (!count)
+		return;
+
+	qsort(latency, count, sizeof(long long), compare_latency);
+	printf("%-8s %9d %10.2f %10.2f %10.2f %10.2f\n", name, count,
+		   latency[count / 2] / 1e3, latency[count * 9 / 10] / 1e3,
+		   latency[count * 99 / 100] / 1e3, latency[count - 1] / 1e3);
+}
+
+/* Parse a mix such as "read:8,write:8,seek:4" on top of the default one */
+void load_parse_mix(char *spec, int *mix)
+{
+	char *item, *colon;
+	int i;
+
+	for (item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+		colon = strchr(item, ':');
+		if (!colon)
+			die("Invalid mix entry '%s'", item);
+		*colon = '\0';
+
+		for (i = 0; i < LOAD_OPS; i++)
+			if (!strcmp(item, load_op_names[i]))
+				break;
+		if (i == LOAD_OPS)
+			die("Unknown operation '%s'", item);
+
+		mix[i] = atoi(colon + 1);
+		if (mix[i] < 0)
+			die("Invalid weight for '%s'", item);
+	}
+}
+
+/*
+ * Every record of the shared log must be whole: @size bytes of them in all,
+ * each filled with the letter of the client that appended it. Returns the
+ * number of records, or -1 if the log doesn't hold what was appended.
+ */
+long load_check_log(size_t size)
+{
+	char record[LOAD_RECORD];
+	long records = 0;
+	int fs_fd, i;
+
+	fs_fd = fs_open(LOAD_LOG);
+	if (fs_fd < 0 || fs_stat(fs_fd) != (int)size)
+		records = -1;
+	while (records >= 0 && fs_read(fs_fd, record, LOAD_RECORD) == LOAD_RECORD) {
+		for (i = 1; i < LOAD_RECORD && record[i] == record[0]; i++)
+			;
+		if (i < LOAD_RECORD || record[0] < 'a' || record[0] > 'z')
+			records = -1;
+		else
+			records++;
+	}
+	if (fs_fd >= 0)
+		fs_close(fs_fd);
+
+	return records;
+}
+
+/*
+ * Run a number of client threads against one mounted image, each doing a
+ * random mix of operations on its own file, and appending to a log they all
+ * share if the mix has appends
+ */
+void thread_fs_loadgen(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct load_client *clients;
+	struct timespec start, end;
+	int mix[LOAD_OPS] = { 1, 1, 2, 2, 8, 8, 4, 0 };
+	long long *all;
+	long long wall_ns;
+	long total = 0, errors = 0, records = 0;
+	char *diskname;
+	int threads, ops, mix_total = 0;
+	int i, j, n;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <threads> <ops per thread> [<op>:<weight>,...]");
+
+	diskname = t_arg->argv[0];
+	threads = atoi(t_arg->argv[1]);
+	ops = atoi(t_arg->argv[2]);
+	if (threads < 1 || ops < 1)
+		die("invalid number of threads or ops");
+	if (t_arg->argc > 3)
+		load_parse_mix(t_arg->argv[3], mix);
+	for (i = 0; i < LOAD_OPS; i++)
+		mix_total += mix[i];
+	if (!mix_total)
+		die("Empty operation mix");
+
+	clients = calloc(threads, sizeof(*clients));
+	if (!clients)
+		die_perror("calloc");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	load_log_size = 0;
+	if (mix[LOAD_APPEND] && fs_create(LOAD_LOG))
+		die("Cannot create file '%s'", LOAD_LOG);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; i++) {
+		clients[i].id = i;
+		clients[i].ops = ops;
+		clients[i].mix = mix;
+		clients[i].mix_total = mix_total;
+		clients[i].seed = i + 1;
+		if (pthread_create(&clients[i].thread, NULL, load_client_run,
+						   &clients[i]))
+			die("Cannot create thread");
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(clients[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wall_ns = elapsed_ns(&start, &end);
+
+	if (mix[LOAD_APPEND]) {
+		records = load_check_log(load_log_size);
+		fs_delete(LOAD_LOG);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%d threads, %ld ops in %.3f ms: %.0f ops/s\n", threads,
+		   (long)threads * ops, wall_ns / 1e6,
+		   wall_ns ? (double)threads * ops * 1e9 / wall_ns : 0);
+	printf("%-8s %9s %10s %10s %10s %10s\n", "op", "count", "p50(us)",
+		   "p90(us)", "p99(us)", "max(us)");
+
+	all = malloc((long)threads * ops * sizeof(long long));
+	if (!all)
+		die_perror("malloc");
+	for (j = 0; j < LOAD_OPS; j++) {
+		long long *latency;
+
+		for (n = 0, i = 0; i < threads; i++)
+			n += clients[i].count[j];
+		latency = malloc((n ? n : 1) * sizeof(long long));
+		if (!latency)
+			die_perror("malloc");
+		for (n = 0, i = 0; i < threads; i++) {
+			memcpy(latency + n, clients[i].latency[j],
+				   clients[i].count[j] * sizeof(long long));
+			memcpy(all + total, clients[i].latency[j],
+				   clients[i].count[j] * sizeof(long long));
+			n += clients[i].count[j];
+			total += clients[i].count[j];
+		}
+		print_latency(load_op_names[j], latency, n);
+		free(latency);
+	}
+	print_latency("all", all, total);
+	free(all);
+
+	for (i = 0; i < threads; i++) {
+		errors += clients[i].errors;
+		for (j = 0; j < LOAD_OPS; j++)
+			free(clients[i].latency[j]);
+	}
+	free(clients);
+
+	if (errors)
+		printf("%ld operations failed\n", errors);
+	if (records < 0)
+		printf("Shared log '%s' lost or mixed up records\n", LOAD_LOG);
+	else if (mix[LOAD_APPEND])
+		printf("Shared log '%s' ends with %ld whole records\n", LOAD_LOG,
+			   records);
 }
 
 void thread_fs_ls(void *arg)
@@ -480,6 +1283,103 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <path>...");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	for (i = 1; i < t_arg->argc; i++) {
+		if (fs_mkdir(t_arg->argv[i])) {
+			fs_umount();
+			die("Cannot create directory '%s'", t_arg->argv[i]);
+		}
+		printf("Created directory '%s'\n", t_arg->argv[i]);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <path>...");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	for (i = 1; i < t_arg->argc; i++) {
+		if (fs_rmdir(t_arg->argv[i])) {
+			fs_umount();
+			die("Cannot remove directory '%s'", t_arg->argv[i]);
+		}
+		printf("Removed directory '%s'\n", t_arg->argv[i]);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent *dirents;
+	char *diskname, *path;
+	int i, count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<path>]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Size the array first, then get every entry in one call */
+	path = t_arg->argc > 1 ? t_arg->argv[1] : "/";
+	count = fs_stat_all(path, NULL, 0);
+	if (count < 0) {
+		fs_umount();
+		die("Cannot open directory");
+	}
+	dirents = malloc((count ? count : 1) * sizeof(*dirents));
+	if (!dirents)
+		die_perror("malloc");
+	count = fs_stat_all(path, dirents, count);
+	if (count < 0) {
+		fs_umount();
+		die("Cannot read directory");
+	}
+
+	for (i = 0; i < count; i++) {
+		if (dirents[i].is_directory)
+			printf("dir: %s\n", dirents[i].name);
+		else
+			printf("file: %s, size: %zu, blocks: %zu\n",
+				   dirents[i].name, dirents[i].size,
+				   dirents[i].block_count);
+	}
+	free(dirents);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -499,6 +1399,65 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot(t_arg->argv[1]))
+		die("Cannot take snapshot %s", t_arg->argv[1]);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_snapls(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_snapshot_mount(diskname, t_arg->argv[1]))
+		die("Cannot mount snapshot %s", t_arg->argv[1]);
+
+	fs_ls();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_snaprm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <snapshot>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(t_arg->argv[1]))
+		die("Cannot delete snapshot %s", t_arg->argv[1]);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -507,17 +1466,55 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	size_t block_size = 4096;
+	size_t max_files = FS_FILE_MAX_COUNT;
+	int flags = 0;
+	int i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data blocks> [<block size> [extents] [inline] [checksums] [<max files>]]");
+
+	if (t_arg->argc > 2)
+		block_size = get_argv(t_arg->argv[2]);
+
+	for (i = 3; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "extents"))
+			flags |= FS_FORMAT_EXTENTS;
+		else if (!strcmp(t_arg->argv[i], "inline"))
+			flags |= FS_FORMAT_INLINE;
+		else if (!strcmp(t_arg->argv[i], "checksums"))
+			flags |= FS_FORMAT_CHECKSUMS;
+		else
+			max_files = get_argv(t_arg->argv[i]);
+	}
+
+	if (fs_format(t_arg->argv[0], get_argv(t_arg->argv[1]), block_size, max_files, flags))
+		die("Cannot format diskname");
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
+	{ "format",	thread_fs_format },
 	{ "info",	thread_fs_info },
+	{ "snapshot",	thread_fs_snapshot },
+	{ "snapls",	thread_fs_snapls },
+	{ "snaprm",	thread_fs_snaprm },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "dir",	thread_fs_dir },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "replay",	thread_fs_replay },
+	{ "loadgen",	thread_fs_loadgen }
 };
 
 void usage(char *program)
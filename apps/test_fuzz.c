@@ -0,0 +1,1271 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+/*
+ * Randomized test harness for libfs.
+ *
+ * Every run plays a random sequence of operations against libfs and against an
+ * in-memory model of what the files should contain, comparing every result.
+ * With every file deleted afterwards, the disk must be back to the free space
+ * it had when formatted. The same sequence is then replayed with a simulated
+ * crash: from a random point on, the block backend silently drops every
+ * write. The image is then mounted again and checked against what was last
+ * synced.
+ *
+ * Each run formats its own disk image, with a block size, a number of blocks
+ * and format flags picked from its seed, so that every on-disk format gets
+ * its share of runs. Some disks span several FAT blocks, with a ballast file
+ * in the lower half so that files are allocated past the first one. The
+ * image lives in memory: the block_* functions below replace libfs/disk.c at
+ * link time, and copy_file_range() replaces the libc one so that libfs
+ * copying data blocks straight into the image goes through the same crash.
+ */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Files and descriptors the model keeps track of */
+#define FUZZ_FILES 16
+#define FUZZ_FDS 8
+
+/* Largest data block fs_format() can be asked for */
+#define FUZZ_BLOCK_SIZE_MAX (16 * BLOCK_SIZE)
+
+/*
+ * Fault-injecting in-memory block backend. The image is a memory file that
+ * libfs can open by name, mapped here for the block functions.
+ */
+static int image_fd = -1;
+static char image_path[64];
+static struct stat image_st;
+static char *pristine_image;
+static char *disk_image;
+static size_t disk_blocks;
+static char disk_opened;
+
+/* Writes left before the simulated crash, or -1 when no crash is armed */
+static long writes_left = -1;
+static char crashed;
+
+static long block_reads;
+static long block_writes;
+
+int block_disk_open(const char *diskname)
+{
+	struct stat st;
+
+	(void)diskname;
+
+	if (disk_opened)
+		return -1;
+
+	/* fs_format() may have resized the image */
+	if (fstat(image_fd, &st))
+		die_perror("fstat");
+	if ((size_t)st.st_size != disk_blocks * BLOCK_SIZE) {
+		if (disk_image)
+			munmap(disk_image, disk_blocks * BLOCK_SIZE);
+		disk_blocks = st.st_size / BLOCK_SIZE;
+		disk_image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+						  MAP_SHARED, image_fd, 0);
+		if (disk_image == MAP_FAILED)
+			die_perror("mmap");
+	}
+
+	disk_opened = 1;
+	return 0;
+}
+
+int block_disk_close(void)
+{
+	if (!disk_opened)
+		return -1;
+	disk_opened = 0;
+	return 0;
+}
+
+int block_disk_count(void)
+{
+	if (!disk_opened)
+		return -1;
+	return disk_blocks;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	if (!disk_opened || block >= disk_blocks)
+		return -1;
+
+	block_writes++;
+	if (writes_left == 0) {
+		/* Past the crash point, writes get lost without libfs noticing */
+		crashed = 1;
+		return 0;
+	}
+	if (writes_left > 0)
+		writes_left--;
+
+	memcpy(disk_image + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+	return 0;
+}
+
+int block_read(size_t block, void *buf)
+{
+	if (!disk_opened || block >= disk_blocks)
+		return -1;
+
+	block_reads++;
+	memcpy(buf, disk_image + block * BLOCK_SIZE, BLOCK_SIZE);
+	return 0;
+}
+
+int is_image(int fd)
+{
+	struct stat st;
+
+	return !fstat(fd, &st) && st.st_dev == image_st.st_dev &&
+		st.st_ino == image_st.st_ino;
+}
+
+/*
+ * Copies into the image count as block writes, a block at a time, and the
+ * ones past the crash point get lost. The bytes they would have written are
+ * consumed from @in all the same.
+ */
+ssize_t copy_file_range(int in, off64_t *in_offset, int out,
+						off64_t *out_offset, size_t len, unsigned int flags)
+{
+	size_t done = 0, chunk;
+	ssize_t ret;
+
+	if (!out_offset || !is_image(out)) {
+		if (is_image(in))
+			block_reads += (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		return syscall(SYS_copy_file_range, in, in_offset, out, out_offset,
+					   len, flags);
+	}
+
+	while (done < len) {
+		chunk = BLOCK_SIZE - *out_offset % BLOCK_SIZE;
+		if (chunk > len - done)
+			chunk = len - done;
+
+		block_writes++;
+		if (writes_left == 0) {
+			crashed = 1;
+			if (in_offset)
+				*in_offset += chunk;
+			else
+				lseek(in, chunk, SEEK_CUR);
+			*out_offset += chunk;
+			done += chunk;
+			continue;
+		}
+
+		ret = syscall(SYS_copy_file_range, in, in_offset, out, out_offset,
+					  chunk, flags);
+		if (ret <= 0)
+			return done ? (ssize_t)done : ret;
+		if (writes_left > 0)
+			writes_left--;
+		done += ret;
+		if ((size_t)ret < chunk)
+			break;
+	}
+	return done;
+}
+
+void create_image(void)
+{
+	image_fd = memfd_create("fuzz.img", 0);
+	if (image_fd < 0 || fstat(image_fd, &image_st))
+		die_perror("memfd_create");
+	snprintf(image_path, sizeof(image_path), "/proc/self/fd/%d", image_fd);
+}
+
+void destroy_image(void)
+{
+	if (disk_image)
+		munmap(disk_image, disk_blocks * BLOCK_SIZE);
+	close(image_fd);
+	free(pristine_image);
+}
+
+/*
+ * Model
+ */
+struct model_file {
+	char name[FS_FILENAME_LEN];
+	char exists;
+	char *data;
+	size_t size;
+
+	/* Modified since the last fs_sync() or remount */
+	char dirty;
+
+	/* State as of the last fs_sync() or remount */
+	char durable_exists;
+	char *durable_data;
+	size_t durable_size;
+
+	/* State as of the last fs_snapshot() */
+	char snapshot_exists;
+	char *snapshot_data;
+	size_t snapshot_size;
+};
+
+struct model_fd {
+	int fs_fd;
+	int file;
+	size_t offset;
+	char append;
+};
+
+static struct model_file files[FUZZ_FILES];
+static struct model_fd fds[FUZZ_FDS];
+static int open_fds;
+
+/* File taking the lowest data blocks of a wide disk, never touched by ops */
+static struct model_file ballast = { .name = "fuzz.ballast" };
+
+/* The one snapshot the model keeps, taken again and again */
+#define SNAPSHOT_NAME "fuzz.snap"
+static char snapshot_taken;
+
+/* Largest size the model lets a file reach, so that the disk never fills up */
+static size_t max_file_size;
+
+/* First size past what a file can have, with its 32-bit size */
+#define FUZZ_SIZE_LIMIT ((size_t)UINT32_MAX + 1)
+
+/* Data block size of the current run's disk, and how it was formatted */
+static size_t cluster_size;
+static char format_desc[128];
+
+static uint64_t rand_state;
+
+uint64_t fuzz_rand(void)
+{
+	/* xorshift64*, so that runs only depend on their seed */
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 2685821657736338717ULL;
+}
+
+size_t fuzz_range(size_t n)
+{
+	return n ? fuzz_rand() % n : 0;
+}
+
+void model_resize(struct model_file *f, size_t size)
+{
+	f->data = realloc(f->data, size ? size : 1);
+	if (!f->data)
+		die_perror("realloc");
+	if (size > f->size)
+		memset(f->data + f->size, 0, size - f->size);
+	f->size = size;
+}
+
+void model_reset(void)
+{
+	int i;
+
+	for (i = 0; i < FUZZ_FILES; i++) {
+		free(files[i].data);
+		free(files[i].durable_data);
+		free(files[i].snapshot_data);
+		memset(&files[i], 0, sizeof(files[i]));
+		snprintf(files[i].name, FS_FILENAME_LEN, "fuzz.%d", i);
+	}
+	open_fds = 0;
+	snapshot_taken = 0;
+}
+
+/* Everything currently in the model is now on disk */
+void model_make_durable(void)
+{
+	struct model_file *f;
+	int i;
+
+	for (i = 0; i < FUZZ_FILES; i++) {
+		f = &files[i];
+		f->durable_exists = f->exists;
+		f->durable_size = f->size;
+		f->durable_data = realloc(f->durable_data, f->size ? f->size : 1);
+		if (!f->durable_data)
+			die_perror("realloc");
+		if (f->exists)
+			memcpy(f->durable_data, f->data, f->size);
+		f->dirty = 0;
+	}
+}
+
+/* Everything currently in the model is now in the snapshot */
+void model_snapshot(void)
+{
+	struct model_file *f;
+	int i;
+
+	for (i = 0; i < FUZZ_FILES; i++) {
+		f = &files[i];
+		f->snapshot_exists = f->exists;
+		f->snapshot_size = f->size;
+		f->snapshot_data = realloc(f->snapshot_data, f->size ? f->size : 1);
+		if (!f->snapshot_data)
+			die_perror("realloc");
+		if (f->exists)
+			memcpy(f->snapshot_data, f->data, f->size);
+	}
+	snapshot_taken = 1;
+}
+
+int model_is_open(int file)
+{
+	int i;
+
+	for (i = 0; i < open_fds; i++)
+		if (fds[i].file == file)
+			return 1;
+	return 0;
+}
+
+/*
+ * Operations and their cost
+ */
+enum fuzz_opcode {
+	FUZZ_CREATE,
+	FUZZ_DELETE,
+	FUZZ_COPY,
+	FUZZ_CLONE,
+	FUZZ_OPEN,
+	FUZZ_CLOSE,
+	FUZZ_WRITE,
+	FUZZ_APPENDS,
+	FUZZ_READ,
+	FUZZ_SENDFILE,
+	FUZZ_RECVFILE,
+	FUZZ_MMAP,
+	FUZZ_SEEK,
+	FUZZ_STAT,
+	FUZZ_TRUNCATE,
+	FUZZ_FALLOCATE,
+	FUZZ_SETFLAGS,
+	FUZZ_SYNC,
+	FUZZ_REMOUNT,
+	FUZZ_SNAPSHOT,
+	FUZZ_SNAPCHECK,
+	FUZZ_OPS,
+};
+
+static const struct {
+	const char *name;
+	int weight;
+} fuzz_ops[FUZZ_OPS] = {
+	{ "create",		4 },
+	{ "delete",		2 },
+	{ "copy",		1 },
+	{ "clone",		2 },
+	{ "open",		4 },
+	{ "close",		3 },
+	{ "write",		12 },
+	{ "appends",	2 },
+	{ "read",		10 },
+	{ "sendfile",	3 },
+	{ "recvfile",	3 },
+	{ "mmap",		2 },
+	{ "seek",		5 },
+	{ "stat",		2 },
+	{ "truncate",	2 },
+	{ "fallocate",	1 },
+	{ "setflags",	1 },
+	{ "sync",		1 },
+	{ "remount",	1 },
+	{ "snapshot",	1 },
+	{ "snapcheck",	1 },
+};
+
+static struct {
+	long count;
+	long long ns;
+	long reads;
+	long writes;
+} op_cost[FUZZ_OPS];
+
+static char *io_buf;
+
+/* Host file fs_sendfile() and fs_recvfile() copy to and from */
+static int host_fd;
+/* Lowest free descriptor while unmounted, which fs_umount() must restore */
+static int fd_floor;
+static long divergences;
+static long op_index;
+
+/* Past a crash, libfs runs on a disk that lost writes and nothing holds */
+#define diverge(fmt, ...)											\
+do {																\
+	if (!crashed) {													\
+		fprintf(stderr, "op %ld (%s): "fmt"\n", op_index, op_name,	\
+				##__VA_ARGS__);										\
+		divergences++;												\
+	}																\
+	return -1;														\
+} while (0)
+
+/* Read a whole file back through libfs and compare it with @data */
+int check_file(const char *op_name, struct model_file *f, const char *data,
+			   size_t size)
+{
+	int fs_fd, ret;
+	size_t done;
+	char *buf;
+
+	fs_fd = fs_open(f->name);
+	if (fs_fd < 0)
+		diverge("cannot open '%s'", f->name);
+	ret = fs_stat(fs_fd);
+	if (ret != (int)size) {
+		fs_close(fs_fd);
+		diverge("'%s' is %d bytes instead of %zu", f->name, ret, size);
+	}
+
+	buf = malloc(size ? size : 1);
+	if (!buf)
+		die_perror("malloc");
+	done = 0;
+	while (done < size) {
+		ret = fs_read(fs_fd, buf + done, size - done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	fs_close(fs_fd);
+
+	ret = done != size || (size && memcmp(buf, data, size));
+	free(buf);
+	if (ret)
+		diverge("content of '%s' differs", f->name);
+	return 0;
+}
+
+int check_all_files(const char *op_name, int snapshot)
+{
+	struct model_file *f;
+	int i, fs_fd;
+
+	for (i = 0; i < FUZZ_FILES; i++) {
+		f = &files[i];
+		if (snapshot ? f->snapshot_exists : f->exists) {
+			if (snapshot && check_file(op_name, f, f->snapshot_data,
+									   f->snapshot_size))
+				return -1;
+			if (!snapshot && check_file(op_name, f, f->data, f->size))
+				return -1;
+		} else {
+			fs_fd = fs_open(f->name);
+			if (fs_fd >= 0) {
+				fs_close(fs_fd);
+				diverge("deleted file '%s' can be opened", f->name);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write random bytes into @f through a descriptor of its own, right after it
+ * was copied or cloned from or into @other, then check that @other didn't
+ * change with it. @other is NULL when @f was just snapshotted instead.
+ */
+int write_apart(const char *op_name, struct model_file *f,
+				struct model_file *other)
+{
+	size_t pos, len, i;
+	int fs_fd, ret;
+
+	pos = fuzz_range(f->size + 1);
+	len = 1 + fuzz_range(2 * cluster_size);
+	if (pos + len > max_file_size)
+		len = max_file_size - pos;
+	for (i = 0; i < len; i++)
+		io_buf[i] = fuzz_range(3) ? 0 : fuzz_rand();
+
+	f->dirty = 1;
+	fs_fd = fs_open(f->name);
+	if (fs_fd < 0)
+		diverge("cannot open '%s'", f->name);
+	ret = fs_lseek(fs_fd, pos) ? -1 : fs_write(fs_fd, io_buf, len);
+	fs_close(fs_fd);
+	if (ret != (int)len)
+		diverge("wrote %d bytes into '%s' instead of %zu", ret, f->name, len);
+	if (pos + len > f->size)
+		model_resize(f, pos + len);
+	memcpy(f->data + pos, io_buf, len);
+
+	if (other && check_file(op_name, other, other->data, other->size))
+		return -1;
+	return check_file(op_name, f, f->data, f->size);
+}
+
+int close_all_fds(const char *op_name)
+{
+	while (open_fds) {
+		if (fs_close(fds[--open_fds].fs_fd))
+			diverge("cannot close fd %d", fds[open_fds].fs_fd);
+	}
+	return 0;
+}
+
+/* Pick an operation, and run it on both libfs and the model */
+int run_op(void)
+{
+	int total = 0, pick, i, ret, expected, append;
+	enum fuzz_opcode op;
+	const char *op_name;
+	struct model_file *f, *g;
+	struct model_fd *d;
+	const void *view;
+	size_t len, pos;
+	int appenders[2];
+
+	for (i = 0; i < FUZZ_OPS; i++)
+		total += fuzz_ops[i].weight;
+	pick = fuzz_range(total);
+	for (op = 0; pick >= fuzz_ops[op].weight; op++)
+		pick -= fuzz_ops[op].weight;
+
+	/* Operations on a descriptor need one */
+	if (op >= FUZZ_CLOSE && op <= FUZZ_SETFLAGS && !open_fds)
+		op = FUZZ_OPEN;
+	if (op == FUZZ_OPEN && open_fds == FUZZ_FDS)
+		op = FUZZ_CLOSE;
+	op_name = fuzz_ops[op].name;
+
+	f = &files[fuzz_range(FUZZ_FILES)];
+	d = open_fds ? &fds[fuzz_range(open_fds)] : NULL;
+	if (d && op != FUZZ_OPEN && op != FUZZ_CREATE && op != FUZZ_DELETE)
+		f = &files[d->file];
+
+	/*
+	 * Past the crash point, a call can fail after some of its writes went
+	 * through, so files are marked as changed before rather than after
+	 */
+	switch (op) {
+	case FUZZ_CREATE:
+		expected = f->exists ? -1 : 0;
+		f->dirty = 1;
+		ret = fs_create(f->name);
+		if (ret != expected)
+			diverge("'%s' returned %d instead of %d", f->name, ret, expected);
+		if (!ret) {
+			f->exists = 1;
+			model_resize(f, 0);
+		}
+		break;
+
+	case FUZZ_DELETE:
+		expected = f->exists && !model_is_open(f - files) ? 0 : -1;
+		f->dirty = 1;
+		ret = fs_delete(f->name);
+		if (ret != expected)
+			diverge("'%s' returned %d instead of %d", f->name, ret, expected);
+		if (!ret)
+			f->exists = 0;
+		break;
+
+	/* Out of @f, open or not, into a file of the model that may not exist */
+	case FUZZ_COPY:
+	case FUZZ_CLONE:
+		g = &files[fuzz_range(FUZZ_FILES)];
+		expected = f->exists && !g->exists ? 0 : -1;
+		g->dirty = 1;
+		if (op == FUZZ_COPY)
+			ret = fs_copy(f->name, g->name);
+		else
+			ret = fs_clone(f->name, g->name);
+		if (ret != expected)
+			diverge("'%s' to '%s' returned %d instead of %d", f->name,
+					g->name, ret, expected);
+		if (ret)
+			break;
+		g->exists = 1;
+		model_resize(g, 0);
+		model_resize(g, f->size);
+		memcpy(g->data, f->data, f->size);
+
+		/* Either file then gets a write the other one must not see */
+		if (fuzz_range(2) ? write_apart(op_name, g, f) :
+			write_apart(op_name, f, g))
+			return -1;
+		break;
+
+	case FUZZ_OPEN:
+		/* Some fds append, wherever their offset is */
+		append = !fuzz_range(4);
+		ret = append ? fs_open_flags(f->name, FS_OPEN_APPEND) : fs_open(f->name);
+		if ((ret >= 0) != f->exists)
+			diverge("'%s' returned %d", f->name, ret);
+		if (ret >= 0) {
+			d = &fds[open_fds++];
+			d->fs_fd = ret;
+			d->file = f - files;
+			d->offset = 0;
+			d->append = append;
+		}
+		break;
+
+	case FUZZ_CLOSE:
+		ret = fs_close(d->fs_fd);
+		if (ret)
+			diverge("fd %d returned %d", d->fs_fd, ret);
+		*d = fds[--open_fds];
+		break;
+
+	case FUZZ_WRITE:
+		/* Now and then ending past what a file can have, which writes nothing */
+		if (!d->append && !fuzz_range(32)) {
+			pos = FUZZ_SIZE_LIMIT - fuzz_range(2);
+			if (fs_lseek(d->fs_fd, pos))
+				diverge("cannot seek fd %d", d->fs_fd);
+			ret = fs_write(d->fs_fd, io_buf, 2);
+			if (ret)
+				diverge("at %zu wrote %d bytes instead of 0", pos, ret);
+			if (fs_lseek(d->fs_fd, d->offset))
+				diverge("cannot seek fd %d", d->fs_fd);
+			break;
+		}
+		if (d->append)
+			d->offset = f->size;
+		else if (d->offset >= max_file_size)
+			d->offset = fuzz_range(f->size + 1);
+		if (fs_lseek(d->fs_fd, d->offset))
+			diverge("cannot seek fd %d", d->fs_fd);
+
+		/* Mostly small writes, some spanning several blocks */
+		len = fuzz_range(4) ? 1 + fuzz_range(512) : 1 + fuzz_range(3 * cluster_size);
+		if (d->offset + len > max_file_size)
+			len = max_file_size - d->offset;
+		for (pos = 0; pos < len; pos++)
+			io_buf[pos] = fuzz_range(3) ? 0 : fuzz_rand();
+
+		f->dirty = 1;
+		ret = fs_write(d->fs_fd, io_buf, len);
+		if (ret != (int)len)
+			diverge("wrote %d bytes instead of %zu", ret, len);
+		if (d->offset + len > f->size)
+			model_resize(f, d->offset + len);
+		memcpy(f->data + d->offset, io_buf, len);
+		d->offset += len;
+		break;
+
+	/*
+	 * Two more appenders take turns with writes small enough to stay
+	 * buffered, so each must land past the bytes the other one holds
+	 */
+	case FUZZ_APPENDS:
+		appenders[0] = fs_open_flags(f->name, FS_OPEN_APPEND);
+		appenders[1] = fs_open_flags(f->name, FS_OPEN_APPEND);
+		if (appenders[0] < 0 || appenders[1] < 0) {
+			fs_close(appenders[0]);
+			fs_close(appenders[1]);
+			diverge("cannot open '%s' twice more", f->name);
+		}
+
+		f->dirty = 1;
+		for (i = 1 + fuzz_range(8); i > 0; i--) {
+			len = 1 + fuzz_range(256);
+			if (f->size + len > max_file_size)
+				len = max_file_size - f->size;
+			for (pos = 0; pos < len; pos++)
+				io_buf[pos] = fuzz_rand();
+			ret = fs_write(appenders[fuzz_range(2)], io_buf, len);
+			if (ret != (int)len) {
+				fs_close(appenders[0]);
+				fs_close(appenders[1]);
+				diverge("appended %d bytes instead of %zu", ret, len);
+			}
+			model_resize(f, f->size + len);
+			memcpy(f->data + f->size - len, io_buf, len);
+		}
+
+		/* Read back while they still hold what they buffered */
+		ret = check_file(op_name, f, f->data, f->size);
+		fs_close(appenders[0]);
+		fs_close(appenders[1]);
+		if (ret)
+			return -1;
+		break;
+
+	case FUZZ_READ:
+		len = 1 + fuzz_range(3 * cluster_size);
+		expected = d->offset < f->size ? f->size - d->offset : 0;
+		if ((size_t)expected > len)
+			expected = len;
+
+		ret = fs_read(d->fs_fd, io_buf, len);
+		if (ret != expected)
+			diverge("read %d bytes instead of %d", ret, expected);
+		if (memcmp(io_buf, f->data + d->offset, ret))
+			diverge("read unexpected data at offset %zu", d->offset);
+		d->offset += ret;
+		break;
+
+	case FUZZ_SENDFILE:
+		pos = fuzz_range(f->size + cluster_size);
+		len = 1 + fuzz_range(3 * cluster_size);
+		expected = pos < f->size ? f->size - pos : 0;
+		if ((size_t)expected > len)
+			expected = len;
+
+		if (ftruncate(host_fd, 0) || lseek(host_fd, 0, SEEK_SET))
+			die_perror("ftruncate");
+		ret = fs_sendfile(d->fs_fd, host_fd, pos, len);
+		if (ret != expected)
+			diverge("sent %d bytes instead of %d", ret, expected);
+		if (pread(host_fd, io_buf, ret, 0) != ret ||
+			memcmp(io_buf, f->data + pos, ret))
+			diverge("sent unexpected data from offset %zu", pos);
+		break;
+
+	case FUZZ_RECVFILE:
+		pos = fuzz_range(f->size + cluster_size);
+		if (pos > max_file_size)
+			pos = max_file_size;
+		len = 1 + fuzz_range(3 * cluster_size);
+		if (pos + len > max_file_size)
+			len = max_file_size - pos;
+		for (i = 0; i < (int)len; i++)
+			io_buf[i] = fuzz_range(3) ? 0 : fuzz_rand();
+
+		if (ftruncate(host_fd, 0) || pwrite(host_fd, io_buf, len, 0) != (ssize_t)len ||
+			lseek(host_fd, 0, SEEK_SET))
+			die_perror("pwrite");
+		f->dirty = 1;
+		ret = fs_recvfile(d->fs_fd, host_fd, pos, len);
+		if (ret != (int)len)
+			diverge("received %d bytes instead of %zu", ret, len);
+		if (len && pos + len > f->size)
+			model_resize(f, pos + len);
+		memcpy(f->data + pos, io_buf, len);
+		break;
+
+	/* Holes, chains and indexes all get mapped, and fs_read() must agree */
+	case FUZZ_MMAP:
+		ret = fs_mmap(d->fs_fd, &view);
+		if (ret != (int)f->size) {
+			if (ret > 0)
+				fs_munmap(view, ret);
+			diverge("mapped %d bytes instead of %zu", ret, f->size);
+		}
+		if (ret && memcmp(view, f->data, f->size)) {
+			fs_munmap(view, ret);
+			diverge("mapped unexpected data");
+		}
+		ret = check_file(op_name, f, view, f->size);
+		if (f->size && fs_munmap(view, f->size))
+			diverge("cannot unmap %zu bytes", f->size);
+		if (ret)
+			return -1;
+		break;
+
+	case FUZZ_SEEK:
+		pos = fuzz_range(f->size + 2 * cluster_size);
+		if (pos > max_file_size)
+			pos = max_file_size;
+		ret = fs_lseek(d->fs_fd, pos);
+		if (ret)
+			diverge("fd %d returned %d", d->fs_fd, ret);
+		d->offset = pos;
+		break;
+
+	case FUZZ_STAT:
+		ret = fs_stat(d->fs_fd);
+		if (ret != (int)f->size)
+			diverge("returned %d instead of %zu", ret, f->size);
+		break;
+
+	case FUZZ_TRUNCATE:
+		len = fuzz_range(f->size * 2 + cluster_size);
+		if (len > max_file_size)
+			len = max_file_size;
+		/* Now and then past what a file can have, which must change nothing */
+		if (!fuzz_range(16)) {
+			ret = fs_truncate(d->fs_fd, FUZZ_SIZE_LIMIT + len);
+			if (ret != -1)
+				diverge("to %zu bytes returned %d", FUZZ_SIZE_LIMIT + len, ret);
+			break;
+		}
+		f->dirty = 1;
+		ret = fs_truncate(d->fs_fd, len);
+		if (ret)
+			diverge("to %zu bytes returned %d", len, ret);
+		model_resize(f, len);
+		break;
+
+	case FUZZ_FALLOCATE:
+		len = fuzz_range(max_file_size);
+		if (!fuzz_range(16)) {
+			ret = fs_fallocate(d->fs_fd, FUZZ_SIZE_LIMIT + len);
+			if (ret != -1)
+				diverge("of %zu bytes returned %d", FUZZ_SIZE_LIMIT + len, ret);
+			break;
+		}
+		f->dirty = 1;
+		ret = fs_fallocate(d->fs_fd, len);
+		if (ret)
+			diverge("of %zu bytes returned %d", len, ret);
+		break;
+
+	case FUZZ_SETFLAGS:
+		f->dirty = 1;
+		ret = fs_setflags(d->fs_fd, fuzz_range(FS_FLAG_MASK + 1));
+		if (ret)
+			diverge("returned %d", ret);
+		break;
+
+	case FUZZ_SYNC:
+		ret = fs_sync();
+		if (ret)
+			diverge("returned %d", ret);
+		if (!crashed)
+			model_make_durable();
+		break;
+
+	case FUZZ_REMOUNT:
+		if (close_all_fds(op_name))
+			return -1;
+		if (fs_umount() || fs_mount(image_path))
+			diverge("cannot remount");
+		if (!crashed)
+			model_make_durable();
+		if (check_all_files(op_name, 0))
+			return -1;
+		break;
+
+	case FUZZ_SNAPSHOT:
+		expected = snapshot_taken ? 0 : -1;
+		ret = fs_snapshot_delete(SNAPSHOT_NAME);
+		if (ret != expected)
+			diverge("deleting returned %d instead of %d", ret, expected);
+		snapshot_taken = 0;
+		ret = fs_snapshot(SNAPSHOT_NAME);
+		if (ret)
+			diverge("returned %d", ret);
+		model_snapshot();
+
+		/*
+		 * Overwriting a file right away must give it new blocks, and the
+		 * snapshot must still read as taken from the remounted disk
+		 */
+		f = &files[fuzz_range(FUZZ_FILES)];
+		if (!f->exists || !f->size)
+			break;
+		if (write_apart(op_name, f, NULL))
+			return -1;
+		/* fall through */
+	case FUZZ_SNAPCHECK:
+		if (!snapshot_taken)
+			break;
+		if (close_all_fds(op_name))
+			return -1;
+		if (fs_umount() || fs_snapshot_mount(image_path, SNAPSHOT_NAME))
+			diverge("cannot mount the snapshot");
+		if (!crashed)
+			model_make_durable();
+		ret = check_all_files(op_name, 1);
+		if (!ret && fs_create(files[0].name) != -1)
+			diverge("could create '%s' in the snapshot", files[0].name);
+		if (fs_umount() || fs_mount(image_path))
+			diverge("cannot remount");
+		if (ret || check_all_files(op_name, 0))
+			return -1;
+		break;
+
+	default:
+		break;
+	}
+
+	return op;
+}
+
+/*
+ * Number of bytes a new file can grow to, which is how much free space the
+ * disk has in whole blocks. The file is deleted afterwards.
+ */
+long measure_capacity(void)
+{
+	long total = 0;
+	int fs_fd, ret;
+
+	memset(io_buf, 0xa5, BLOCK_SIZE);
+	if (fs_create("fuzz.fill"))
+		return -1;
+	fs_fd = fs_open("fuzz.fill");
+	if (fs_fd < 0)
+		return -1;
+	do {
+		ret = fs_write(fs_fd, io_buf, BLOCK_SIZE);
+		if (ret > 0)
+			total += ret;
+	} while (ret == BLOCK_SIZE);
+	fs_close(fs_fd);
+	if (fs_delete("fuzz.fill"))
+		return -1;
+
+	return total;
+}
+
+/* Write the ballast file, @size bytes of a pattern, to the mounted disk */
+void write_ballast(size_t size)
+{
+	size_t i;
+	int fs_fd;
+
+	ballast.data = realloc(ballast.data, size);
+	if (!ballast.data)
+		die_perror("realloc");
+	for (i = 0; i < size; i++)
+		ballast.data[i] = (char)(i / BLOCK_SIZE * 31 + i);
+	ballast.size = size;
+
+	if (fs_create(ballast.name))
+		die("Cannot create '%s' on %s", ballast.name, format_desc);
+	fs_fd = fs_open(ballast.name);
+	if (fs_fd < 0 || fs_write(fs_fd, ballast.data, size) != (int)size
+		|| fs_close(fs_fd))
+		die("Cannot write '%s' on %s", ballast.name, format_desc);
+}
+
+/*
+ * Format a fresh image with a geometry picked from @seed, and keep a copy of
+ * it for play() to start from. Returns how many bytes a new file can grow to.
+ */
+long format_image(uint64_t seed)
+{
+	size_t data_blocks, max_files;
+	long capacity;
+	int flags, wide;
+
+	rand_state = seed ? seed : 1;
+	cluster_size = BLOCK_SIZE << fuzz_range(5);
+	flags = fuzz_range((FS_FORMAT_EXTENTS | FS_FORMAT_INLINE |
+						FS_FORMAT_CHECKSUMS) + 1);
+	max_files = FS_FILE_MAX_COUNT << fuzz_range(3);
+	/* Files take whole data blocks, so there are always plenty of those */
+	data_blocks = 8 * FUZZ_FILES + fuzz_range(2048 * BLOCK_SIZE / cluster_size);
+
+	/*
+	 * One run in four gets a disk several FAT blocks long, version 1 unless
+	 * inline data was picked. A ballast file takes its lower half up front,
+	 * so that files get blocks whose FAT entries are past the first FAT
+	 * block.
+	 */
+	wide = !fuzz_range(4);
+	if (wide) {
+		cluster_size = BLOCK_SIZE;
+		max_files = FS_FILE_MAX_COUNT;
+		data_blocks = 2 * 2048 + fuzz_range(4 * 2048);
+	}
+
+	snprintf(format_desc, sizeof(format_desc),
+			 "%zu blocks of %zu bytes, %zu files%s%s%s%s", data_blocks,
+			 cluster_size, max_files,
+			 flags & FS_FORMAT_EXTENTS ? ", extents" : "",
+			 flags & FS_FORMAT_INLINE ? ", inline" : "",
+			 flags & FS_FORMAT_CHECKSUMS ? ", checksums" : "",
+			 wide ? ", ballast" : "");
+	if (fs_format(image_path, data_blocks, cluster_size, max_files, flags))
+		die("Cannot format %s", format_desc);
+
+	ballast.size = 0;
+	if (wide) {
+		if (fs_mount(image_path))
+			die("Cannot mount %s", format_desc);
+		write_ballast(data_blocks / 2 * BLOCK_SIZE);
+		if (fs_umount())
+			die("Cannot unmount %s", format_desc);
+	}
+
+	pristine_image = realloc(pristine_image, disk_blocks * BLOCK_SIZE);
+	if (!pristine_image)
+		die_perror("realloc");
+	memcpy(pristine_image, disk_image, disk_blocks * BLOCK_SIZE);
+
+	if (fs_mount(image_path))
+		die("Cannot mount %s", format_desc);
+	capacity = measure_capacity();
+	fs_umount();
+	if (capacity < 64 * BLOCK_SIZE)
+		die("Need at least 64 free data blocks on %s", format_desc);
+
+	/* Room for every file twice over, as the snapshot may hold all of it */
+	max_file_size = capacity / (4 * FUZZ_FILES);
+
+	return capacity;
+}
+
+/*
+ * Play @ops random operations seeded with @seed. Returns the number of block
+ * writes issued, or -1 if libfs diverged from the model.
+ */
+long play(uint64_t seed, int ops)
+{
+	struct timespec start, end;
+	long reads, writes, total_writes;
+	int op;
+
+	memcpy(disk_image, pristine_image, disk_blocks * BLOCK_SIZE);
+	rand_state = seed ? seed : 1;
+	model_reset();
+	total_writes = block_writes;
+
+	if (fs_mount(image_path))
+		die("Cannot mount disk");
+	model_make_durable();
+
+	for (op_index = 0; op_index < ops && !crashed; op_index++) {
+		reads = block_reads;
+		writes = block_writes;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		op = run_op();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (op < 0) {
+			fs_umount();
+			return -1;
+		}
+
+		/* Costs only mean something while every write goes through */
+		if (writes_left < 0) {
+			op_cost[op].count++;
+			op_cost[op].ns += (end.tv_sec - start.tv_sec) * 1000000000LL
+				+ (end.tv_nsec - start.tv_nsec);
+			op_cost[op].reads += block_reads - reads;
+			op_cost[op].writes += block_writes - writes;
+		}
+	}
+
+	if (!crashed) {
+		if (close_all_fds("end") || check_all_files("end", 0)) {
+			fs_umount();
+			return -1;
+		}
+	}
+	fs_umount();
+
+	return block_writes - total_writes;
+}
+
+/*
+ * With every file and the snapshot deleted, the disk must have exactly the
+ * free space it had when formatted: no block leaked or handed out twice.
+ * Only holds for a run that didn't crash.
+ */
+int check_capacity(long capacity)
+{
+	const char *op_name = "capacity";
+	long now;
+	int i;
+
+	if (fs_mount(image_path))
+		diverge("cannot mount the disk again");
+	if (ballast.size && check_file(op_name, &ballast, ballast.data,
+								   ballast.size)) {
+		fs_umount();
+		return -1;
+	}
+	for (i = 0; i < FUZZ_FILES; i++)
+		fs_delete(files[i].name);
+	fs_snapshot_delete(SNAPSHOT_NAME);
+	now = measure_capacity();
+	fs_umount();
+	if (now != capacity)
+		diverge("%ld bytes free instead of %ld", now, capacity);
+
+	return 0;
+}
+
+/* Descriptor number the next open() gets */
+int lowest_free_fd(void)
+{
+	int fd = open("/dev/null", O_RDONLY);
+
+	if (fd < 0)
+		die_perror("open");
+	close(fd);
+	return fd;
+}
+
+/*
+ * After a crash, the disk must still mount, every file must be readable, and
+ * files that weren't touched since the last sync must be intact
+ */
+int check_recovery(long *leaked, long capacity)
+{
+	const char *op_name = "recovery";
+	struct model_file *f;
+	long now;
+	int i, fs_fd, ret;
+
+	if (fs_mount(image_path))
+		diverge("cannot mount the disk again");
+
+	for (i = 0; i < FUZZ_FILES; i++) {
+		f = &files[i];
+		if (!f->dirty) {
+			if (!f->durable_exists) {
+				fs_fd = fs_open(f->name);
+				if (fs_fd >= 0) {
+					fs_close(fs_fd);
+					fs_umount();
+					diverge("'%s' appeared", f->name);
+				}
+			} else if (check_file(op_name, f, f->durable_data,
+								  f->durable_size)) {
+				fs_umount();
+				return -1;
+			}
+			continue;
+		}
+
+		/* Either version is fine, as long as it reads back in full */
+		fs_fd = fs_open(f->name);
+		if (fs_fd < 0)
+			continue;
+		ret = fs_stat(fs_fd);
+		while (ret > 0) {
+			int got = fs_read(fs_fd, io_buf, 3 * BLOCK_SIZE);
+			if (got <= 0)
+				break;
+			ret -= got;
+		}
+		fs_close(fs_fd);
+		if (ret) {
+			fs_umount();
+			diverge("'%s' cannot be read in full", f->name);
+		}
+	}
+
+	/* The ballast was written before the run, so nothing may touch it */
+	if (ballast.size && check_file(op_name, &ballast, ballast.data,
+								   ballast.size)) {
+		fs_umount();
+		return -1;
+	}
+
+	/* Blocks whose allocation was lost with the crash are fine, just counted */
+	for (i = 0; i < FUZZ_FILES; i++)
+		fs_delete(files[i].name);
+	fs_snapshot_delete(SNAPSHOT_NAME);
+	now = measure_capacity();
+	fs_umount();
+	if (now < 0)
+		diverge("cannot use the disk anymore");
+	if (lowest_free_fd() != fd_floor)
+		diverge("descriptor %d still open after fs_umount()", fd_floor);
+	*leaked += (capacity - now) / BLOCK_SIZE;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	long capacity, writes, leaked = 0;
+	int runs, ops, run, i;
+	uint64_t seed;
+
+	if (argc > 4) {
+		fprintf(stderr, "Usage: %s [<runs> [<ops per run> [<seed>]]]\n",
+				argv[0]);
+		exit(1);
+	}
+
+	runs = argc > 1 ? atoi(argv[1]) : 100;
+	ops = argc > 2 ? atoi(argv[2]) : 1000;
+	seed = argc > 3 ? strtoull(argv[3], NULL, 0) : (uint64_t)time(NULL);
+
+	create_image();
+	host_fd = memfd_create("fuzz.host", 0);
+	if (host_fd < 0)
+		die_perror("memfd_create");
+	io_buf = malloc(3 * FUZZ_BLOCK_SIZE_MAX);
+	if (!io_buf)
+		die_perror("malloc");
+	fd_floor = lowest_free_fd();
+
+	printf("seed %llu, %d runs of %d ops\n", (unsigned long long)seed, runs,
+		   ops);
+
+	for (run = 0; run < runs; run++) {
+		capacity = format_image(seed + run);
+		writes = play(seed + run, ops);
+		if (writes < 0) {
+			fprintf(stderr, "run %d diverged on %s, replay with seed %llu\n",
+					run, format_desc, (unsigned long long)(seed + run));
+			continue;
+		}
+		if (check_capacity(capacity)) {
+			fprintf(stderr, "run %d lost free space on %s, replay with seed "
+					"%llu\n", run, format_desc,
+					(unsigned long long)(seed + run));
+			continue;
+		}
+
+		/* Same sequence again, losing every write after a random one */
+		writes_left = fuzz_range(writes);
+		crashed = 0;
+		play(seed + run, ops);
+		writes_left = -1;
+		crashed = 0;
+		if (check_recovery(&leaked, capacity))
+			fprintf(stderr, "run %d did not recover on %s, replay with seed "
+					"%llu\n", run, format_desc,
+					(unsigned long long)(seed + run));
+	}
+
+	printf("%-10s %8s %10s %10s %10s\n", "op", "count", "avg(us)", "reads",
+		   "writes");
+	for (i = 0; i < FUZZ_OPS; i++) {
+		if (!op_cost[i].count)
+			continue;
+		printf("%-10s %8ld %10.2f %10.2f %10.2f\n", fuzz_ops[i].name,
+			   op_cost[i].count, op_cost[i].ns / 1e3 / op_cost[i].count,
+			   (double)op_cost[i].reads / op_cost[i].count,
+			   (double)op_cost[i].writes / op_cost[i].count);
+	}
+	printf("%ld blocks leaked by crashes\n", leaked);
+	printf("%ld divergences\n", divergences);
+
+	model_reset();
+	free(io_buf);
+	close(host_fd);
+	destroy_image();
+
+	return divergences ? 1 : 0;
+}
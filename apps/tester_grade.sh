@@ -284,6 +284,230 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+#
+# Formats
+#
+
+# version 2 format (32-bit FAT) for more files than the original one holds
+format_v2() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./test_fs.x format test.fs 100 4096 256
+    run_tool dd if=/dev/urandom of=test-file-1 bs=2048 count=5
+    run_tool ./test_fs.x add test.fs test-file-1
+
+    run_test ./test_fs.x info test.fs
+    rm -f test.fs test-file-1
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "6")")
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    line_array+=("$(select_line "${STDOUT}" "8")")
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    local corr_array=()
+    corr_array+=("data_blk_count=100")
+    corr_array+=("fat_free_ratio=96/100")
+    corr_array+=("rdir_free_ratio=255/256")
+    corr_array+=("data_blk_size=4096")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# write and read back across 16 KiB data blocks
+format_large_blocks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./test_fs.x format test.fs 50 16384
+    python3 -c "for i in range(20000): print('ab', end='')" > test-file-1
+
+    local line_array=()
+    local corr_array=()
+
+    cat <<END_SCRIPT > large_blocks.script
+MOUNT
+CREATE	test-file-1
+OPEN	test-file-1
+WRITE	FILE	test-file-1
+SEEK	0
+READ	40000	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs large_blocks.script
+
+    line_array+=("$(select_line "${STDOUT}" "6")")
+    corr_array+=("Read 40000 bytes from file. Compared 40000 correct.")
+
+    run_test ./test_fs.x info test.fs
+
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    corr_array+=("fat_free_ratio=46/50")
+    line_array+=("$(select_line "${STDOUT}" "9")")
+    corr_array+=("data_blk_size=16384")
+
+    rm -f test.fs test-file-1 large_blocks.script
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# original format with 3 FAT blocks, filled well past the first one
+format_v1_large() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./test_fs.x format test.fs 6000
+    python3 -c "print('a' * 12287999)" > test-file-1
+    python3 -c "print('b' * 7999999)" > test-file-2
+    run_tool ./test_fs.x add test.fs test-file-1 test-file-2
+
+    local line_array=()
+    local corr_array=()
+
+    cat <<END_SCRIPT > v1_large.script
+MOUNT
+OPEN	test-file-2
+READ	8000000	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs v1_large.script
+
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("Read 8000000 bytes from file. Compared 8000000 correct.")
+
+    run_test ./test_fs.x info test.fs
+
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    corr_array+=("fat_free_ratio=1045/6000")
+
+    run_tool ./test_fs.x rm test.fs test-file-1
+    run_test ./test_fs.x info test.fs
+
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    corr_array+=("fat_free_ratio=4045/6000")
+
+    rm -f test.fs test-file-1 test-file-2 v1_large.script
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# files on an extents disk each take one run of blocks, plus an extent block
+format_extents() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./test_fs.x format test.fs 100 4096 extents
+    run_tool dd if=/dev/urandom of=test-file-1 bs=4096 count=3
+    run_tool dd if=/dev/urandom of=test-file-2 bs=2500 count=2
+    run_tool ./test_fs.x add test.fs test-file-1 test-file-2
+
+    local line_array=()
+    local corr_array=()
+
+    run_test ./test_fs.x stat test.fs test-file-1
+
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("3 data blocks in 1 fragments")
+
+    run_test ./test_fs.x stat test.fs test-file-2
+
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("2 data blocks in 1 fragments")
+
+    run_test ./test_fs.x info test.fs
+
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    corr_array+=("fat_free_ratio=92/100")
+
+    rm -f test.fs test-file-1 test-file-2
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# files up to 224 bytes stay in their directory entry on an inline disk
+format_inline() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./test_fs.x format test.fs 100 4096 inline
+    run_tool dd if=/dev/urandom of=test-file-1 bs=100 count=1
+    run_tool dd if=/dev/urandom of=test-file-2 bs=300 count=1
+    run_tool ./test_fs.x add test.fs test-file-1 test-file-2
+
+    local line_array=()
+    local corr_array=()
+
+    cat <<END_SCRIPT > inline.script
+MOUNT
+OPEN	test-file-1
+READ	100	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs inline.script
+
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("Read 100 bytes from file. Compared 100 correct.")
+
+    run_test ./test_fs.x stat test.fs test-file-1
+
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    corr_array+=("0 data blocks in 0 fragments")
+
+    run_test ./test_fs.x info test.fs
+
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    corr_array+=("fat_free_ratio=98/100")
+
+    rm -f test.fs test-file-1 test-file-2 inline.script
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a data block changed behind the back of a checksums disk fails to read
+format_checksums() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./test_fs.x format test.fs 100 4096 checksums
+    python3 -c "for i in range(8192): print('a', end='')" > test-file-1
+    run_tool ./test_fs.x add test.fs test-file-1
+
+    local line_array=()
+    local corr_array=()
+
+    cat <<END_SCRIPT > checksums.script
+MOUNT
+OPEN	test-file-1
+READ	8192	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs checksums.script
+
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    corr_array+=("Read 8192 bytes from file. Compared 8192 correct.")
+
+    # Second block of the file: data block 2, after 4 metadata blocks
+    printf 'XXXX' | dd of=test.fs bs=1 seek=$((6 * 4096 + 100)) conv=notrunc 2>/dev/null
+    run_test ./test_fs.x cat test.fs test-file-1
+
+    line_array+=("$(select_line "${STDERR}" "1")")
+    corr_array+=("Short read on file 'test-file-1' (4096/8192 bytes)")
+
+    rm -f test.fs test-file-1 checksums.script
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -296,6 +520,13 @@ run_tests() {
     # Phase 3+4
     read_block
     overwrite_block
+    # Formats
+    format_v2
+    format_large_blocks
+    format_v1_large
+    format_extents
+    format_inline
+    format_checksums
 }
 
 make_fs() {
@@ -1,47 +1,384 @@
+#define _GNU_SOURCE // copy_file_range()
+
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
 
-#define FAT_EOC 0xffff
+/*
+ * In memory, FAT entries, block indexes and index block entries are always 32
+ * bits wide and FAT_EOC marks the end of a chain, whatever the on-disk format
+ * (see load_fat() and friends)
+ */
+#define FAT_EOC 0xffffffff
+#define FAT_EOC_V1 0xffff
+
+/*
+ * Superblock features. Images written by other implementations leave garbage
+ * in the rdir padding, so the flags byte of an entry only means something
+ * once FEATURE_FILE_FLAGS is set (which scrubs all entries first).
+ */
+#define FEATURE_FILE_FLAGS 0x01
+
+/*
+ * Internal file flags, next to the FS_FLAG_* ones from fs.h. An indexed file
+ * doesn't chain its data blocks through the FAT: first_data_block_index heads
+ * a FAT chain of index blocks, each mapping index_entries consecutive logical
+ * blocks to data blocks, INDEX_HOLE marking blocks that read as zeros. Its
+ * data blocks are only marked FAT_EOC in the FAT, which is how sparse files
+ * are stored.
+ */
+#define FILE_INDEXED 0x80
+#define INDEX_HOLE 0
+
+/*
+ * An extent file keeps its data blocks as runs of consecutive blocks instead:
+ * first_data_block_index heads a FAT chain of extent blocks, each holding up
+ * to cluster_size / sizeof(Extent) extents, the first zero length one ending
+ * the list. Like those of an indexed file, its data blocks are only marked
+ * FAT_EOC in the FAT, which is then nothing more than a free map for them.
+ * Extent files never have holes. FEATURE_EXTENTS makes fs_create() lay out
+ * new files this way.
+ */
+#define FILE_EXTENTS 0x40
+#define FEATURE_EXTENTS 0x02
+
+/*
+ * A directory is an rdir entry without data, which other entries name as
+ * their parent. All entries live in the one rdir whatever directory they are
+ * in; parent is only stored once file flags are enabled, so every entry of
+ * an older image is in the root.
+ */
+#define FILE_DIRECTORY 0x20
+#define PARENT_ROOT 0 // otherwise parent is the rdir entry index + 1
+
+/*
+ * A snapshot is an rdir entry with parent PARENT_SNAPSHOT, which no path
+ * leads to, whose chain holds a copy of disk blocks 1 up to the end of the
+ * rdir (the FAT and the rdir) as they were when it was taken. Every data block
+ * that copy of the FAT has allocated is frozen while the snapshot exists:
+ * never written in place nor allocated again, even once the live file system
+ * frees it. In memory, such a free block reads FAT_FROZEN, which only ever
+ * goes to disk as 0.
+ */
+#define PARENT_SNAPSHOT 0xffffffff
+#define FAT_FROZEN (FAT_EOC - 1)
+
+/*
+ * Version 2 rdir entries can be sizeof(Disk_Entry) << entry_shift bytes. An
+ * inline file keeps its data in the bytes past the Disk_Entry header rather
+ * than in data blocks, as long as it fits: first_data_block_index stays
+ * FAT_EOC and every block helper sees an empty file. The first write or
+ * truncate that doesn't fit moves the data out to a data block and clears
+ * FILE_INLINE (see spill_inline()). Bytes of the inline area past the end of
+ * file, and whole areas of free entries, are always zero. FEATURE_INLINE
+ * makes fs_create() start new files out inline.
+ */
+#define FILE_INLINE 0x10
+#define FEATURE_INLINE 0x04
+#define ENTRY_SHIFT_MAX 3
+#define INLINE_SIZE_MAX ((sizeof(Disk_Entry) << ENTRY_SHIFT_MAX) - sizeof(Disk_Entry))
+
+/*
+ * A compressed file (FS_FLAG_COMPRESS, always indexed) is handled in units of
+ * COMPRESS_UNIT consecutive logical blocks. A unit is stored as is, or, when
+ * that saves at least one block, compressed (see lz_compress()) into its
+ * first index slots, INDEX_COMPRESSED filling the others. The compressed
+ * stream starts with its length as a uint32_t. Units are rewritten whole into
+ * fresh blocks, never in place.
+ */
+#define COMPRESS_UNIT 8
+#define INDEX_COMPRESSED (FAT_EOC - 1) // 0xfffe on version 1, past any block index
+
+/*
+ * With FEATURE_CHECKSUMS, the checksum_blocks blocks right after the rdir hold
+ * a Block_Checksum for every disk block of the data area, in order. A write
+ * updates the checksum before the block, keeping the old one as previous, so
+ * that a block matching either one is intact even if a crash came in between.
+ * Only the block cache reads and writes data blocks, and it checks and
+ * updates checksums on the way (fs_copy() bypasses it, but checks them too).
+ */
+#define FEATURE_CHECKSUMS 0x08
+
+/*
+ * Version 2 images have 32-bit FAT and index entries and data blocks of
+ * BLOCK_SIZE << block_shift bytes, each stored as that many consecutive disk
+ * blocks (called a cluster here, as opposed to a BLOCK_SIZE disk block)
+ */
+#define BLOCK_SHIFT_MAX 4
+#define CLUSTER_SIZE_MAX (BLOCK_SIZE << BLOCK_SHIFT_MAX)
+
+/*
+ * Blocks moved per round by fs_copy()
+ */
+#define COPY_BATCH 32
+
+/*
+ * Data blocks mapped per round by fs_sendfile() and fs_recvfile()
+ */
+#define SENDFILE_BATCH 256
 
 #pragma pack(push, 1)
 
 typedef struct
 {
-	char signature[8];
+	char signature[8]; // "ECS150FS"
 	uint16_t total_blocks;
 	uint16_t root_directory_index;
 	uint16_t data_block_start_index;
 	uint16_t data_block_count;
 	uint8_t fat_block_count;
-	uint8_t padding[4079];
-} Superblock;
+	uint8_t features; // FEATURE_* bits, 0 on a plain ECS150FS image
+	uint8_t padding[4078];
+} Disk_Superblock;
+
+typedef struct
+{
+	char signature[8]; // "ECS150V2"
+	uint32_t total_blocks;
+	uint32_t root_directory_index;
+	uint32_t data_block_start_index;
+	uint32_t data_block_count;
+	uint32_t fat_block_count;
+	uint8_t features;
+	uint8_t block_shift; // data blocks are BLOCK_SIZE << block_shift bytes
+	uint32_t root_directory_blocks; // 0 for a single block
+	uint8_t entry_shift; // rdir entries are sizeof(Disk_Entry) << entry_shift bytes
+	uint8_t padding[4061];
+} Disk_Superblock_V2;
 
 typedef struct
 {
 	char filename[16];
 	uint32_t size;
 	uint16_t first_data_block_index;
-	uint8_t padding[10];
+	uint8_t flags; // FS_FLAG_* and FILE_* bits, only valid with FEATURE_FILE_FLAGS
+	uint16_t first_data_block_high; // version 2 only
+	uint32_t parent; // containing directory, only valid with FEATURE_FILE_FLAGS
+	uint8_t padding[3];
 
-} Root_Directory;
+} Disk_Entry;
+
+typedef struct
+{
+	uint32_t start; // first data block
+	uint32_t length; // in data blocks, 0 past the last extent
+} Extent;
+
+typedef struct
+{
+	uint32_t current; // CRC32C of the block as last written
+	uint32_t previous; // before that
+} Block_Checksum;
 
 #pragma pack(pop)
 
+#define DIR_ENTRIES_MAX (BLOCK_SIZE / sizeof(Disk_Entry)) // per rdir block
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(Block_Checksum))
+
+/*
+ * The superblock of the mounted disk, parsed once by fs_mount(). Data blocks
+ * are cluster_size bytes, cluster_blocks disk blocks each.
+ */
+typedef struct
+{
+	int version; // 1 for ECS150FS, 2 for ECS150V2, 0 if nothing is mounted
+	uint32_t total_blocks;
+	uint32_t root_directory_index;
+	uint32_t data_block_start_index;
+	uint32_t data_block_count;
+	uint32_t fat_block_count;
+	uint8_t features;
+	uint32_t cluster_blocks;
+	size_t cluster_size;
+	size_t index_entries; // entries per index block
+	uint32_t root_directory_blocks;
+	int entry_count; // rdir entries, FS_FILE_MAX_COUNT on version 1 images
+	size_t entry_size; // bytes per rdir entry
+	uint32_t entries_per_block;
+	size_t inline_size; // bytes of file data an rdir entry has room for
+	uint32_t checksum_blocks; // 0 without FEATURE_CHECKSUMS
+} Superblock;
+
+/*
+ * In-memory rdir entry, see load_dir_block()
+ */
+typedef struct
+{
+	char filename[FS_FILENAME_LEN];
+	uint32_t size;
+	uint32_t first_data_block_index;
+	uint8_t flags;
+	uint32_t parent; // PARENT_ROOT or the rdir entry index + 1 of a directory
+} Root_Directory;
+
+/*
+ * Slot of dedupTable
+ */
+typedef struct
+{
+	uint32_t hash; // CRC32C of the block's content
+	uint32_t block;
+} Dedup_Entry;
+
+#define DEDUP_PROBE 8 // slots tried per lookup
+
+static Superblock mountedSuperblock;
+
+/*
+ * Directory index, built at mount time: the name and parent of every rdir
+ * entry (empty name if the entry is free), chained into hash buckets by both
+ * so that resolving a path takes one lookup per component and never has to
+ * read the rdir. Entries go through store_entry(), which keeps it up to date.
+ */
+static char (*dirNames)[FS_FILENAME_LEN] = NULL;
+static uint32_t *dirParents = NULL; // 1-1 with dirNames
+static uint8_t *dirIsDirectory = NULL; // 1-1 with dirNames
+static int *dirChildren = NULL;	 // entries in each directory, 1-1 with dirNames
+static int *dirBuckets = NULL;	 // first entry of each bucket, -1 if none
+static int *dirNext = NULL;		 // next entry in the same bucket, 1-1 with dirNames
+static size_t dirBucketCount = 0; // a power of two
+static int dirUsed = 0;			 // entries taken
+static int dirFreeHint = 0;		 // no free entry below this one
+
+/*
+ * -1 if fd is not valid, points to rdir entry of file, else it points to the rdir index.
+ * The fd arrays start out with FS_OPEN_MAX_COUNT fds and double whenever
+ * they are all taken.
+ */
+static int *fdArray = NULL;		 // index is 1-1 with fd
+static size_t *offsetArray = NULL; // 1-1 with fdArray
+static uint8_t *appendArray = NULL; // FS_OPEN_APPEND, 1-1 with fdArray
+static int fdCount = 0;			 // size of the fd arrays
+static int openFiles = 0;		 // save computation by storing the number of files open
+
+/*
+ * Directory streams from fs_opendir(): the directory listed and the next
+ * rdir entry to look at, -1 if the stream is closed. Grown like the fd arrays.
+ */
+static uint32_t *dirStreamDir = NULL;
+static int *dirStreamNext = NULL; // 1-1 with dirStreamDir
+static int dirStreamCount = 0;
+
+/*
+ * Read-ahead state, 1-1 with fdArray. A read starting where the previous one
+ * on the same fd ended is sequential; sequential readers get a window of
+ * blocks prefetched into the block cache that doubles on every miss, random
+ * readers get none.
+ */
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 32
+static size_t *readAheadNext = NULL; // offset a sequential read would start at
+static int *readAheadWindow = NULL;	 // blocks to prefetch on the next miss
+
+/*
+ * Data block cache, keyed by disk block index. Writes go through to disk and
+ * update the cached copy, so the cache never holds dirty blocks.
+ */
+#define CACHE_BLOCK_COUNT 64
+
+typedef struct
+{
+	long block;			   // disk block index, -1 if the slot is empty
+	unsigned long lastUse; // LRU stamp
+	char data[BLOCK_SIZE];
+} Cache_Block;
+
+static Cache_Block blockCache[CACHE_BLOCK_COUNT];
+static unsigned long cacheClock = 0;
+
+/*
+ * The compressed unit load_unit() decompressed last, keyed by its first data
+ * block. cluster_write() drops it when that block gets reused.
+ */
+static char *unitCache = NULL;
+static uint32_t unitCacheBlock = INDEX_HOLE;
+
+/*
+ * Data blocks shared between indexed files by fs_clone(): number of extra
+ * references to each block, 0 if only one file owns it. Rebuilt from the
+ * index blocks at mount time, NULL while nothing is mounted.
+ */
+static uint16_t *blockShares = NULL;
+
+/*
+ * The checksum area of the mounted disk, loaded at mount time and written
+ * back a block at a time as checksums change, NULL without FEATURE_CHECKSUMS
+ */
+static Block_Checksum *blockChecksums = NULL;
+
 /*
- * -1 if fd is not valid, points to rdir entry of file, else it points to the rdir index
+ * Data blocks held by a snapshot: 1 for each block frozen by one, rebuilt at
+ * mount time and as snapshots come and go, NULL if the disk has none
  */
-static int fdArray[FS_OPEN_MAX_COUNT];		  // index is 1-1 with fd
-static size_t offsetArray[FS_OPEN_MAX_COUNT]; // 1-1 with fdArray --> all initialized to 0
-static int openFiles = 0;					  // save computation by storing the number of files open
+static uint8_t *blockFrozen = NULL;
+
+/*
+ * Where the mounted snapshot keeps its copy of each of disk blocks 1 up to the
+ * end of the rdir, NULL unless a snapshot (read-only) is mounted
+ */
+static uint32_t *snapshotMeta = NULL;
+
+/*
+ * Blocks written to FS_FLAG_DEDUP files, hashed by the CRC32C of their content
+ * into data_block_count slots probed DEDUP_PROBE at a time, and a flag per data
+ * block telling whether the table may still point at it: cleared when the
+ * block is freed or reused, so only blocks held by indexed files are ever
+ * shared. Both allocated by the first dedup write, NULL until then.
+ */
+static Dedup_Entry *dedupTable = NULL;
+static uint8_t *dedupListed = NULL;
+
+/*
+ * Second descriptor on the image file, opened by fs_mount() next to the one
+ * disk.c keeps to itself, through which fs_sendfile() and fs_recvfile() have
+ * the kernel move data blocks between the image and host files. Both go
+ * through the same page cache, so it sees every block_write() right away.
+ * -1 if the image couldn't be opened again.
+ */
+static int imageFd = -1;
+
+/*
+ * Scratch buffers for the length of a mount, so that reads and writes don't go
+ * to the heap on every call. arena_alloc() hands out ARENA_BUFFERS slots for
+ * the FAT, block maps, extent lists and compressed units: each starts out
+ * empty and grows to the largest size asked of it, up to arenaLimit bytes.
+ * arena_cluster() hands out ARENA_CLUSTERS more of arenaClusterSize bytes,
+ * allocated by fs_mount(), for one data block or one index block at a time.
+ * arena_free() takes back both kinds. Past what the slots hold, or with
+ * nothing mounted, memory comes from the heap.
+ */
+#define ARENA_BUFFERS 4
+#define ARENA_CLUSTERS 4
+static char *arenaBuffers[ARENA_BUFFERS];
+static size_t arenaSizes[ARENA_BUFFERS];
+static uint8_t arenaTaken[ARENA_BUFFERS];
+static size_t arenaLimit = 0;
+static char *arenaClusters = NULL;
+static size_t arenaClusterSize = 0;
+static uint8_t arenaClusterTaken[ARENA_CLUSTERS];
+
+/*
+ * Write buffers, 1-1 with fdArray. Writes smaller than a data block are
+ * gathered here and only go to disk once they reach a data block boundary, or
+ * when the fd is closed, seeked, read from or synced. Each is one data block,
+ * allocated by fs_open().
+ */
+static char **writeBuffer = NULL;
+static size_t *writeBufferStart = NULL; // file offset of writeBuffer[fd][0]
+static size_t *writeBufferLen = NULL;	// bytes buffered, 0 if empty
+static int *writeError = NULL;			// a flush fell short (disk full)
 
 /*
  * round from scratch
@@ -86,796 +423,6063 @@ double ceil(double x)
  */
 static int is_mounted()
 {
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	return mountedSuperblock.version ? 0 : -1;
+}
+
+/*
+ * Copy the parsed superblock of the mounted disk, -1 if nothing is mounted
+ */
+static int load_superblock(Superblock *superblock)
+{
+	if (is_mounted() < 0)
 	{
 		return -1;
 	}
+	*superblock = mountedSuperblock;
 	return 0;
 }
 
 /*
- * Count the number of rdir spots taken
+ * Like load_superblock(), but -1 as well if a snapshot is mounted, as nothing
+ * can be changed then
  */
-static int files_written()
+static int load_superblock_rw(Superblock *superblock)
 {
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
-	{
-		return -1;
-	}
-	Root_Directory rdir[128];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
-	{
-		return -1;
-	}
-	int filesWritten = 0;
-	for (int i = 0; i < 128; ++i)
+	return snapshotMeta != NULL ? -1 : load_superblock(superblock);
+}
+
+/*
+ * Read metadata block @block (superblock, FAT or rdir), from the copy kept by
+ * the snapshot if one is mounted
+ */
+static int meta_read(size_t block, void *buf)
+{
+	if (snapshotMeta != NULL && block > 0 && block < mountedSuperblock.root_directory_index + mountedSuperblock.root_directory_blocks)
 	{
-		if (rdir[i].filename[0] != 0)
-		{
-			filesWritten++;
-		}
+		block = snapshotMeta[block - 1];
 	}
+	return block_read(block, buf);
+}
 
-	return filesWritten;
+/*
+ * Write metadata block @block, which fails if a snapshot is mounted
+ */
+static int meta_write(size_t block, const void *buf)
+{
+	return snapshotMeta != NULL ? -1 : block_write(block, buf);
 }
 
 /*
- * Count the number of fat spots taken
+ * Write @superblock back to disk in its on-disk format
  */
-int fat_blocks_written()
+static int store_superblock(Superblock *superblock)
 {
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	char block[BLOCK_SIZE];
+	if (meta_read(0, block) == -1)
 	{
 		return -1;
 	}
-
-	Root_Directory rdir[128];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	if (superblock->version == 1)
 	{
-		return -1;
+		((Disk_Superblock *)block)->features = superblock->features;
 	}
-
-	int fatBlocksWritten = 0;
-	for (int i = 0; i < 128; ++i)
+	else
 	{
-		if (rdir[i].filename[0] == 0)
-		{
-			continue;
-		}
-		double frac = (double)rdir[i].size / BLOCK_SIZE;
-		double ceiling = ceil(frac);
-		int c = round(ceiling);
-		fatBlocksWritten += c;
+		((Disk_Superblock_V2 *)block)->features = superblock->features;
 	}
+	if (meta_write(0, block) == -1)
+	{
+		return -1;
+	}
+	mountedSuperblock = *superblock;
+	return 0;
+}
 
-	fatBlocksWritten++; // account for the EOF at the beginning manually
-
-	return fatBlocksWritten;
+/*
+ * Header of entry @i of rdir block @block
+ */
+static Disk_Entry *block_entry(Superblock *superblock, char *block, size_t i)
+{
+	return (Disk_Entry *)(block + i * superblock->entry_size);
 }
 
 /*
- * Allocate the next block from FAT
+ * Read rdir block @n into @entries (entries_per_block of them), widening
+ * block indexes. Flags read as 0 until file flags are enabled.
  */
-int fs_allocate_block(uint16_t *fatBlocks, int data_block_count)
+static int load_dir_block(Superblock *superblock, uint32_t n, Root_Directory *entries)
 {
-	// Find a free block in the FAT
-	for (int i = 0; i < data_block_count; i++)
+	char block[BLOCK_SIZE];
+	if (meta_read(superblock->root_directory_index + n, block) == -1)
 	{
-		if (fatBlocks[i] == 0)
+		return -1;
+	}
+	for (size_t i = 0; i < superblock->entries_per_block; ++i)
+	{
+		Disk_Entry *disk_entry = block_entry(superblock, block, i);
+		memcpy(entries[i].filename, disk_entry->filename, FS_FILENAME_LEN);
+		entries[i].filename[FS_FILENAME_LEN - 1] = 0;
+		entries[i].size = disk_entry->size;
+		entries[i].flags = (superblock->features & FEATURE_FILE_FLAGS) ? disk_entry->flags : 0;
+		entries[i].parent = (superblock->features & FEATURE_FILE_FLAGS) ? disk_entry->parent : PARENT_ROOT;
+		if (superblock->version == 1)
 		{
-			fatBlocks[i] = FAT_EOC;
-			return i;
+			entries[i].first_data_block_index = disk_entry->first_data_block_index == FAT_EOC_V1 ? FAT_EOC : disk_entry->first_data_block_index;
+		}
+		else
+		{
+			entries[i].first_data_block_index = disk_entry->first_data_block_index | (uint32_t)disk_entry->first_data_block_high << 16;
 		}
 	}
-	// No free blocks available
-	return -1;
+	return 0;
 }
 
-int fs_mount(const char *diskname)
+/*
+ * Read rdir entry @idx
+ */
+static int load_entry(Superblock *superblock, int idx, Root_Directory *entry)
 {
-	if (block_disk_open(diskname) == -1)
+	Root_Directory entries[DIR_ENTRIES_MAX];
+	if (load_dir_block(superblock, idx / superblock->entries_per_block, entries) == -1)
 	{
 		return -1;
 	}
+	*entry = entries[idx % superblock->entries_per_block];
+	return 0;
+}
 
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+/*
+ * Read the inline area of rdir entry @idx into @data (inline_size bytes)
+ */
+static int load_inline(Superblock *superblock, int idx, char *data)
+{
+	char block[BLOCK_SIZE];
+	if (meta_read(superblock->root_directory_index + idx / superblock->entries_per_block, block) == -1)
 	{
 		return -1;
 	}
+	memcpy(data, block_entry(superblock, block, idx % superblock->entries_per_block) + 1, superblock->inline_size);
+	return 0;
+}
 
-	if ((strncmp(superblock.signature, "ECS150FS", 8) != 0) || (superblock.total_blocks != block_disk_count()))
-	{
-		return -1; // invalid signature
-	}
-
-	uint16_t fat_block_init[BLOCK_SIZE];
-	if (block_read(1, &fat_block_init) == -1)
+/*
+ * Hash of a file name in directory @parent, for the directory index
+ */
+static size_t name_hash(uint32_t parent, const char *name)
+{
+	size_t hash = (2166136261u ^ parent) * 16777619u;
+	for (; *name != 0; ++name)
 	{
-		return -1;
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
 	}
+	return hash;
+}
 
-	fat_block_init[0] = FAT_EOC; // make sure first entry is FAT_EOC
-
-	if (block_write(1, &fat_block_init) == -1)
+/*
+ * Record rdir entry @idx as @entry (empty name for a free entry) in the
+ * directory index
+ */
+static void dir_index_set(int idx, Root_Directory *entry)
+{
+	dirIsDirectory[idx] = entry->filename[0] != 0 && (entry->flags & FILE_DIRECTORY);
+	if (strcmp(dirNames[idx], entry->filename) == 0 && dirParents[idx] == entry->parent)
 	{
-		return -1;
+		return;
 	}
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
+	if (dirNames[idx][0] != 0)
 	{
-		fdArray[i] = -1;
+		int *link = &dirBuckets[name_hash(dirParents[idx], dirNames[idx]) & (dirBucketCount - 1)];
+		while (*link != idx)
+		{
+			link = &dirNext[*link];
+		}
+		*link = dirNext[idx];
+		if (dirParents[idx] != PARENT_ROOT && dirParents[idx] <= (uint32_t)mountedSuperblock.entry_count)
+		{
+			dirChildren[dirParents[idx] - 1]--;
+		}
+		dirUsed--;
+		if (idx < dirFreeHint)
+		{
+			dirFreeHint = idx;
+		}
 	}
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
+	strcpy(dirNames[idx], entry->filename);
+	dirParents[idx] = entry->parent;
+	if (entry->filename[0] != 0)
 	{
-		offsetArray[i] = 0;
+		size_t bucket = name_hash(entry->parent, entry->filename) & (dirBucketCount - 1);
+		dirNext[idx] = dirBuckets[bucket];
+		dirBuckets[bucket] = idx;
+		if (entry->parent != PARENT_ROOT && entry->parent <= (uint32_t)mountedSuperblock.entry_count)
+		{
+			dirChildren[entry->parent - 1]++;
+		}
+		dirUsed++;
 	}
-
-	return 0;
 }
 
-int fs_umount(void)
+/*
+ * Write @entry back as rdir entry @idx, with its padding zeroed, and @data
+ * (inline_size bytes) as its inline area in the same block write. Without
+ * @data the inline area is left alone, or zeroed if @entry is free. The rest
+ * of the rdir block is left as it is on disk.
+ */
+static int store_entry_inline(Superblock *superblock, int idx, Root_Directory *entry, const char *data)
 {
-	if (block_disk_count() == -1)
+	char block[BLOCK_SIZE];
+	uint32_t n = idx / superblock->entries_per_block;
+	if (meta_read(superblock->root_directory_index + n, block) == -1)
 	{
 		return -1;
 	}
 
-	if (block_disk_close() == -1)
+	Disk_Entry *disk_entry = block_entry(superblock, block, idx % superblock->entries_per_block);
+	if (data != NULL)
 	{
-		return -1;
+		memcpy(disk_entry + 1, data, superblock->inline_size);
 	}
-
-	/*
-	 * reset fd arrays
-	 */
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
+	else if (entry->filename[0] == 0)
 	{
-		fdArray[i] = -1;
+		memset(disk_entry + 1, 0, superblock->inline_size);
 	}
-
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
+	memset(disk_entry, 0, sizeof(Disk_Entry));
+	memcpy(disk_entry->filename, entry->filename, FS_FILENAME_LEN);
+	disk_entry->size = entry->size;
+	disk_entry->flags = entry->flags;
+	disk_entry->first_data_block_index = entry->first_data_block_index & 0xffff;
+	disk_entry->parent = entry->parent;
+	if (superblock->version != 1)
 	{
-		offsetArray[i] = 0;
+		disk_entry->first_data_block_high = entry->first_data_block_index >> 16;
 	}
-
-	return 0;
-}
-
-int fs_info(void)
-{
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	if (meta_write(superblock->root_directory_index + n, block) == -1)
 	{
 		return -1;
 	}
 
-	int filesWritten = files_written();
-	int fatBlocksWritten = fat_blocks_written();
-
-	printf("FS Info:\ntotal_blk_count=%i\nfat_blk_count=%i\nrdir_blk=%i\ndata_blk=%i\ndata_blk_count=%i\nfat_free_ratio=%i/%i\nrdir_free_ratio=%i/%i\n",
-		   superblock.total_blocks, superblock.fat_block_count, superblock.root_directory_index, superblock.data_block_start_index,
-		   superblock.data_block_count, superblock.data_block_count - fatBlocksWritten, superblock.data_block_count, FS_FILE_MAX_COUNT - filesWritten, FS_FILE_MAX_COUNT);
-
+	dir_index_set(idx, entry);
 	return 0;
 }
 
-int fs_create(const char *filename)
+/*
+ * Write @entry back as rdir entry @idx, see store_entry_inline()
+ */
+static int store_entry(Superblock *superblock, int idx, Root_Directory *entry)
 {
+	return store_entry_inline(superblock, idx, entry, NULL);
+}
 
-	/*
-	 * Obtain superblock
-	 */
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+/*
+ * Build the directory index from the rdir
+ */
+static int build_dir_index(Superblock *superblock)
+{
+	dirBucketCount = 1;
+	while (dirBucketCount < (size_t)superblock->entry_count)
 	{
-		return -1;
+		dirBucketCount <<= 1;
 	}
-	int filesWritten = files_written();
-	/*
-	 * Proper file init and err checking
-	 */
-	if (filesWritten == FS_FILE_MAX_COUNT)
+	dirNames = calloc(superblock->entry_count, FS_FILENAME_LEN);
+	dirParents = calloc(superblock->entry_count, sizeof(uint32_t));
+	dirIsDirectory = calloc(superblock->entry_count, sizeof(uint8_t));
+	dirChildren = calloc(superblock->entry_count, sizeof(int));
+	dirNext = malloc(sizeof(int) * superblock->entry_count);
+	dirBuckets = malloc(sizeof(int) * dirBucketCount);
+	if (dirNames == NULL || dirParents == NULL || dirIsDirectory == NULL || dirChildren == NULL || dirNext == NULL || dirBuckets == NULL)
 	{
-		return -1; // too many files
+		return -1;
 	}
-	char fileStore[FS_FILENAME_LEN];
-	memset(fileStore, 0, FS_FILENAME_LEN);
-	strcpy(fileStore, filename);
-	if (fileStore[FS_FILENAME_LEN - 1] != 0)
+	for (size_t i = 0; i < dirBucketCount; ++i)
 	{
-		return -1; // invalid size
+		dirBuckets[i] = -1;
 	}
+	dirUsed = 0;
+	dirFreeHint = 0;
 
-	/*
-	 * Fetch rdir block from disk
-	 */
-	Root_Directory rdir[FS_FILE_MAX_COUNT];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	Root_Directory entries[DIR_ENTRIES_MAX];
+	for (uint32_t n = 0; n < superblock->root_directory_blocks; ++n)
 	{
-		return -1;
+		if (load_dir_block(superblock, n, entries) == -1)
+		{
+			return -1;
+		}
+		for (size_t i = 0; i < superblock->entries_per_block; ++i)
+		{
+			dir_index_set(n * superblock->entries_per_block + i, &entries[i]);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Drop the directory index
+ */
+static void free_dir_index(void)
+{
+	free(dirNames);
+	free(dirParents);
+	free(dirIsDirectory);
+	free(dirChildren);
+	free(dirNext);
+	free(dirBuckets);
+	dirNames = NULL;
+	dirParents = NULL;
+	dirIsDirectory = NULL;
+	dirChildren = NULL;
+	dirNext = NULL;
+	dirBuckets = NULL;
+	dirUsed = 0;
+}
+
+/*
+ * Find the rdir entry named @name in directory @parent, -1 if there is none
+ */
+static int lookup(uint32_t parent, const char *name)
+{
+	for (int i = dirBuckets[name_hash(parent, name) & (dirBucketCount - 1)]; i != -1; i = dirNext[i])
+	{
+		if (dirParents[i] == parent && strcmp(dirNames[i], name) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Walk @path down to its last component: the directory holding it goes in
+ * @parent, the component itself in @name. Components are separated by '/',
+ * a leading one is optional. -1 if a directory on the way doesn't exist or a
+ * component is empty or too long.
+ */
+static int resolve_path(const char *path, uint32_t *parent, char *name)
+{
+	if (path == NULL)
+	{
+		return -1;
+	}
+	*parent = PARENT_ROOT;
+	while (*path == '/')
+	{
+		path++;
+	}
+	for (;;)
+	{
+		size_t len = strcspn(path, "/");
+		if (len == 0 || len >= FS_FILENAME_LEN)
+		{
+			return -1;
+		}
+		memcpy(name, path, len);
+		name[len] = 0;
+		path += len;
+		while (*path == '/')
+		{
+			path++;
+		}
+		if (*path == 0)
+		{
+			return 0;
+		}
+
+		int idx = lookup(*parent, name);
+		if (idx == -1 || !dirIsDirectory[idx])
+		{
+			return -1;
+		}
+		*parent = idx + 1;
+	}
+}
+
+/*
+ * Find the rdir entry at @path, file or directory, -1 if there is none or
+ * the path is invalid
+ */
+static int find_file(const char *path)
+{
+	uint32_t parent;
+	char name[FS_FILENAME_LEN];
+	if (resolve_path(path, &parent, name) == -1)
+	{
+		return -1;
+	}
+	return lookup(parent, name);
+}
+
+/*
+ * Index of a free rdir entry, -1 if the rdir is full
+ */
+static int find_free_entry(Superblock *superblock)
+{
+	for (; dirFreeHint < superblock->entry_count; ++dirFreeHint)
+	{
+		if (dirNames[dirFreeHint][0] == 0)
+		{
+			return dirFreeHint;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Count the number of rdir spots taken
+ */
+static int files_written()
+{
+	if (is_mounted() < 0)
+	{
+		return -1;
+	}
+	return dirUsed;
+}
+
+/*
+ * CRC32C (Castagnoli polynomial, reflected), with the SSE 4.2 crc32
+ * instruction when the CPU has it and slicing by 8 otherwise
+ */
+#define CRC32C_POLY 0x82f63b78
+static uint32_t crcTable[8][256];
+static int crcHardware = -1; // -1 until the first crc32c()
+
+static void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		uint32_t crc = i;
+		for (int k = 0; k < 8; ++k)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crcTable[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; ++i)
+	{
+		for (int t = 1; t < 8; ++t)
+		{
+			crcTable[t][i] = (crcTable[t - 1][i] >> 8) ^ crcTable[0][crcTable[t - 1][i] & 0xff];
+		}
+	}
+#if defined(__x86_64__) && defined(__GNUC__)
+	crcHardware = __builtin_cpu_supports("sse4.2");
+#else
+	crcHardware = 0;
+#endif
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len)
+{
+	uint64_t crc64 = crc;
+	for (; len >= sizeof(uint64_t); data += sizeof(uint64_t), len -= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+	crc = crc64;
+	for (; len > 0; ++data, --len)
+	{
+		crc = __builtin_ia32_crc32qi(crc, *data);
+	}
+	return crc;
+}
+#endif
+
+static uint32_t crc32c(const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+	uint32_t crc = 0xffffffff;
+	if (crcHardware == -1)
+	{
+		crc32c_init();
+	}
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (crcHardware)
+	{
+		return ~crc32c_sse42(crc, data, len);
+	}
+#endif
+	for (; len >= 8; data += 8, len -= 8)
+	{
+		uint32_t low, high; // little endian, like the on-disk structures
+		memcpy(&low, data, sizeof(low));
+		memcpy(&high, data + 4, sizeof(high));
+		low ^= crc;
+		crc = crcTable[7][low & 0xff] ^ crcTable[6][(low >> 8) & 0xff] ^ crcTable[5][(low >> 16) & 0xff] ^ crcTable[4][low >> 24] ^
+			  crcTable[3][high & 0xff] ^ crcTable[2][(high >> 8) & 0xff] ^ crcTable[1][(high >> 16) & 0xff] ^ crcTable[0][high >> 24];
+	}
+	for (; len > 0; ++data, --len)
+	{
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *data) & 0xff];
+	}
+	return ~crc;
+}
+
+/*
+ * Check disk block @block, just read into @data, against its checksum
+ */
+static int checksum_verify(size_t block, const void *data)
+{
+	if (blockChecksums == NULL || block < mountedSuperblock.data_block_start_index)
+	{
+		return 0;
+	}
+	Block_Checksum *checksum = &blockChecksums[block - mountedSuperblock.data_block_start_index];
+	uint32_t crc = crc32c(data, BLOCK_SIZE);
+	return crc == checksum->current || crc == checksum->previous ? 0 : -1;
+}
+
+/*
+ * Update the checksum of disk block @block, about to be overwritten with
+ * @data, on disk
+ */
+static int checksum_update(size_t block, const void *data)
+{
+	if (blockChecksums == NULL || block < mountedSuperblock.data_block_start_index)
+	{
+		return 0;
+	}
+	size_t n = block - mountedSuperblock.data_block_start_index;
+	Block_Checksum *checksum = &blockChecksums[n];
+	uint32_t crc = crc32c(data, BLOCK_SIZE);
+	if (crc == checksum->current)
+	{
+		return 0;
+	}
+	checksum->previous = checksum->current;
+	checksum->current = crc;
+	n -= n % CHECKSUMS_PER_BLOCK;
+	size_t checksum_index = mountedSuperblock.data_block_start_index - mountedSuperblock.checksum_blocks;
+	return block_write(checksum_index + n / CHECKSUMS_PER_BLOCK, &blockChecksums[n]);
+}
+
+/*
+ * Drop every cached block, used when the underlying disk changes
+ */
+static void cache_invalidate(void)
+{
+	for (int i = 0; i < CACHE_BLOCK_COUNT; ++i)
+	{
+		blockCache[i].block = -1;
+		blockCache[i].lastUse = 0;
+	}
+	free(unitCache);
+	unitCache = NULL;
+	unitCacheBlock = INDEX_HOLE;
+}
+
+/*
+ * Find the cache slot holding disk block @block, NULL on a miss
+ */
+static Cache_Block *cache_lookup(size_t block)
+{
+	for (int i = 0; i < CACHE_BLOCK_COUNT; ++i)
+	{
+		if (blockCache[i].block == (long)block)
+		{
+			blockCache[i].lastUse = ++cacheClock;
+			return &blockCache[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Load disk block @block into the cache (empty or least recently used slot)
+ */
+static Cache_Block *cache_fill(size_t block)
+{
+	Cache_Block *slot = cache_lookup(block);
+	if (slot != NULL)
+	{
+		return slot;
+	}
+
+	slot = &blockCache[0];
+	for (int i = 0; i < CACHE_BLOCK_COUNT && slot->block != -1; ++i)
+	{
+		if (blockCache[i].block == -1 || blockCache[i].lastUse < slot->lastUse)
+		{
+			slot = &blockCache[i];
+		}
+	}
+
+	if (block_read(block, slot->data) == -1 || checksum_verify(block, slot->data) == -1)
+	{
+		slot->block = -1;
+		return NULL;
+	}
+	slot->block = block;
+	slot->lastUse = ++cacheClock;
+	return slot;
+}
+
+/*
+ * Read disk block @block through the cache
+ */
+static int cache_read(size_t block, void *buf)
+{
+	Cache_Block *slot = cache_fill(block);
+	if (slot == NULL)
+	{
+		return -1;
+	}
+	memcpy(buf, slot->data, BLOCK_SIZE);
+	return 0;
+}
+
+/*
+ * Write disk block @block through to disk, refreshing the cached copy if any
+ */
+static int cache_write(size_t block, const void *buf)
+{
+	if (snapshotMeta != NULL || checksum_update(block, buf) == -1 || block_write(block, buf) == -1)
+	{
+		return -1;
+	}
+	Cache_Block *slot = cache_lookup(block);
+	if (slot != NULL)
+	{
+		memcpy(slot->data, buf, BLOCK_SIZE);
+	}
+	return 0;
+}
+
+/*
+ * Drop disk blocks @block up to @block + @count from the cache, once they have
+ * been written behind its back
+ */
+static void cache_drop(size_t block, size_t count)
+{
+	for (int i = 0; i < CACHE_BLOCK_COUNT; ++i)
+	{
+		if (blockCache[i].block >= (long)block && blockCache[i].block < (long)(block + count))
+		{
+			blockCache[i].block = -1;
+			blockCache[i].lastUse = 0;
+		}
+	}
+}
+
+/*
+ * First disk block of data block @cluster
+ */
+static size_t cluster_block(Superblock *superblock, uint32_t cluster)
+{
+	return superblock->data_block_start_index + (size_t)cluster * superblock->cluster_blocks;
+}
+
+/*
+ * Read data block @cluster through the cache
+ */
+static int cluster_read(Superblock *superblock, uint32_t cluster, void *buf)
+{
+	if (cluster >= superblock->data_block_count)
+	{
+		return -1; // a damaged chain or index led here
+	}
+	for (size_t i = 0; i < superblock->cluster_blocks; ++i)
+	{
+		if (cache_read(cluster_block(superblock, cluster) + i, (char *)buf + i * BLOCK_SIZE) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write data block @cluster through the cache
+ */
+static int cluster_write(Superblock *superblock, uint32_t cluster, const void *buf)
+{
+	if (cluster == unitCacheBlock)
+	{
+		unitCacheBlock = INDEX_HOLE;
+	}
+	if (cluster >= superblock->data_block_count)
+	{
+		return -1; // a damaged chain or index led here
+	}
+	for (size_t i = 0; i < superblock->cluster_blocks; ++i)
+	{
+		if (cache_write(cluster_block(superblock, cluster) + i, (const char *)buf + i * BLOCK_SIZE) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read index block @cluster into @index, widening its entries (INDEX_COMPRESSED
+ * included)
+ */
+static int read_index_block(Superblock *superblock, uint32_t cluster, uint32_t *index)
+{
+	if (superblock->version != 1)
+	{
+		return cluster_read(superblock, cluster, index);
+	}
+
+	uint16_t narrow[BLOCK_SIZE / sizeof(uint16_t)];
+	if (cluster_read(superblock, cluster, narrow) == -1)
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < superblock->index_entries; ++i)
+	{
+		index[i] = narrow[i] == (uint16_t)INDEX_COMPRESSED ? INDEX_COMPRESSED : narrow[i];
+	}
+	return 0;
+}
+
+/*
+ * Write @index back as index block @cluster
+ */
+static int write_index_block(Superblock *superblock, uint32_t cluster, uint32_t *index)
+{
+	if (superblock->version != 1)
+	{
+		return cluster_write(superblock, cluster, index);
+	}
+
+	uint16_t narrow[BLOCK_SIZE / sizeof(uint16_t)];
+	for (size_t i = 0; i < superblock->index_entries; ++i)
+	{
+		narrow[i] = index[i];
+	}
+	return cluster_write(superblock, cluster, narrow);
+}
+
+/*
+ * Prefetch the @count mapped data blocks in @blocks into the cache, skipping
+ * holes and stopping after @window disk blocks
+ */
+static void read_ahead(Superblock *superblock, uint32_t *blocks, size_t count, int window)
+{
+	size_t budget = window;
+	for (size_t i = 0; i < count && blocks[i] != FAT_EOC; ++i)
+	{
+		for (size_t j = 0; blocks[i] != INDEX_HOLE && blocks[i] != INDEX_COMPRESSED && j < superblock->cluster_blocks; ++j)
+		{
+			if (budget-- == 0 || cache_fill(cluster_block(superblock, blocks[i]) + j) == NULL)
+			{
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * Free the arena, once nothing is mounted
+ */
+static void arena_destroy(void)
+{
+	for (int i = 0; i < ARENA_BUFFERS; ++i)
+	{
+		free(arenaBuffers[i]);
+		arenaBuffers[i] = NULL;
+		arenaSizes[i] = 0;
+		arenaTaken[i] = 0;
+	}
+	free(arenaClusters);
+	arenaClusters = NULL;
+	arenaClusterSize = 0;
+	memset(arenaClusterTaken, 0, sizeof(arenaClusterTaken));
+	arenaLimit = 0;
+}
+
+/*
+ * Set up the arena for the disk described by @superblock. Only the cluster
+ * slots are allocated up front; a buffer slot never needs to hold more than
+ * the whole FAT, a block map of the whole disk or a compressed unit.
+ */
+static int arena_init(Superblock *superblock)
+{
+	arena_destroy();
+	size_t per_block = BLOCK_SIZE / (superblock->version == 1 ? sizeof(uint16_t) : sizeof(uint32_t));
+	size_t fat_size = sizeof(uint32_t) * superblock->fat_block_count * per_block;
+	size_t map_size = sizeof(uint32_t) * ((size_t)superblock->data_block_count + READ_AHEAD_MAX + 1);
+	size_t unit_size = COMPRESS_UNIT * superblock->cluster_size;
+	arenaLimit = fat_size > map_size ? fat_size : map_size;
+	arenaLimit = arenaLimit > unit_size ? arenaLimit : unit_size;
+
+	/*
+	 * Index blocks of version 1 disks are widened to 32-bit entries, twice
+	 * the size of the block
+	 */
+	size_t index_size = sizeof(uint32_t) * superblock->index_entries;
+	arenaClusterSize = superblock->cluster_size > index_size ? superblock->cluster_size : index_size;
+	arenaClusters = malloc(arenaClusterSize * ARENA_CLUSTERS);
+	return arenaClusters == NULL ? -1 : 0;
+}
+
+/*
+ * Get @size bytes of scratch memory: from the smallest free arena slot that
+ * holds that much already, or else from the largest free one, grown at least
+ * twofold, or from the heap if none is free or @size is past what slots hold.
+ * NULL on failure, never for 0 bytes.
+ */
+static void *arena_alloc(size_t size)
+{
+	size = size > 0 ? size : 1;
+	int pick = -1;
+	int largest = -1;
+	for (int i = 0; i < ARENA_BUFFERS && arenaClusters != NULL && size <= arenaLimit; ++i)
+	{
+		if (arenaTaken[i])
+		{
+			continue;
+		}
+		if (arenaSizes[i] >= size && (pick == -1 || arenaSizes[i] < arenaSizes[pick]))
+		{
+			pick = i;
+		}
+		if (largest == -1 || arenaSizes[i] > arenaSizes[largest])
+		{
+			largest = i;
+		}
+	}
+	pick = pick == -1 ? largest : pick;
+	if (pick == -1)
+	{
+		return malloc(size);
+	}
+
+	if (arenaSizes[pick] < size)
+	{
+		size_t grown = arenaSizes[pick] * 2 < arenaLimit ? arenaSizes[pick] * 2 : arenaLimit;
+		grown = grown > size ? grown : size;
+		free(arenaBuffers[pick]); // nothing to keep, so no realloc()
+		arenaBuffers[pick] = malloc(grown);
+		arenaSizes[pick] = arenaBuffers[pick] == NULL ? 0 : grown;
+		if (arenaBuffers[pick] == NULL)
+		{
+			return NULL;
+		}
+	}
+	arenaTaken[pick] = 1;
+	return arenaBuffers[pick];
+}
+
+/*
+ * Get scratch memory for one data block or one index block of the mounted
+ * disk, of which callers keep a few at most. NULL on failure.
+ */
+static void *arena_cluster(void)
+{
+	for (int i = 0; i < ARENA_CLUSTERS && arenaClusters != NULL; ++i)
+	{
+		if (!arenaClusterTaken[i])
+		{
+			arenaClusterTaken[i] = 1;
+			return arenaClusters + i * arenaClusterSize;
+		}
+	}
+	return malloc(arenaClusters != NULL ? arenaClusterSize : CLUSTER_SIZE_MAX);
+}
+
+/*
+ * Give back memory from arena_alloc() or arena_cluster()
+ */
+static void arena_free(void *buf)
+{
+	char *p = buf;
+	if (arenaClusters != NULL && p >= arenaClusters && p < arenaClusters + arenaClusterSize * ARENA_CLUSTERS)
+	{
+		arenaClusterTaken[(p - arenaClusters) / arenaClusterSize] = 0;
+		return;
+	}
+	for (int i = 0; i < ARENA_BUFFERS && p != NULL; ++i)
+	{
+		if (p == arenaBuffers[i])
+		{
+			arenaTaken[i] = 0;
+			return;
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Read the whole FAT into an array of 32-bit entries from arena_alloc(),
+ * taking FAT block n from disk block @map[n] if @map isn't NULL. NULL on
+ * failure.
+ */
+static uint32_t *read_fat(Superblock *superblock, const uint32_t *map)
+{
+	size_t per_block = BLOCK_SIZE / (superblock->version == 1 ? sizeof(uint16_t) : sizeof(uint32_t));
+	uint32_t *fatBlocks = arena_alloc(sizeof(uint32_t) * superblock->fat_block_count * per_block);
+	if (fatBlocks == NULL)
+	{
+		return NULL;
+	}
+
+	/*
+	 * FAT blocks go in back to back as stored, which for 16-bit entries is
+	 * the first half of the array
+	 */
+	for (size_t i = 0; i < superblock->fat_block_count; ++i)
+	{
+		if (block_read(map != NULL ? map[i] : i + 1, (char *)fatBlocks + i * BLOCK_SIZE) == -1)
+		{
+			arena_free(fatBlocks);
+			return NULL;
+		}
+	}
+
+	/*
+	 * Widen 16-bit entries in place, back to front
+	 */
+	if (superblock->version == 1)
+	{
+		uint16_t *narrow = (uint16_t *)fatBlocks;
+		for (size_t i = superblock->fat_block_count * per_block; i-- > 0;)
+		{
+			fatBlocks[i] = narrow[i] == FAT_EOC_V1 ? FAT_EOC : narrow[i];
+		}
+	}
+	return fatBlocks;
+}
+
+/*
+ * Load the whole FAT of the mounted disk, or snapshot, with free blocks that a
+ * snapshot holds marked FAT_FROZEN. NULL on failure.
+ */
+static uint32_t *load_fat(Superblock *superblock)
+{
+	uint32_t *fatBlocks = read_fat(superblock, snapshotMeta);
+	if (fatBlocks != NULL && blockFrozen != NULL)
+	{
+		for (uint32_t i = 0; i < superblock->data_block_count; ++i)
+		{
+			if (fatBlocks[i] == 0 && blockFrozen[i])
+			{
+				fatBlocks[i] = FAT_FROZEN;
+			}
+		}
+	}
+	return fatBlocks;
+}
+
+/*
+ * Write the whole FAT back to disk
+ */
+static int store_fat(Superblock *superblock, uint32_t *fatBlocks)
+{
+	if (superblock->version != 1)
+	{
+		uint32_t wide[BLOCK_SIZE / sizeof(uint32_t)];
+		for (size_t i = 0; i < superblock->fat_block_count; ++i)
+		{
+			for (size_t j = 0; j < BLOCK_SIZE / sizeof(uint32_t); ++j)
+			{
+				uint32_t fat_entry = fatBlocks[i * (BLOCK_SIZE / sizeof(uint32_t)) + j];
+				wide[j] = fat_entry == FAT_FROZEN ? 0 : fat_entry;
+			}
+			if (meta_write(i + 1, wide) == -1)
+			{
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	uint16_t narrow[BLOCK_SIZE / sizeof(uint16_t)];
+	for (size_t i = 0; i < superblock->fat_block_count; ++i)
+	{
+		for (size_t j = 0; j < BLOCK_SIZE / sizeof(uint16_t); ++j)
+		{
+			uint32_t fat_entry = fatBlocks[i * (BLOCK_SIZE / sizeof(uint16_t)) + j];
+			narrow[j] = fat_entry == FAT_FROZEN ? 0 : fat_entry;
+		}
+		if (meta_write(i + 1, narrow) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Count the number of fat spots taken, preallocated blocks included
+ */
+int fat_blocks_written()
+{
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+
+	int fatBlocksWritten = 0;
+	for (size_t i = 0; i < superblock.data_block_count; ++i)
+	{
+		if (fatBlocks[i] != 0)
+		{
+			fatBlocksWritten++; // the EOF at the beginning counts too
+		}
+	}
+
+	arena_free(fatBlocks);
+	return fatBlocksWritten;
+}
+
+/*
+ * Return block @block to the free list, unless a snapshot holds it
+ */
+static void free_block(uint32_t *fatBlocks, uint32_t block)
+{
+	fatBlocks[block] = blockFrozen != NULL && blockFrozen[block] ? FAT_FROZEN : 0;
+}
+
+/*
+ * Return every block of the chain starting at @fat_index to the free list
+ */
+static void free_chain(uint32_t *fatBlocks, uint32_t fat_index)
+{
+	while (fat_index != FAT_EOC && fat_index != 0)
+	{
+		uint32_t next_index = fatBlocks[fat_index];
+		free_block(fatBlocks, fat_index);
+		fat_index = next_index;
+	}
+}
+
+/*
+ * Find @count free blocks in a row, trying right after @hint first. Returns
+ * the first block of the run, or FAT_EOC if there is no such run.
+ */
+static uint32_t find_free_run(uint32_t *fatBlocks, uint32_t data_block_count, uint32_t count, uint32_t hint)
+{
+	uint32_t run = 0;
+	for (uint32_t i = hint; i < data_block_count && fatBlocks[i] == 0 && run < count; ++i)
+	{
+		run++;
+	}
+	if (run == count)
+	{
+		return hint;
+	}
+
+	run = 0;
+	for (uint32_t i = 1; i < data_block_count; ++i)
+	{
+		run = fatBlocks[i] == 0 ? run + 1 : 0;
+		if (run == count)
+		{
+			return i - count + 1;
+		}
+	}
+	return FAT_EOC;
+}
+
+/*
+ * Grow the chain of @entry to at least @blocks blocks, in one contiguous run
+ * if there is one. All or nothing: returns -1 and leaves the FAT untouched if
+ * the disk doesn't have enough free blocks.
+ */
+static int extend_chain(uint32_t *fatBlocks, uint32_t data_block_count, Root_Directory *entry, size_t blocks)
+{
+	size_t chain_length = 0;
+	uint32_t tail = FAT_EOC;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		chain_length++;
+		tail = i;
+	}
+	if (chain_length >= blocks)
+	{
+		return 0;
+	}
+
+	size_t missing = blocks - chain_length;
+	size_t free_blocks = 0;
+	for (uint32_t i = 1; i < data_block_count; ++i)
+	{
+		free_blocks += fatBlocks[i] == 0;
+	}
+	if (free_blocks < missing)
+	{
+		return -1;
+	}
+
+	uint32_t run = find_free_run(fatBlocks, data_block_count, missing, tail == FAT_EOC ? 1 : tail + 1);
+	for (size_t i = 0; i < missing; ++i)
+	{
+		uint32_t new_idx = run;
+		if (run == FAT_EOC)
+		{
+			for (new_idx = 1; fatBlocks[new_idx] != 0; ++new_idx)
+				; // no run that long, take whatever is free
+		}
+		else
+		{
+			run++;
+		}
+
+		fatBlocks[new_idx] = FAT_EOC;
+		if (tail == FAT_EOC)
+		{
+			entry->first_data_block_index = new_idx;
+		}
+		else
+		{
+			fatBlocks[tail] = new_idx;
+		}
+		tail = new_idx;
+	}
+	return 0;
+}
+
+/*
+ * Allocate the next block from FAT, FAT_EOC if the disk is full
+ */
+uint32_t fs_allocate_block(uint32_t *fatBlocks, uint32_t data_block_count)
+{
+	// Find a free block in the FAT
+	for (uint32_t i = 0; i < data_block_count; i++)
+	{
+		if (fatBlocks[i] == 0)
+		{
+			fatBlocks[i] = FAT_EOC;
+			if (dedupListed != NULL)
+			{
+				dedupListed[i] = 0;
+			}
+			return i;
+		}
+	}
+	// No free blocks available
+	return FAT_EOC;
+}
+
+/*
+ * Load the extent list of extent file @entry into an array from arena_alloc()
+ * with room for @extra more extents. Returns the number of extents, -1 on failure.
+ */
+static long load_extents(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, Extent **extents, size_t extra)
+{
+	size_t per_block = superblock->cluster_size / sizeof(Extent);
+	size_t blocks = 0;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		blocks++;
+	}
+
+	*extents = arena_alloc(sizeof(Extent) * (blocks * per_block + extra + 1));
+	if (*extents == NULL)
+	{
+		return -1;
+	}
+
+	size_t count = 0;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		if (cluster_read(superblock, i, *extents + count) == -1)
+		{
+			arena_free(*extents);
+			return -1;
+		}
+		size_t n = 0;
+		while (n < per_block && (*extents)[count + n].length != 0)
+		{
+			n++;
+		}
+		count += n;
+		if (n < per_block)
+		{
+			break;
+		}
+	}
+
+	/*
+	 * Garbage (a torn write) must not index the FAT
+	 */
+	for (size_t i = 0; i < count; ++i)
+	{
+		if ((*extents)[i].start == 0 || (*extents)[i].start >= superblock->data_block_count ||
+			(*extents)[i].length > superblock->data_block_count - (*extents)[i].start)
+		{
+			arena_free(*extents);
+			return -1;
+		}
+	}
+	return count;
+}
+
+/*
+ * Write @count extents back as the extent list of @entry, growing or
+ * shrinking its chain of extent blocks. All or nothing: returns -1 and leaves
+ * the FAT untouched if there is no room for the extent blocks.
+ */
+static int store_extents(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, Extent *extents, size_t count)
+{
+	size_t per_block = superblock->cluster_size / sizeof(Extent);
+	size_t needed = (count + per_block - 1) / per_block;
+
+	size_t have = 0;
+	uint32_t tail = FAT_EOC;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		have++;
+		tail = i;
+	}
+	if (have < needed)
+	{
+		size_t free_blocks = 0;
+		for (uint32_t i = 1; i < superblock->data_block_count; ++i)
+		{
+			free_blocks += fatBlocks[i] == 0;
+		}
+		if (free_blocks < needed - have)
+		{
+			return -1;
+		}
+		for (; have < needed; ++have)
+		{
+			uint32_t new_idx = fs_allocate_block(fatBlocks, superblock->data_block_count);
+			if (tail == FAT_EOC)
+			{
+				entry->first_data_block_index = new_idx;
+			}
+			else
+			{
+				fatBlocks[tail] = new_idx;
+			}
+			tail = new_idx;
+		}
+	}
+	else if (have > needed)
+	{
+		uint32_t keep = FAT_EOC;
+		uint32_t block_index = entry->first_data_block_index;
+		for (size_t i = 0; i < needed; ++i)
+		{
+			keep = block_index;
+			block_index = fatBlocks[block_index];
+		}
+		free_chain(fatBlocks, block_index);
+		if (keep == FAT_EOC)
+		{
+			entry->first_data_block_index = FAT_EOC;
+		}
+		else
+		{
+			fatBlocks[keep] = FAT_EOC;
+		}
+	}
+
+	Extent *block = arena_cluster();
+	if (block == NULL)
+	{
+		return -1;
+	}
+	size_t done = 0;
+	int ret = 0;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC && ret == 0; i = fatBlocks[i])
+	{
+		size_t n = count - done < per_block ? count - done : per_block;
+		memcpy(block, extents + done, sizeof(Extent) * n);
+		memset(block + n, 0, sizeof(Extent) * (per_block - n));
+		ret = cluster_write(superblock, i, block);
+		done += n;
+	}
+	arena_free(block);
+	return ret;
+}
+
+/*
+ * Number of data blocks in the extent list of @entry, -1 on failure
+ */
+static long extent_blocks(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry)
+{
+	Extent *extents;
+	long count = load_extents(superblock, fatBlocks, entry, &extents, 0);
+	if (count == -1)
+	{
+		return -1;
+	}
+	long blocks = 0;
+	for (long i = 0; i < count; ++i)
+	{
+		blocks += extents[i].length;
+	}
+	arena_free(extents);
+	return blocks;
+}
+
+/*
+ * Grow extent file @entry to at least @blocks data blocks, appending to its
+ * last extent whenever the blocks right after it are free. All or nothing,
+ * like extend_chain().
+ */
+static int extend_extents(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t blocks)
+{
+	Extent *extents;
+	long have_extents = load_extents(superblock, fatBlocks, entry, &extents, 0);
+	if (have_extents == -1)
+	{
+		return -1;
+	}
+	size_t count = have_extents;
+	size_t length = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		length += extents[i].length;
+	}
+	if (length >= blocks)
+	{
+		arena_free(extents);
+		return 0;
+	}
+
+	size_t missing = blocks - length;
+	size_t free_blocks = 0;
+	for (uint32_t i = 1; i < superblock->data_block_count; ++i)
+	{
+		free_blocks += fatBlocks[i] == 0;
+	}
+	if (free_blocks < missing)
+	{
+		arena_free(extents);
+		return -1;
+	}
+
+	/*
+	 * Worst case every new block is an extent of its own
+	 */
+	Extent *grown = arena_alloc(sizeof(Extent) * (count + missing + 1));
+	if (grown == NULL)
+	{
+		arena_free(extents);
+		return -1;
+	}
+	memcpy(grown, extents, sizeof(Extent) * count);
+	arena_free(extents);
+	extents = grown;
+
+	uint32_t end = count > 0 ? extents[count - 1].start + extents[count - 1].length : 1;
+	uint32_t run = find_free_run(fatBlocks, superblock->data_block_count, missing, end);
+	uint32_t next = 1;
+	for (size_t i = 0; i < missing; ++i)
+	{
+		uint32_t new_idx = run;
+		if (run == FAT_EOC)
+		{
+			while (fatBlocks[next] != 0)
+			{
+				next++; // no run that long, take whatever is free
+			}
+			new_idx = next;
+		}
+		else
+		{
+			run++;
+		}
+
+		fatBlocks[new_idx] = FAT_EOC;
+		if (count > 0 && extents[count - 1].start + extents[count - 1].length == new_idx)
+		{
+			extents[count - 1].length++;
+		}
+		else
+		{
+			extents[count].start = new_idx;
+			extents[count].length = 1;
+			count++;
+		}
+	}
+
+	/*
+	 * No room left for the extent list, give the data blocks back
+	 */
+	if (store_extents(superblock, fatBlocks, entry, extents, count) == -1)
+	{
+		size_t seen = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			for (uint32_t b = 0; b < extents[i].length; ++b, ++seen)
+			{
+				if (seen >= length)
+				{
+					free_block(fatBlocks, extents[i].start + b);
+				}
+			}
+		}
+		arena_free(extents);
+		return -1;
+	}
+
+	arena_free(extents);
+	return 0;
+}
+
+/*
+ * Flags of @entry, 0 on images that never had file flags enabled
+ */
+static uint8_t file_flags(Superblock *superblock, Root_Directory *entry)
+{
+	return (superblock->features & FEATURE_FILE_FLAGS) ? entry->flags : 0;
+}
+
+/*
+ * Number of data blocks allocated to chain or extent file @entry, -1 on
+ * failure
+ */
+static long file_blocks(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry)
+{
+	if (file_flags(superblock, entry) & FILE_EXTENTS)
+	{
+		return extent_blocks(superblock, fatBlocks, entry);
+	}
+
+	long chain_length = 0;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		chain_length++;
+	}
+	return chain_length;
+}
+
+/*
+ * Count the data blocks file @entry holds into @blocks, preallocated ones
+ * included but not its index or extent blocks, and the runs of consecutive
+ * ones they make up in file order into @fragments
+ */
+static int file_layout(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t *blocks, size_t *fragments)
+{
+	*blocks = 0;
+	*fragments = 0;
+	uint32_t previous = FAT_EOC;
+	if (file_flags(superblock, entry) & FILE_EXTENTS)
+	{
+		Extent *extents;
+		long count = load_extents(superblock, fatBlocks, entry, &extents, 0);
+		if (count == -1)
+		{
+			return -1;
+		}
+		for (long i = 0; i < count; ++i)
+		{
+			*blocks += extents[i].length;
+			*fragments += extents[i].start != previous + 1;
+			previous = extents[i].start + extents[i].length - 1;
+		}
+		arena_free(extents);
+		return 0;
+	}
+
+	if (!(file_flags(superblock, entry) & FILE_INDEXED))
+	{
+		for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+		{
+			(*blocks)++;
+			*fragments += i != previous + 1;
+			previous = i;
+		}
+		return 0;
+	}
+
+	uint32_t *index = arena_cluster();
+	if (index == NULL)
+	{
+		return -1;
+	}
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		if (read_index_block(superblock, i, index) == -1)
+		{
+			arena_free(index);
+			return -1;
+		}
+		for (size_t slot = 0; slot < superblock->index_entries; ++slot)
+		{
+			if (index[slot] == INDEX_HOLE || index[slot] == INDEX_COMPRESSED)
+			{
+				continue;
+			}
+			(*blocks)++;
+			*fragments += index[slot] != previous + 1;
+			previous = index[slot];
+		}
+	}
+	arena_free(index);
+	return 0;
+}
+
+/*
+ * Grow chain or extent file @entry to at least @blocks data blocks, see
+ * extend_chain() and extend_extents()
+ */
+static int extend_file(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t blocks)
+{
+	if (file_flags(superblock, entry) & FILE_EXTENTS)
+	{
+		return extend_extents(superblock, fatBlocks, entry, blocks);
+	}
+	return extend_chain(fatBlocks, superblock->data_block_count, entry, blocks);
+}
+
+/*
+ * Scrub the flags and padding of every rdir entry and mark the superblock as
+ * having file flags, writing both back in that order
+ */
+static int enable_file_flags(Superblock *superblock)
+{
+	if (superblock->features & FEATURE_FILE_FLAGS)
+	{
+		return 0;
+	}
+
+	char block[BLOCK_SIZE];
+	for (uint32_t n = 0; n < superblock->root_directory_blocks; ++n)
+	{
+		if (meta_read(superblock->root_directory_index + n, block) == -1)
+		{
+			return -1;
+		}
+		for (size_t i = 0; i < superblock->entries_per_block; ++i)
+		{
+			Disk_Entry *disk_entry = block_entry(superblock, block, i);
+			disk_entry->flags = 0;
+			disk_entry->parent = 0;
+			memset(disk_entry->padding, 0, sizeof(disk_entry->padding));
+			if (superblock->version == 1)
+			{
+				disk_entry->first_data_block_high = 0;
+			}
+		}
+		if (meta_write(superblock->root_directory_index + n, block) == -1)
+		{
+			return -1;
+		}
+	}
+	superblock->features |= FEATURE_FILE_FLAGS;
+	return store_superblock(superblock);
+}
+
+/*
+ * Check whether the @size bytes of a data block hold nothing but zeros
+ */
+static int is_zero_block(const char *data, size_t size)
+{
+	return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+/*
+ * LZ4-style block codec for compressed files. The stream is a series of
+ * sequences, each a token byte (literal count in the high nibble, match
+ * length - LZ_MIN_MATCH in the low one, 15 meaning more length bytes follow,
+ * each added in until one isn't 255), the literals, then a 16-bit little
+ * endian match offset. The last sequence stops after its literals.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+/*
+ * Append a sequence to the @cap bytes at @dst, -1 if it doesn't fit
+ */
+static int lz_sequence(uint8_t *dst, size_t cap, size_t *out, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len)
+{
+	if (cap - *out < 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1)
+	{
+		return -1;
+	}
+
+	size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+	uint8_t *token = &dst[(*out)++];
+	*token = (literal_len < 15 ? literal_len : 15) << 4 | (match_code < 15 ? match_code : 15);
+	if (literal_len >= 15)
+	{
+		size_t rest = literal_len - 15;
+		for (; rest >= 255; rest -= 255)
+		{
+			dst[(*out)++] = 255;
+		}
+		dst[(*out)++] = rest;
+	}
+	memcpy(dst + *out, literals, literal_len);
+	*out += literal_len;
+
+	if (match_len > 0)
+	{
+		dst[(*out)++] = offset & 0xff;
+		dst[(*out)++] = offset >> 8;
+		if (match_code >= 15)
+		{
+			size_t rest = match_code - 15;
+			for (; rest >= 255; rest -= 255)
+			{
+				dst[(*out)++] = 255;
+			}
+			dst[(*out)++] = rest;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Compress the @len bytes at @src into at most @cap bytes at @dst. Returns
+ * the compressed length, 0 if it doesn't fit.
+ */
+static size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS]; // last position seen for each hash
+	memset(table, 0, sizeof(table));
+
+	size_t out = 0;
+	size_t anchor = 0;
+	size_t pos = 0;
+	while (pos + LZ_MIN_MATCH <= len)
+	{
+		uint32_t sequence;
+		memcpy(&sequence, src + pos, sizeof(sequence));
+		uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		size_t candidate = table[hash];
+		table[hash] = pos;
+		if (candidate >= pos || pos - candidate > 0xffff || memcmp(src + candidate, src + pos, LZ_MIN_MATCH) != 0)
+		{
+			pos++;
+			continue;
+		}
+
+		size_t match_len = LZ_MIN_MATCH;
+		while (pos + match_len < len && src[candidate + match_len] == src[pos + match_len])
+		{
+			match_len++;
+		}
+		if (lz_sequence(dst, cap, &out, src + anchor, pos - anchor, pos - candidate, match_len) == -1)
+		{
+			return 0;
+		}
+		pos += match_len;
+		anchor = pos;
+	}
+
+	if (lz_sequence(dst, cap, &out, src + anchor, len - anchor, 0, 0) == -1)
+	{
+		return 0;
+	}
+	return out;
+}
+
+/*
+ * Read one extended length from @src, -1 if the stream ends first
+ */
+static int lz_length(const uint8_t *src, size_t len, size_t *in, size_t *length)
+{
+	uint8_t byte;
+	do
+	{
+		if (*in >= len)
+		{
+			return -1;
+		}
+		byte = src[(*in)++];
+		*length += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+/*
+ * Decompress the @len bytes at @src into exactly @dst_len bytes at @dst, -1
+ * if the stream is corrupt
+ */
+static int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len)
+{
+	size_t in = 0;
+	size_t out = 0;
+	while (in < len)
+	{
+		uint8_t token = src[in++];
+		size_t literal_len = token >> 4;
+		if (literal_len == 15 && lz_length(src, len, &in, &literal_len) == -1)
+		{
+			return -1;
+		}
+		if (literal_len > len - in || literal_len > dst_len - out)
+		{
+			return -1;
+		}
+		memcpy(dst + out, src + in, literal_len);
+		in += literal_len;
+		out += literal_len;
+		if (in == len)
+		{
+			break; // last sequence
+		}
+
+		if (len - in < 2)
+		{
+			return -1;
+		}
+		size_t offset = src[in] | (size_t)src[in + 1] << 8;
+		in += 2;
+		size_t match_len = token & 15;
+		if (match_len == 15 && lz_length(src, len, &in, &match_len) == -1)
+		{
+			return -1;
+		}
+		match_len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out || match_len > dst_len - out)
+		{
+			return -1;
+		}
+		for (size_t i = 0; i < match_len; ++i)
+		{
+			dst[out + i] = dst[out - offset + i]; // may overlap
+		}
+		out += match_len;
+	}
+	return out == dst_len ? 0 : -1;
+}
+
+/*
+ * Drop one reference to data block @block of an indexed file, freeing it
+ * when it was the last one
+ */
+static void release_block(uint32_t *fatBlocks, uint32_t block)
+{
+	if (blockShares != NULL && blockShares[block] > 0)
+	{
+		blockShares[block]--;
+	}
+	else
+	{
+		free_block(fatBlocks, block);
+		if (dedupListed != NULL)
+		{
+			dedupListed[block] = 0;
+		}
+	}
+}
+
+/*
+ * Check whether data block @block is also used by another file, or held by a
+ * snapshot
+ */
+static int is_shared_block(uint32_t block)
+{
+	return (blockShares != NULL && blockShares[block] > 0) || (blockFrozen != NULL && blockFrozen[block]);
+}
+
+/*
+ * Find a block listed in dedupTable under @hash that holds the same data as
+ * @data and can take one more reference. Returns FAT_EOC if there is none.
+ */
+static uint32_t dedup_find(Superblock *superblock, uint32_t *fatBlocks, uint32_t hash, const char *data)
+{
+	if (dedupTable == NULL)
+	{
+		dedupTable = calloc(superblock->data_block_count, sizeof(Dedup_Entry));
+		dedupListed = calloc(superblock->data_block_count, sizeof(uint8_t));
+		if (dedupTable == NULL || dedupListed == NULL)
+		{
+			free(dedupTable);
+			free(dedupListed);
+			dedupTable = NULL;
+			dedupListed = NULL;
+			return FAT_EOC;
+		}
+	}
+
+	char *listed = arena_cluster();
+	uint32_t found = FAT_EOC; // a hash collision, or the block changed since
+	for (uint32_t i = 0; i < DEDUP_PROBE && listed != NULL && found == FAT_EOC; ++i)
+	{
+		Dedup_Entry *slot = &dedupTable[(hash + i) % superblock->data_block_count];
+		uint32_t block = slot->block;
+		if (slot->hash != hash || !dedupListed[block] || fatBlocks[block] == 0 || fatBlocks[block] == FAT_FROZEN || blockShares == NULL || blockShares[block] == UINT16_MAX)
+		{
+			continue;
+		}
+		if (cluster_read(superblock, block, listed) == 0 && memcmp(listed, data, superblock->cluster_size) == 0)
+		{
+			found = block;
+		}
+	}
+	arena_free(listed);
+	return found;
+}
+
+/*
+ * List data block @block, just written with content hashing to @hash, in the
+ * first probed slot that is free or stale, or else in place of the first one
+ */
+static void dedup_note(Superblock *superblock, uint32_t block, uint32_t hash)
+{
+	if (dedupTable == NULL)
+	{
+		return;
+	}
+	Dedup_Entry *slot = &dedupTable[hash % superblock->data_block_count];
+	for (uint32_t i = 0; i < DEDUP_PROBE; ++i)
+	{
+		Dedup_Entry *probe = &dedupTable[(hash + i) % superblock->data_block_count];
+		if (!dedupListed[probe->block] || probe->block == block)
+		{
+			slot = probe;
+			break;
+		}
+	}
+	slot->hash = hash;
+	slot->block = block;
+	dedupListed[block] = 1;
+}
+
+/*
+ * Fill @blocks with the data block indexes of logical blocks [@first, @first +
+ * @count) of @entry: INDEX_HOLE for holes, FAT_EOC past the end of a chain
+ */
+static int map_blocks(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t first, size_t count, uint32_t *blocks)
+{
+	size_t i = 0;
+	uint32_t block_index = entry->first_data_block_index;
+
+	if (file_flags(superblock, entry) & FILE_EXTENTS)
+	{
+		Extent *extents;
+		long extent_count = load_extents(superblock, fatBlocks, entry, &extents, 0);
+		if (extent_count == -1)
+		{
+			return -1;
+		}
+		size_t skip = first;
+		for (long e = 0; e < extent_count && i < count; ++e)
+		{
+			if (skip >= extents[e].length)
+			{
+				skip -= extents[e].length;
+				continue;
+			}
+			for (uint32_t b = skip; b < extents[e].length && i < count; ++b)
+			{
+				blocks[i++] = extents[e].start + b;
+			}
+			skip = 0;
+		}
+		for (; i < count; ++i)
+		{
+			blocks[i] = FAT_EOC;
+		}
+		arena_free(extents);
+		return 0;
+	}
+
+	if (!(file_flags(superblock, entry) & FILE_INDEXED))
+	{
+		for (size_t skip = 0; skip < first && block_index != FAT_EOC; ++skip)
+		{
+			block_index = fatBlocks[block_index];
+		}
+		for (; i < count && block_index != FAT_EOC; ++i)
+		{
+			blocks[i] = block_index;
+			block_index = fatBlocks[block_index];
+		}
+		for (; i < count; ++i)
+		{
+			blocks[i] = FAT_EOC;
+		}
+		return 0;
+	}
+
+	uint32_t *index = arena_cluster();
+	if (index == NULL)
+	{
+		return -1;
+	}
+	for (size_t skip = 0; skip < first / superblock->index_entries && block_index != FAT_EOC; ++skip)
+	{
+		block_index = fatBlocks[block_index];
+	}
+	int ret = 0;
+	while (i < count && ret == 0)
+	{
+		size_t slot = (first + i) % superblock->index_entries;
+		if (block_index == FAT_EOC)
+		{
+			blocks[i++] = INDEX_HOLE; // past the last index block
+			continue;
+		}
+		if (read_index_block(superblock, block_index, index) == -1)
+		{
+			ret = -1;
+			break;
+		}
+		for (; i < count && slot < superblock->index_entries; ++i, ++slot)
+		{
+			blocks[i] = index[slot];
+			if (blocks[i] >= superblock->data_block_count && blocks[i] != INDEX_COMPRESSED)
+			{
+				ret = -1; // garbage, don't let it index the FAT
+				break;
+			}
+		}
+		block_index = fatBlocks[block_index];
+	}
+	arena_free(index);
+	return ret;
+}
+
+/*
+ * Make sure the index chain of @entry can map @blocks logical blocks, adding
+ * zeroed (all holes) index blocks as needed. Returns -1 if the disk is full.
+ */
+static int ensure_index(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t blocks)
+{
+	size_t needed = (blocks + superblock->index_entries - 1) / superblock->index_entries;
+	size_t have = 0;
+	uint32_t tail = FAT_EOC;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		have++;
+		tail = i;
+	}
+
+	if (have >= needed)
+	{
+		return 0;
+	}
+	char *zero_block = arena_cluster();
+	if (zero_block == NULL)
+	{
+		return -1;
+	}
+	memset(zero_block, 0, superblock->cluster_size);
+	int ret = 0;
+	for (; have < needed; ++have)
+	{
+		uint32_t new_idx = fs_allocate_block(fatBlocks, superblock->data_block_count);
+		if (new_idx == FAT_EOC || cluster_write(superblock, new_idx, zero_block) == -1)
+		{
+			ret = -1;
+			break;
+		}
+		if (tail == FAT_EOC)
+		{
+			entry->first_data_block_index = new_idx;
+		}
+		else
+		{
+			fatBlocks[tail] = new_idx;
+		}
+		tail = new_idx;
+	}
+	arena_free(zero_block);
+	return ret;
+}
+
+/*
+ * Store @blocks as the mapping of logical blocks [@first, @first + @count) of
+ * indexed file @entry, whose index chain must already cover them. Each index
+ * block is read and written once.
+ */
+static int store_index(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t first, size_t count, uint32_t *blocks)
+{
+	uint32_t *index = arena_cluster();
+	if (index == NULL)
+	{
+		return -1;
+	}
+	uint32_t block_index = entry->first_data_block_index;
+	for (size_t skip = 0; skip < first / superblock->index_entries; ++skip)
+	{
+		block_index = fatBlocks[block_index];
+	}
+
+	size_t i = 0;
+	int ret = 0;
+	while (i < count)
+	{
+		size_t slot = (first + i) % superblock->index_entries;
+		if (read_index_block(superblock, block_index, index) == -1)
+		{
+			ret = -1;
+			break;
+		}
+		for (; i < count && slot < superblock->index_entries; ++i, ++slot)
+		{
+			index[slot] = blocks[i];
+		}
+		if (write_index_block(superblock, block_index, index) == -1)
+		{
+			ret = -1;
+			break;
+		}
+		block_index = fatBlocks[block_index];
+	}
+	arena_free(index);
+	return ret;
+}
+
+/*
+ * Turn chain or extent file @entry, rdir entry @idx, into an indexed one.
+ * Returns -1, leaving it untouched, if there is no room for the index blocks.
+ * The caller writes the FAT back.
+ */
+static int convert_to_indexed(Superblock *superblock, uint32_t *fatBlocks, int idx, Root_Directory *entry)
+{
+	if (file_flags(superblock, entry) & FILE_INDEXED)
+	{
+		return 0;
+	}
+	if (enable_file_flags(superblock) == -1)
+	{
+		return -1;
+	}
+
+	long chain_length = file_blocks(superblock, fatBlocks, entry);
+	if (chain_length == -1)
+	{
+		return -1;
+	}
+
+	uint32_t *blocks = malloc(sizeof(uint32_t) * (chain_length + 1));
+	if (blocks == NULL || map_blocks(superblock, fatBlocks, entry, 0, chain_length, blocks) == -1)
+	{
+		free(blocks);
+		return -1;
+	}
+
+	/*
+	 * Hang an index chain off the entry in place of the data chain (or extent
+	 * list). On disk, the index is allocated before the entry switches over to
+	 * it, and the data blocks only lose their links (keeping them allocated)
+	 * after that, so a crash in between leaks blocks at worst.
+	 */
+	Root_Directory indexed = *entry;
+	indexed.first_data_block_index = FAT_EOC;
+	indexed.flags = (indexed.flags & ~FILE_EXTENTS) | FILE_INDEXED;
+	if (ensure_index(superblock, fatBlocks, &indexed, chain_length) == -1 ||
+		store_index(superblock, fatBlocks, &indexed, 0, chain_length, blocks) == -1)
+	{
+		free_chain(fatBlocks, indexed.first_data_block_index);
+		free(blocks);
+		return -1;
+	}
+
+	uint32_t old_first = entry->first_data_block_index;
+	int had_extents = file_flags(superblock, entry) & FILE_EXTENTS;
+	*entry = indexed;
+	if (store_fat(superblock, fatBlocks) == -1 || store_entry(superblock, idx, entry) == -1)
+	{
+		free(blocks);
+		return -1;
+	}
+	if (had_extents)
+	{
+		free_chain(fatBlocks, old_first); // the extent blocks
+	}
+	for (long i = 0; i < chain_length; ++i)
+	{
+		fatBlocks[blocks[i]] = FAT_EOC;
+	}
+
+	free(blocks);
+	return 0;
+}
+
+/*
+ * Make sure changing file @entry, rdir entry @idx, leaves the blocks that
+ * snapshots hold alone. A chain or extent file with a frozen block becomes an
+ * indexed one, whose data blocks then get copied on write like shared ones,
+ * and frozen index blocks are copied to fresh ones. Both the FAT and the entry
+ * are stored if anything changes. Returns -1 if the disk is full.
+ */
+static int thaw_file(Superblock *superblock, uint32_t *fatBlocks, int idx, Root_Directory *entry)
+{
+	if (blockFrozen == NULL || entry->first_data_block_index == FAT_EOC)
+	{
+		return 0;
+	}
+
+	if (!(file_flags(superblock, entry) & FILE_INDEXED))
+	{
+		int frozen = 0;
+		for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+		{
+			frozen |= blockFrozen[i]; // data chain, or extent list
+		}
+		if (!frozen && (file_flags(superblock, entry) & FILE_EXTENTS))
+		{
+			Extent *extents;
+			long extent_count = load_extents(superblock, fatBlocks, entry, &extents, 0);
+			if (extent_count == -1)
+			{
+				return -1;
+			}
+			for (long e = 0; e < extent_count; ++e)
+			{
+				for (uint32_t b = 0; b < extents[e].length; ++b)
+				{
+					frozen |= blockFrozen[extents[e].start + b];
+				}
+			}
+			arena_free(extents);
+		}
+		if (!frozen)
+		{
+			return 0;
+		}
+		if (convert_to_indexed(superblock, fatBlocks, idx, entry) == -1)
+		{
+			return -1;
+		}
+	}
+
+	/*
+	 * The copies get linked in, and the entry stored, before the frozen
+	 * index blocks are let go
+	 */
+	size_t chain_length = 0;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; i = fatBlocks[i])
+	{
+		chain_length++;
+	}
+	uint32_t *thawed = arena_alloc(sizeof(uint32_t) * chain_length);
+	char *block = arena_cluster();
+	if (thawed == NULL || block == NULL)
+	{
+		arena_free(block);
+		arena_free(thawed);
+		return -1;
+	}
+	size_t thawed_count = 0;
+	uint32_t prev_idx = FAT_EOC;
+	for (uint32_t i = entry->first_data_block_index; i != FAT_EOC; prev_idx = i, i = fatBlocks[i])
+	{
+		if (!blockFrozen[i])
+		{
+			continue;
+		}
+		uint32_t new_idx = fs_allocate_block(fatBlocks, superblock->data_block_count);
+		if (new_idx == FAT_EOC || cluster_read(superblock, i, block) == -1 || cluster_write(superblock, new_idx, block) == -1)
+		{
+			if (new_idx != FAT_EOC)
+			{
+				fatBlocks[new_idx] = 0;
+			}
+			arena_free(block);
+			arena_free(thawed);
+			return -1;
+		}
+		fatBlocks[new_idx] = fatBlocks[i];
+		if (prev_idx == FAT_EOC)
+		{
+			entry->first_data_block_index = new_idx;
+		}
+		else
+		{
+			fatBlocks[prev_idx] = new_idx;
+		}
+		thawed[thawed_count++] = i;
+		i = new_idx;
+	}
+	arena_free(block);
+
+	int ret = 0;
+	if (thawed_count > 0 && (store_fat(superblock, fatBlocks) == -1 || store_entry(superblock, idx, entry) == -1))
+	{
+		ret = -1;
+	}
+	for (size_t i = 0; i < thawed_count; ++i)
+	{
+		free_block(fatBlocks, thawed[i]);
+	}
+	arena_free(thawed);
+	return ret;
+}
+
+/*
+ * Back every hole among the first @want logical blocks of indexed file @entry
+ * with a data block, in one contiguous run if there is one. Holes inside the
+ * file get zeroed, the ones past EOF are only reserved. All or nothing:
+ * returns -1 if the disk doesn't have enough free blocks.
+ */
+static int fill_holes(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t want)
+{
+	if (want == 0)
+	{
+		return 0;
+	}
+	if (ensure_index(superblock, fatBlocks, entry, want) == -1)
+	{
+		return -1;
+	}
+
+	uint32_t *blocks = arena_alloc(sizeof(uint32_t) * want);
+	if (blocks == NULL || map_blocks(superblock, fatBlocks, entry, 0, want, blocks) == -1)
+	{
+		arena_free(blocks);
+		return -1;
+	}
+
+	size_t holes = 0;
+	for (size_t i = 0; i < want; ++i)
+	{
+		holes += blocks[i] == INDEX_HOLE;
+	}
+	size_t free_blocks = 0;
+	for (uint32_t i = 1; i < superblock->data_block_count; ++i)
+	{
+		free_blocks += fatBlocks[i] == 0;
+	}
+	char *zero_block = arena_cluster();
+	if (free_blocks < holes || zero_block == NULL)
+	{
+		arena_free(zero_block);
+		arena_free(blocks);
+		return -1;
+	}
+	memset(zero_block, 0, superblock->cluster_size);
+	size_t size_blocks = (entry->size + superblock->cluster_size - 1) / superblock->cluster_size;
+	uint32_t run = holes > 0 ? find_free_run(fatBlocks, superblock->data_block_count, holes, 1) : FAT_EOC;
+	for (size_t i = 0; i < want; ++i)
+	{
+		if (blocks[i] != INDEX_HOLE)
+		{
+			continue;
+		}
+		blocks[i] = run == FAT_EOC ? fs_allocate_block(fatBlocks, superblock->data_block_count) : run++;
+		fatBlocks[blocks[i]] = FAT_EOC;
+		if (i < size_blocks)
+		{
+			cluster_write(superblock, blocks[i], zero_block);
+		}
+	}
+
+	arena_free(zero_block);
+	int ret = store_index(superblock, fatBlocks, entry, 0, want, blocks);
+	arena_free(blocks);
+	return ret;
+}
+
+/*
+ * Free every data block of @entry from logical block @keep on, along with
+ * preallocated ones. Index and extent blocks no longer needed go too.
+ */
+static int free_blocks_from(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t keep)
+{
+	if (file_flags(superblock, entry) & FILE_EXTENTS)
+	{
+		Extent *extents;
+		long extent_count = load_extents(superblock, fatBlocks, entry, &extents, 0);
+		if (extent_count == -1)
+		{
+			return -1;
+		}
+		size_t count = 0;
+		size_t kept = 0;
+		for (long e = 0; e < extent_count; ++e)
+		{
+			uint32_t length = keep - kept < extents[e].length ? keep - kept : extents[e].length;
+			for (uint32_t b = length; b < extents[e].length; ++b)
+			{
+				free_block(fatBlocks, extents[e].start + b);
+			}
+			if (length > 0)
+			{
+				extents[count].start = extents[e].start;
+				extents[count++].length = length;
+				kept += length;
+			}
+		}
+		int ret = store_extents(superblock, fatBlocks, entry, extents, count);
+		arena_free(extents);
+		return ret;
+	}
+
+	if (!(file_flags(superblock, entry) & FILE_INDEXED))
+	{
+		uint32_t prev_idx = FAT_EOC;
+		uint32_t block_index = entry->first_data_block_index;
+		for (size_t i = 0; i < keep && block_index != FAT_EOC; ++i)
+		{
+			prev_idx = block_index;
+			block_index = fatBlocks[block_index];
+		}
+		free_chain(fatBlocks, block_index);
+		if (prev_idx == FAT_EOC)
+		{
+			entry->first_data_block_index = FAT_EOC;
+		}
+		else
+		{
+			fatBlocks[prev_idx] = FAT_EOC;
+		}
+		return 0;
+	}
+
+	uint32_t *index = arena_cluster();
+	if (index == NULL)
+	{
+		return -1;
+	}
+	size_t keep_index = (keep + superblock->index_entries - 1) / superblock->index_entries;
+	uint32_t prev_idx = FAT_EOC;
+	uint32_t block_index = entry->first_data_block_index;
+	for (size_t n = 0; block_index != FAT_EOC; ++n)
+	{
+		uint32_t next_index = fatBlocks[block_index];
+		if ((n + 1) * superblock->index_entries > keep)
+		{
+			if (read_index_block(superblock, block_index, index) == -1)
+			{
+				arena_free(index);
+				return -1;
+			}
+			size_t slot = n * superblock->index_entries < keep ? keep - n * superblock->index_entries : 0;
+			for (; slot < superblock->index_entries; ++slot)
+			{
+				if (index[slot] != INDEX_HOLE && index[slot] < superblock->data_block_count)
+				{
+					release_block(fatBlocks, index[slot]); // not INDEX_COMPRESSED, nor garbage
+				}
+				index[slot] = INDEX_HOLE;
+			}
+			if (n < keep_index)
+			{
+				write_index_block(superblock, block_index, index);
+			}
+		}
+		if (n < keep_index)
+		{
+			prev_idx = block_index;
+		}
+		else
+		{
+			free_block(fatBlocks, block_index); // index block no longer needed
+		}
+		block_index = next_index;
+	}
+	arena_free(index);
+	if (prev_idx == FAT_EOC)
+	{
+		entry->first_data_block_index = FAT_EOC;
+	}
+	else
+	{
+		fatBlocks[prev_idx] = FAT_EOC;
+	}
+	return 0;
+}
+
+/*
+ * Move the data of inline file @entry, rdir entry @idx, out to a data block,
+ * leaving the chain or extent file fs_create() would have made without
+ * FEATURE_INLINE. Returns -1, leaving @entry untouched, if the disk is full.
+ * The caller writes the FAT and @entry back, in that order.
+ */
+static int spill_inline(Superblock *superblock, uint32_t *fatBlocks, int idx, Root_Directory *entry)
+{
+	if (!(file_flags(superblock, entry) & FILE_INLINE))
+	{
+		return 0;
+	}
+
+	char *data = calloc(1, superblock->cluster_size);
+	if (data == NULL || load_inline(superblock, idx, data) == -1)
+	{
+		free(data);
+		return -1;
+	}
+
+	Root_Directory spilled = *entry;
+	spilled.flags &= ~FILE_INLINE;
+	spilled.first_data_block_index = FAT_EOC;
+	uint32_t block;
+	if (spilled.size > 0 &&
+		(extend_file(superblock, fatBlocks, &spilled, 1) == -1 ||
+		 map_blocks(superblock, fatBlocks, &spilled, 0, 1, &block) == -1 ||
+		 cluster_write(superblock, block, data) == -1))
+	{
+		free_blocks_from(superblock, fatBlocks, &spilled, 0);
+		free(data);
+		return -1;
+	}
+
+	free(data);
+	*entry = spilled;
+	return 0;
+}
+
+/*
+ * Write @count bytes at file offset @offset of inline file @entry, rdir entry
+ * @idx, and set its size to @size, all in its rdir block. Bytes between the
+ * old and the new end of file are zero already when growing, and get zeroed
+ * when shrinking.
+ */
+static int write_inline(Superblock *superblock, int idx, Root_Directory *entry, size_t offset, const void *buf, size_t count, size_t size)
+{
+	char data[INLINE_SIZE_MAX];
+	if (load_inline(superblock, idx, data) == -1)
+	{
+		return -1;
+	}
+	if (count > 0)
+	{
+		memcpy(data + offset, buf, count);
+	}
+	if (size < entry->size)
+	{
+		memset(data + size, 0, entry->size - size);
+	}
+	entry->size = size;
+	return store_entry_inline(superblock, idx, entry, data);
+}
+
+/*
+ * Read the unit of a compressed file with index slots @slots into @data
+ * (COMPRESS_UNIT clusters), decompressing it through @scratch (as large) if
+ * it is stored compressed. Holes read as zeros.
+ */
+static int load_unit(Superblock *superblock, uint32_t *slots, char *data, char *scratch)
+{
+	size_t cluster_size = superblock->cluster_size;
+	size_t unit_size = COMPRESS_UNIT * cluster_size;
+	if (slots[COMPRESS_UNIT - 1] != INDEX_COMPRESSED)
+	{
+		for (size_t j = 0; j < COMPRESS_UNIT; ++j)
+		{
+			if (slots[j] == INDEX_HOLE || slots[j] == FAT_EOC)
+			{
+				memset(data + j * cluster_size, 0, cluster_size);
+			}
+			else if (cluster_read(superblock, slots[j], data + j * cluster_size) == -1)
+			{
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if (unitCache != NULL && slots[0] == unitCacheBlock)
+	{
+		memcpy(data, unitCache, unit_size);
+		return 0;
+	}
+
+	size_t stored = 0;
+	for (; stored < COMPRESS_UNIT && slots[stored] != INDEX_COMPRESSED; ++stored)
+	{
+		if (cluster_read(superblock, slots[stored], scratch + stored * cluster_size) == -1)
+		{
+			return -1;
+		}
+	}
+	uint32_t length;
+	memcpy(&length, scratch, sizeof(length));
+	if (stored == 0 || length > stored * cluster_size - sizeof(length) ||
+		lz_decompress((uint8_t *)scratch + sizeof(length), length, (uint8_t *)data, unit_size) == -1)
+	{
+		return -1; // corrupt
+	}
+
+	if (unitCache == NULL)
+	{
+		unitCache = malloc(unit_size);
+	}
+	if (unitCache != NULL)
+	{
+		memcpy(unitCache, data, unit_size);
+		unitCacheBlock = slots[0];
+	}
+	return 0;
+}
+
+/*
+ * Check whether the unit with index slots @slots has no data blocks at all
+ */
+static int is_hole_unit(uint32_t *slots)
+{
+	for (size_t j = 0; j < COMPRESS_UNIT; ++j)
+	{
+		if (slots[j] != INDEX_HOLE && slots[j] != FAT_EOC)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Store @data (COMPRESS_UNIT clusters) as the unit of a compressed file with
+ * index slots @slots, compressed through @scratch (as large) if @compress is
+ * set and that saves a block. All-zero clusters of a unit kept as is become
+ * holes. The unit always goes to fresh blocks, whose indexes replace @slots,
+ * and the old ones are released. Returns -1, leaving @slots untouched, if
+ * the disk is full.
+ */
+static int store_unit(Superblock *superblock, uint32_t *fatBlocks, uint32_t *slots, const char *data, char *scratch, int compress)
+{
+	size_t cluster_size = superblock->cluster_size;
+	size_t unit_size = COMPRESS_UNIT * cluster_size;
+	uint32_t fresh[COMPRESS_UNIT];
+	size_t stored = COMPRESS_UNIT;
+	const char *source = data;
+
+	uint32_t length = 0;
+	if (compress && !is_zero_block(data, unit_size))
+	{
+		length = lz_compress((const uint8_t *)data, unit_size, (uint8_t *)scratch + sizeof(length), (COMPRESS_UNIT - 1) * cluster_size - sizeof(length));
+	}
+	if (length > 0)
+	{
+		memcpy(scratch, &length, sizeof(length));
+		stored = (sizeof(length) + length + cluster_size - 1) / cluster_size;
+		memset(scratch + sizeof(length) + length, 0, stored * cluster_size - sizeof(length) - length);
+		source = scratch;
+	}
+
+	size_t j;
+	for (j = 0; j < COMPRESS_UNIT; ++j)
+	{
+		fresh[j] = j < stored ? INDEX_HOLE : INDEX_COMPRESSED;
+		if (j >= stored || (length == 0 && is_zero_block(data + j * cluster_size, cluster_size)))
+		{
+			continue;
+		}
+		fresh[j] = fs_allocate_block(fatBlocks, superblock->data_block_count);
+		if (fresh[j] == FAT_EOC)
+		{
+			break; // disk is full
+		}
+		if (cluster_write(superblock, fresh[j], source + j * cluster_size) == -1)
+		{
+			j++;
+			break;
+		}
+	}
+	if (j < COMPRESS_UNIT)
+	{
+		for (size_t k = 0; k < j; ++k)
+		{
+			if (fresh[k] != INDEX_HOLE && fresh[k] != INDEX_COMPRESSED && fresh[k] != FAT_EOC)
+			{
+				release_block(fatBlocks, fresh[k]);
+			}
+		}
+		return -1;
+	}
+
+	for (j = 0; j < COMPRESS_UNIT; ++j)
+	{
+		if (slots[j] != INDEX_HOLE && slots[j] != INDEX_COMPRESSED && slots[j] != FAT_EOC)
+		{
+			release_block(fatBlocks, slots[j]);
+		}
+		slots[j] = fresh[j];
+	}
+	return 0;
+}
+
+/*
+ * Decompress or compress (@compress) every unit of compressed file @entry in
+ * place, all-hole units aside. The caller writes the FAT back.
+ */
+static int recode_units(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, int compress)
+{
+	size_t unit_size = COMPRESS_UNIT * superblock->cluster_size;
+	size_t units = (entry->size + unit_size - 1) / unit_size;
+	char *data = arena_alloc(unit_size);
+	char *scratch = arena_alloc(unit_size);
+	uint32_t slots[COMPRESS_UNIT];
+	int ret = data == NULL || scratch == NULL ? -1 : 0;
+	for (size_t u = 0; ret == 0 && u < units; ++u)
+	{
+		if (map_blocks(superblock, fatBlocks, entry, u * COMPRESS_UNIT, COMPRESS_UNIT, slots) == -1)
+		{
+			ret = -1;
+			break;
+		}
+		if (is_hole_unit(slots) || (slots[COMPRESS_UNIT - 1] == INDEX_COMPRESSED) == compress)
+		{
+			continue;
+		}
+		if (load_unit(superblock, slots, data, scratch) == -1 ||
+			store_unit(superblock, fatBlocks, slots, data, scratch, compress) == -1 ||
+			store_index(superblock, fatBlocks, entry, u * COMPRESS_UNIT, COMPRESS_UNIT, slots) == -1)
+		{
+			ret = -1;
+		}
+	}
+	arena_free(scratch);
+	arena_free(data);
+	return ret;
+}
+
+/*
+ * write_through() for compressed file @entry: every unit the write touches
+ * is read back, patched and stored again. Returns the number of bytes
+ * written, cut short at a unit boundary if the disk fills up. The caller
+ * writes the FAT and @entry back.
+ */
+static int write_compressed(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t offset, const void *buf, size_t count)
+{
+	size_t unit_size = COMPRESS_UNIT * superblock->cluster_size;
+	size_t first = offset / unit_size;
+	size_t last = (offset + count - 1) / unit_size;
+	if (ensure_index(superblock, fatBlocks, entry, (last + 1) * COMPRESS_UNIT) == -1)
+	{
+		return 0;
+	}
+
+	char *data = arena_alloc(unit_size);
+	char *scratch = arena_alloc(unit_size);
+	if (data == NULL || scratch == NULL)
+	{
+		arena_free(scratch);
+		arena_free(data);
+		return -1;
+	}
+
+	uint32_t slots[COMPRESS_UNIT];
+	int bytes_written = 0;
+	for (size_t u = first; u <= last; ++u)
+	{
+		size_t unit_start = u * unit_size;
+		size_t from = unit_start > offset ? unit_start : offset;
+		size_t to = unit_start + unit_size < offset + count ? unit_start + unit_size : offset + count;
+		if (map_blocks(superblock, fatBlocks, entry, u * COMPRESS_UNIT, COMPRESS_UNIT, slots) == -1 ||
+			load_unit(superblock, slots, data, scratch) == -1)
+		{
+			break;
+		}
+		memcpy(data + (from - unit_start), (const char *)buf + bytes_written, to - from);
+		if (store_unit(superblock, fatBlocks, slots, data, scratch, 1) == -1 ||
+			store_index(superblock, fatBlocks, entry, u * COMPRESS_UNIT, COMPRESS_UNIT, slots) == -1)
+		{
+			break;
+		}
+		bytes_written += (int)(to - from);
+	}
+
+	arena_free(scratch);
+	arena_free(data);
+	if (bytes_written > 0 && offset + bytes_written > entry->size)
+	{
+		entry->size = offset + bytes_written;
+	}
+	return bytes_written;
+}
+
+/*
+ * fs_read() for compressed file @entry, one unit at a time. Returns the number
+ * of bytes read into @buf.
+ */
+static int read_compressed(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry, size_t offset, void *buf, size_t count)
+{
+	size_t unit_size = COMPRESS_UNIT * superblock->cluster_size;
+	char *data = arena_alloc(unit_size);
+	char *scratch = arena_alloc(unit_size);
+	if (data == NULL || scratch == NULL)
+	{
+		arena_free(scratch);
+		arena_free(data);
+		return -1;
+	}
+
+	uint32_t slots[COMPRESS_UNIT];
+	int bytes_read = 0;
+	while (count > 0)
+	{
+		size_t u = (offset + bytes_read) / unit_size;
+		size_t in_unit = (offset + bytes_read) % unit_size;
+		size_t chunk = unit_size - in_unit < count ? unit_size - in_unit : count;
+		if (map_blocks(superblock, fatBlocks, entry, u * COMPRESS_UNIT, COMPRESS_UNIT, slots) == -1 ||
+			load_unit(superblock, slots, data, scratch) == -1)
+		{
+			break;
+		}
+		memcpy((char *)buf + bytes_read, data + in_unit, chunk);
+		bytes_read += (int)chunk;
+		count -= chunk;
+	}
+
+	arena_free(scratch);
+	arena_free(data);
+	return bytes_read;
+}
+
+/*
+ * Write @count bytes at file offset @offset of the file behind @fd straight to
+ * disk, extending its chain as needed. Returns the number of bytes written.
+ */
+static int write_through(int fd, size_t offset, const void *buf, size_t count)
+{
+	/*
+	 * Open superblock
+	 */
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	/*
+	 * Open rdir entry
+	 */
+	int rdir_idx = fdArray[fd];
+	Root_Directory file_entry;
+	if (load_entry(&superblock, rdir_idx, &file_entry) == -1)
+	{
+		return -1;
+	}
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	/*
+	 * Inline files take the write in their rdir entry while it fits
+	 */
+	if ((file_flags(&superblock, &file_entry) & FILE_INLINE) && offset + count <= superblock.inline_size)
+	{
+		size_t size = offset + count > file_entry.size ? offset + count : file_entry.size;
+		if (write_inline(&superblock, rdir_idx, &file_entry, offset, buf, count, size) == -1)
+		{
+			return -1;
+		}
+		return (int)count;
+	}
+
+	/*
+	 * Open fat blocks
+	 */
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+
+	Root_Directory *entry = &file_entry;
+	int fat_dirty = 0;
+	int rdir_dirty = 0;
+	if (file_flags(&superblock, entry) & FILE_INLINE)
+	{
+		if (spill_inline(&superblock, fatBlocks, rdir_idx, entry) == -1)
+		{
+			arena_free(fatBlocks);
+			return 0; // no room for the data block
+		}
+		fat_dirty = rdir_dirty = 1;
+	}
+	if (thaw_file(&superblock, fatBlocks, rdir_idx, entry) == -1)
+	{
+		arena_free(fatBlocks);
+		return 0; // no room to copy what a snapshot holds
+	}
+	if (file_flags(&superblock, entry) & FS_FLAG_COMPRESS)
+	{
+		int bytes_written = write_compressed(&superblock, fatBlocks, entry, offset, buf, count);
+		store_fat(&superblock, fatBlocks);
+		store_entry(&superblock, rdir_idx, entry);
+		arena_free(fatBlocks);
+		return bytes_written;
+	}
+	size_t cluster_size = superblock.cluster_size;
+	size_t first = offset / cluster_size;
+	size_t last = (offset + count - 1) / cluster_size;
+	size_t size_blocks = (entry->size + cluster_size - 1) / cluster_size;
+
+	/*
+	 * Writing past the end of file leaves a gap of blocks that must read as
+	 * zeros. A chain (or extent) file whose blocks don't reach over the gap
+	 * becomes an indexed one so the gap can be left as holes.
+	 */
+	size_t lo = first > size_blocks ? size_blocks : first;
+	long chain_length = 0;
+	if (!(file_flags(&superblock, entry) & FILE_INDEXED))
+	{
+		chain_length = file_blocks(&superblock, fatBlocks, entry);
+	}
+	if (chain_length == -1)
+	{
+		arena_free(fatBlocks);
+		return -1;
+	}
+	if (lo < first && !(file_flags(&superblock, entry) & FILE_INDEXED) && (size_t)chain_length < first)
+	{
+		if (convert_to_indexed(&superblock, fatBlocks, rdir_idx, entry) == -1)
+		{
+			arena_free(fatBlocks);
+			return 0; // no room for the index
+		}
+		fat_dirty = rdir_dirty = 1;
+	}
+	int indexed = file_flags(&superblock, entry) & FILE_INDEXED;
+	int sparse = file_flags(&superblock, entry) & FS_FLAG_SPARSE;
+	int dedup = indexed && (file_flags(&superblock, entry) & FS_FLAG_DEDUP);
+
+	if (indexed)
+	{
+		/*
+		 * Data blocks get allocated one by one below, the index up front
+		 */
+		uint32_t first_index = entry->first_data_block_index;
+		if (ensure_index(&superblock, fatBlocks, entry, last + 1) == -1)
+		{
+			arena_free(fatBlocks);
+			return 0;
+		}
+		fat_dirty = 1;
+		rdir_dirty |= first_index != entry->first_data_block_index;
+	}
+	else
+	{
+		/*
+		 * Grow the chain up to the block holding the last byte to write. On a
+		 * full disk it is left as long as it could get and the write is cut
+		 * short.
+		 */
+		uint32_t first_index = entry->first_data_block_index;
+		if ((size_t)chain_length < last + 1 && extend_file(&superblock, fatBlocks, entry, last + 1) == 0)
+		{
+			chain_length = last + 1;
+			fat_dirty = 1;
+		}
+		for (; (size_t)chain_length < last + 1; ++chain_length)
+		{
+			if (extend_file(&superblock, fatBlocks, entry, chain_length + 1) == -1)
+			{
+				break; // disk is full
+			}
+			fat_dirty = 1;
+		}
+		rdir_dirty |= first_index != entry->first_data_block_index;
+
+		if (offset >= (size_t)chain_length * cluster_size)
+		{
+			if (fat_dirty)
+			{
+				store_fat(&superblock, fatBlocks);
+			}
+			if (rdir_dirty)
+			{
+				store_entry(&superblock, rdir_idx, entry);
+			}
+			arena_free(fatBlocks);
+			return 0; // no room at all
+		}
+		if (count > (size_t)chain_length * cluster_size - offset)
+		{
+			count = chain_length * cluster_size - offset;
+			last = chain_length - 1;
+		}
+	}
+
+	uint32_t *blocks = arena_alloc(sizeof(uint32_t) * (last - lo + 1));
+	char *data_block = arena_cluster();
+	if (blocks == NULL || data_block == NULL || map_blocks(&superblock, fatBlocks, entry, lo, last - lo + 1, blocks) == -1)
+	{
+		arena_free(data_block);
+		arena_free(blocks);
+		arena_free(fatBlocks);
+		return -1;
+	}
+
+	/*
+	 * Begin piping in data through temp data blocks, starting with the gap if
+	 * there is one. Whole blocks are written as is, partial ones are
+	 * read-modify-written, and blocks past the end of the file (new,
+	 * preallocated or holes) start out zeroed. Indexed files only get a data
+	 * block allocated for a hole when there is something other than zeros to
+	 * put in it, and sparse ones give blocks back when zeros are written.
+	 */
+	size_t file_offset = offset;
+	int bytes_written = 0;
+	size_t block_number;
+	for (block_number = lo; block_number <= last; ++block_number)
+	{
+		uint32_t *block_index = &blocks[block_number - lo];
+		size_t block_start = block_number * cluster_size;
+		size_t from = block_start > file_offset ? block_start : file_offset;
+		size_t to = block_start + cluster_size < file_offset + count ? block_start + cluster_size : file_offset + count;
+		size_t chunk = block_number < first ? 0 : to - from;
+
+		if (chunk < cluster_size)
+		{
+			if (block_number >= size_blocks || *block_index == INDEX_HOLE)
+			{
+				memset(data_block, 0, cluster_size);
+			}
+			else if (cluster_read(&superblock, *block_index, data_block) == -1)
+			{
+				break;
+			}
+		}
+		if (chunk > 0)
+		{
+			memcpy(data_block + (from - block_start), buf + bytes_written, chunk);
+		}
+
+		if (indexed && (sparse || chunk == 0) && is_zero_block(data_block, cluster_size))
+		{
+			if (*block_index != INDEX_HOLE && sparse)
+			{
+				release_block(fatBlocks, *block_index); // elide, the block reads as zeros anyway
+				*block_index = INDEX_HOLE;
+			}
+			if (*block_index == INDEX_HOLE)
+			{
+				bytes_written += (int)chunk;
+				continue;
+			}
+		}
+
+		/*
+		 * A dedup file takes a reference to an identical block already on
+		 * disk rather than writing its own
+		 */
+		uint32_t hash = 0;
+		if (dedup)
+		{
+			hash = crc32c(data_block, cluster_size);
+			uint32_t same = dedup_find(&superblock, fatBlocks, hash, data_block);
+			if (same != FAT_EOC && same != *block_index)
+			{
+				if (*block_index != INDEX_HOLE)
+				{
+					release_block(fatBlocks, *block_index);
+				}
+				blockShares[same]++;
+				*block_index = same;
+			}
+			if (same != FAT_EOC)
+			{
+				bytes_written += (int)chunk;
+				continue;
+			}
+		}
+
+		/*
+		 * Holes get a fresh block, and so do blocks shared with a clone
+		 * (copy-on-write: the clone keeps the old one)
+		 */
+		if (*block_index == INDEX_HOLE || (indexed && is_shared_block(*block_index)))
+		{
+			uint32_t new_idx = fs_allocate_block(fatBlocks, superblock.data_block_count);
+			if (new_idx == FAT_EOC)
+			{
+				break; // disk is full
+			}
+			if (*block_index != INDEX_HOLE)
+			{
+				release_block(fatBlocks, *block_index);
+			}
+			*block_index = new_idx;
+		}
+		if (cluster_write(&superblock, *block_index, data_block) == -1)
+		{
+			break;
+		}
+		if (dedup)
+		{
+			dedup_note(&superblock, *block_index, hash);
+		}
+		bytes_written += (int)chunk;
+	}
+
+	if (indexed)
+	{
+		store_index(&superblock, fatBlocks, entry, lo, block_number - lo, blocks);
+	}
+	if (fat_dirty || indexed)
+	{
+		store_fat(&superblock, fatBlocks);
+	}
+
+	/*
+	 * Update the rdir entry if the file grew
+	 */
+	if (bytes_written > 0 && file_offset + bytes_written > entry->size)
+	{
+		entry->size = file_offset + bytes_written;
+		rdir_dirty = 1;
+	}
+	if (rdir_dirty)
+	{
+		store_entry(&superblock, rdir_idx, entry);
+	}
+
+	arena_free(data_block);
+	arena_free(blocks);
+	arena_free(fatBlocks);
+	return bytes_written;
+}
+
+/*
+ * Flush the write buffer of @fd to disk. Returns -1 if the buffered bytes
+ * couldn't all be written (or an earlier flush already fell short).
+ */
+static int flush_fd(int fd)
+{
+	if (writeBufferLen[fd] > 0)
+	{
+		int written = write_through(fd, writeBufferStart[fd], writeBuffer[fd], writeBufferLen[fd]);
+		if (written < (int)writeBufferLen[fd])
+		{
+			writeError[fd] = 1;
+		}
+		writeBufferLen[fd] = 0;
+	}
+	return writeError[fd] ? -1 : 0;
+}
+
+/*
+ * Flush the write buffers of every fd open on rdir entry @rdir_idx, so that
+ * reads and stats through any of them see the buffered bytes
+ */
+static void flush_file(int rdir_idx)
+{
+	for (int i = 0; i < fdCount; ++i)
+	{
+		if (fdArray[i] == rdir_idx)
+		{
+			flush_fd(i);
+		}
+	}
+}
+
+/*
+ * Read the checksum area of a disk with FEATURE_CHECKSUMS into blockChecksums
+ */
+static int load_checksums(Superblock *superblock)
+{
+	if (!(superblock->features & FEATURE_CHECKSUMS))
+	{
+		return 0;
+	}
+	blockChecksums = malloc((size_t)superblock->checksum_blocks * BLOCK_SIZE);
+	if (blockChecksums == NULL)
+	{
+		return -1;
+	}
+	size_t checksum_index = superblock->data_block_start_index - superblock->checksum_blocks;
+	for (size_t n = 0; n < superblock->checksum_blocks; ++n)
+	{
+		if (block_read(checksum_index + n, &blockChecksums[n * CHECKSUMS_PER_BLOCK]) == -1)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Number of metadata blocks a snapshot keeps a copy of: disk blocks 1 up to
+ * the end of the rdir
+ */
+static size_t snapshot_blocks(Superblock *superblock)
+{
+	return superblock->root_directory_index + superblock->root_directory_blocks - 1;
+}
+
+/*
+ * Map each metadata block copied by snapshot @entry to the disk block it was
+ * copied to, in a malloc'd array (see snapshotMeta). NULL on failure.
+ */
+static uint32_t *snapshot_map(Superblock *superblock, uint32_t *fatBlocks, Root_Directory *entry)
+{
+	size_t count = snapshot_blocks(superblock);
+	uint32_t *map = malloc(sizeof(uint32_t) * count);
+	if (map == NULL)
+	{
+		return NULL;
+	}
+	uint32_t cluster = entry->first_data_block_index;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (i > 0 && i % superblock->cluster_blocks == 0)
+		{
+			cluster = fatBlocks[cluster];
+		}
+		if (cluster >= superblock->data_block_count)
+		{
+			free(map);
+			return NULL; // chain too short
+		}
+		map[i] = cluster_block(superblock, cluster) + i % superblock->cluster_blocks;
+	}
+	return map;
+}
+
+/*
+ * Freeze every data block allocated in the copy of the FAT of each snapshot
+ * on the mounted disk (see PARENT_SNAPSHOT)
+ */
+static int build_frozen(Superblock *superblock)
+{
+	free(blockFrozen);
+	blockFrozen = NULL;
+
+	uint32_t *fatBlocks = NULL;
+	for (int i = 0; i < superblock->entry_count; ++i)
+	{
+		if (dirNames[i][0] == 0 || dirParents[i] != PARENT_SNAPSHOT)
+		{
+			continue;
+		}
+		if (fatBlocks == NULL)
+		{
+			fatBlocks = read_fat(superblock, NULL);
+			blockFrozen = calloc(superblock->data_block_count, sizeof(uint8_t));
+			if (fatBlocks == NULL || blockFrozen == NULL)
+			{
+				arena_free(fatBlocks);
+				return -1;
+			}
+		}
+
+		Root_Directory entry;
+		uint32_t *map = NULL;
+		uint32_t *frozen = NULL;
+		if (load_entry(superblock, i, &entry) == 0 && (map = snapshot_map(superblock, fatBlocks, &entry)) != NULL)
+		{
+			frozen = read_fat(superblock, map);
+		}
+		free(map);
+		if (frozen == NULL)
+		{
+			arena_free(fatBlocks);
+			return -1;
+		}
+		for (uint32_t b = 0; b < superblock->data_block_count; ++b)
+		{
+			blockFrozen[b] |= frozen[b] != 0;
+		}
+		arena_free(frozen);
+	}
+
+	arena_free(fatBlocks);
+	return 0;
+}
+
+/*
+ * Count how many indexed files reference each data block
+ */
+static int build_share_table(Superblock *superblock)
+{
+	blockShares = calloc(superblock->data_block_count, sizeof(uint16_t));
+	if (blockShares == NULL)
+	{
+		return -1;
+	}
+	if (!(superblock->features & FEATURE_FILE_FLAGS))
+	{
+		return 0; // no indexed files, nothing can be shared
+	}
+
+	uint32_t *fatBlocks = load_fat(superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+
+	/*
+	 * Count every reference, then turn counts into extra references
+	 */
+	Root_Directory rdir[DIR_ENTRIES_MAX];
+	uint32_t *index = arena_cluster();
+	if (index == NULL)
+	{
+		arena_free(fatBlocks);
+		return -1;
+	}
+	for (size_t i = 0; i < (size_t)superblock->entry_count; ++i)
+	{
+		if (i % superblock->entries_per_block == 0 && load_dir_block(superblock, i / superblock->entries_per_block, rdir) == -1)
+		{
+			arena_free(index);
+			arena_free(fatBlocks);
+			return -1;
+		}
+		Root_Directory *entry = &rdir[i % superblock->entries_per_block];
+		if (entry->filename[0] == 0 || !(entry->flags & FILE_INDEXED))
+		{
+			continue;
+		}
+		for (uint32_t b = entry->first_data_block_index; b != FAT_EOC; b = fatBlocks[b])
+		{
+			if (read_index_block(superblock, b, index) == -1)
+			{
+				arena_free(index);
+				arena_free(fatBlocks);
+				return -1;
+			}
+			for (size_t slot = 0; slot < superblock->index_entries; ++slot)
+			{
+				if (index[slot] != INDEX_HOLE && index[slot] < superblock->data_block_count)
+				{
+					blockShares[index[slot]]++;
+				}
+			}
+		}
+	}
+	for (uint32_t i = 0; i < superblock->data_block_count; ++i)
+	{
+		blockShares[i] = blockShares[i] > 0 ? blockShares[i] - 1 : 0;
+	}
+
+	arena_free(index);
+	arena_free(fatBlocks);
+	return 0;
+}
+
+/*
+ * Free the fd arrays, closing every fd
+ */
+static void free_fd_table(void)
+{
+	for (int i = 0; i < fdCount; ++i)
+	{
+		free(writeBuffer[i]);
+	}
+	free(fdArray);
+	free(offsetArray);
+	free(appendArray);
+	free(readAheadNext);
+	free(readAheadWindow);
+	free(writeBuffer);
+	free(writeBufferStart);
+	free(writeBufferLen);
+	free(writeError);
+	fdArray = NULL;
+	offsetArray = NULL;
+	appendArray = NULL;
+	readAheadNext = NULL;
+	readAheadWindow = NULL;
+	writeBuffer = NULL;
+	writeBufferStart = NULL;
+	writeBufferLen = NULL;
+	writeError = NULL;
+	fdCount = 0;
+}
+
+/*
+ * Close every directory stream
+ */
+static void free_dir_streams(void)
+{
+	free(dirStreamDir);
+	free(dirStreamNext);
+	dirStreamDir = NULL;
+	dirStreamNext = NULL;
+	dirStreamCount = 0;
+}
+
+/*
+ * realloc one fd or directory stream array to count elements
+ */
+static int grow_array(void *array, size_t size, int count)
+{
+	void *grown = realloc(*(void **)array, size * count);
+	if (grown == NULL)
+	{
+		return -1;
+	}
+	*(void **)array = grown;
+	return 0;
+}
+
+/*
+ * Double the fd arrays (or create them). On failure fdCount stays as it was;
+ * arrays that already grew are simply larger than needed.
+ */
+static int grow_fd_table(void)
+{
+	int newCount = fdCount ? fdCount * 2 : FS_OPEN_MAX_COUNT;
+
+	if (grow_array(&fdArray, sizeof(*fdArray), newCount) == -1 ||
+		grow_array(&offsetArray, sizeof(*offsetArray), newCount) == -1 ||
+		grow_array(&appendArray, sizeof(*appendArray), newCount) == -1 ||
+		grow_array(&readAheadNext, sizeof(*readAheadNext), newCount) == -1 ||
+		grow_array(&readAheadWindow, sizeof(*readAheadWindow), newCount) == -1 ||
+		grow_array(&writeBuffer, sizeof(*writeBuffer), newCount) == -1 ||
+		grow_array(&writeBufferStart, sizeof(*writeBufferStart), newCount) == -1 ||
+		grow_array(&writeBufferLen, sizeof(*writeBufferLen), newCount) == -1 ||
+		grow_array(&writeError, sizeof(*writeError), newCount) == -1)
+	{
+		return -1;
+	}
+
+	for (int i = fdCount; i < newCount; ++i)
+	{
+		fdArray[i] = -1;
+		offsetArray[i] = 0;
+		appendArray[i] = 0;
+		readAheadNext[i] = 0;
+		readAheadWindow[i] = 0;
+		writeBuffer[i] = NULL;
+		writeBufferStart[i] = 0;
+		writeBufferLen[i] = 0;
+		writeError[i] = 0;
+	}
+	fdCount = newCount;
+	return 0;
+}
+
+/*
+ * Write @count bytes of @data to host file @host_fd. Returns the number of
+ * bytes written, short only on error.
+ */
+static size_t host_write(int host_fd, const char *data, size_t count)
+{
+	size_t done = 0;
+	while (done < count)
+	{
+		ssize_t written = write(host_fd, data + done, count - done);
+		if (written <= 0)
+		{
+			break;
+		}
+		done += written;
+	}
+	return done;
+}
+
+/*
+ * Move up to @count bytes from host file @in to host file @out, each at
+ * *@in_offset or *@out_offset (moved past the bytes copied), or at its file
+ * position if NULL. The kernel copies them when it can: copy_file_range()
+ * between regular files, sendfile() from a file to anything else (a pipe or a
+ * socket). Only when neither applies do they go through a buffer. Returns the
+ * number of bytes moved, 0 at the end of @in, -1 on error.
+ */
+static ssize_t host_copy(int in, off_t *in_offset, int out, off_t *out_offset, size_t count)
+{
+	ssize_t moved = copy_file_range(in, in_offset, out, out_offset, count, 0);
+	if (moved >= 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF))
+	{
+		return moved;
+	}
+	if (in_offset != NULL && out_offset == NULL)
+	{
+		moved = sendfile(out, in, in_offset, count);
+		if (moved >= 0 || (errno != EINVAL && errno != ENOSYS))
+		{
+			return moved;
+		}
+	}
+
+	char data[BLOCK_SIZE];
+	if (count > BLOCK_SIZE)
+	{
+		count = BLOCK_SIZE;
+	}
+	moved = in_offset != NULL ? pread(in, data, count, *in_offset) : read(in, data, count);
+	if (moved <= 0)
+	{
+		return moved;
+	}
+	for (ssize_t done = 0; done < moved;)
+	{
+		ssize_t written = out_offset != NULL ? pwrite(out, data + done, moved - done, *out_offset + done) : write(out, data + done, moved - done);
+		if (written <= 0)
+		{
+			return -1;
+		}
+		done += written;
+	}
+	if (in_offset != NULL)
+	{
+		*in_offset += moved;
+	}
+	if (out_offset != NULL)
+	{
+		*out_offset += moved;
+	}
+	return moved;
+}
+
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size, size_t max_files, int flags)
+{
+	if (is_mounted() == 0 || diskname == NULL || data_blocks < 1 || (flags & ~(FS_FORMAT_EXTENTS | FS_FORMAT_INLINE | FS_FORMAT_CHECKSUMS)))
+	{
+		return -1;
+	}
+
+	uint32_t block_shift = 0;
+	while (block_shift < BLOCK_SHIFT_MAX && ((size_t)BLOCK_SIZE << block_shift) < block_size)
+	{
+		block_shift++;
+	}
+	if (((size_t)BLOCK_SIZE << block_shift) != block_size)
+	{
+		return -1; // not a power of two in range
+	}
+
+	/*
+	 * Superblock, FAT, rdir, checksums if any, then the data blocks. The
+	 * original format is kept whenever it can describe the disk. Inline files
+	 * get the largest rdir entries.
+	 */
+	int version = block_shift == 0 && data_blocks < FAT_EOC_V1 && max_files <= FS_FILE_MAX_COUNT && !(flags & FS_FORMAT_INLINE) ? 1 : 2;
+	uint8_t entry_shift = (flags & FS_FORMAT_INLINE) ? ENTRY_SHIFT_MAX : 0;
+	size_t entries_per_block = DIR_ENTRIES_MAX >> entry_shift;
+	size_t entry_size = version == 1 ? sizeof(uint16_t) : sizeof(uint32_t);
+	size_t fat_block_count = (data_blocks * entry_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t root_directory_blocks = max_files > entries_per_block ? (max_files + entries_per_block - 1) / entries_per_block : 1;
+	size_t checksum_blocks = 0;
+	if (flags & FS_FORMAT_CHECKSUMS)
+	{
+		checksum_blocks = ((data_blocks << block_shift) + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+	}
+	size_t data_block_start_index = fat_block_count + 1 + root_directory_blocks + checksum_blocks;
+	size_t total_blocks = data_block_start_index + (data_blocks << block_shift);
+	if ((version == 1 && (fat_block_count > UINT8_MAX || total_blocks > UINT16_MAX)) ||
+		data_blocks >= FAT_EOC || max_files > INT32_MAX || total_blocks > INT32_MAX)
+	{
+		return -1; // too big
+	}
+
+	/*
+	 * A freshly sized file reads as zeros: empty FAT and rdir
+	 */
+	int fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)total_blocks * BLOCK_SIZE) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	/*
+	 * Extent and inline files need flags in rdir entries, and an empty rdir
+	 * is as scrubbed as it gets
+	 */
+	uint8_t features = 0;
+	if (flags & FS_FORMAT_EXTENTS)
+	{
+		features |= FEATURE_FILE_FLAGS | FEATURE_EXTENTS;
+	}
+	if (flags & FS_FORMAT_INLINE)
+	{
+		features |= FEATURE_FILE_FLAGS | FEATURE_INLINE;
+	}
+	if (flags & FS_FORMAT_CHECKSUMS)
+	{
+		features |= FEATURE_CHECKSUMS;
+	}
+
+	char block[BLOCK_SIZE];
+	memset(block, 0, BLOCK_SIZE);
+	if (version == 1)
+	{
+		Disk_Superblock *disk_superblock = (Disk_Superblock *)block;
+		disk_superblock->features = features;
+		memcpy(disk_superblock->signature, "ECS150FS", 8);
+		disk_superblock->total_blocks = total_blocks;
+		disk_superblock->fat_block_count = fat_block_count;
+		disk_superblock->root_directory_index = fat_block_count + 1;
+		disk_superblock->data_block_start_index = data_block_start_index;
+		disk_superblock->data_block_count = data_blocks;
+	}
+	else
+	{
+		Disk_Superblock_V2 *disk_superblock = (Disk_Superblock_V2 *)block;
+		memcpy(disk_superblock->signature, "ECS150V2", 8);
+		disk_superblock->total_blocks = total_blocks;
+		disk_superblock->fat_block_count = fat_block_count;
+		disk_superblock->root_directory_index = fat_block_count + 1;
+		disk_superblock->data_block_start_index = data_block_start_index;
+		disk_superblock->data_block_count = data_blocks;
+		disk_superblock->block_shift = block_shift;
+		disk_superblock->features = features;
+		disk_superblock->root_directory_blocks = root_directory_blocks;
+		disk_superblock->entry_shift = entry_shift;
+	}
+
+	if (block_disk_open(diskname) == -1)
+	{
+		return -1;
+	}
+	int ret = block_write(0, block);
+
+	memset(block, 0, BLOCK_SIZE);
+	if (version == 1)
+	{
+		((uint16_t *)block)[0] = FAT_EOC_V1;
+	}
+	else
+	{
+		((uint32_t *)block)[0] = FAT_EOC;
+	}
+	if (ret == 0)
+	{
+		ret = block_write(1, block);
+	}
+
+	/*
+	 * Every data block starts out zeroed, and checksummed as such
+	 */
+	Block_Checksum *checksums = (Block_Checksum *)block;
+	memset(block, 0, BLOCK_SIZE);
+	uint32_t zero_crc = crc32c(block, BLOCK_SIZE);
+	for (size_t i = 0; i < CHECKSUMS_PER_BLOCK; ++i)
+	{
+		checksums[i].current = checksums[i].previous = zero_crc;
+	}
+	for (size_t n = 0; ret == 0 && n < checksum_blocks; ++n)
+	{
+		ret = block_write(data_block_start_index - checksum_blocks + n, block);
+	}
+
+	if (block_disk_close() == -1)
+	{
+		return -1;
+	}
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	if (block_disk_open(diskname) == -1)
+	{
+		return -1;
+	}
+
+	char block[BLOCK_SIZE];
+	if (block_read(0, block) == -1)
+	{
+		return -1;
+	}
+
+	/*
+	 * Parse either superblock layout into the in-memory one
+	 */
+	Superblock superblock;
+	memset(&superblock, 0, sizeof(Superblock));
+	uint32_t block_shift = 0;
+	uint32_t entry_shift = 0;
+	if (strncmp(block, "ECS150FS", 8) == 0)
+	{
+		Disk_Superblock *disk_superblock = (Disk_Superblock *)block;
+		superblock.version = 1;
+		superblock.total_blocks = disk_superblock->total_blocks;
+		superblock.root_directory_index = disk_superblock->root_directory_index;
+		superblock.data_block_start_index = disk_superblock->data_block_start_index;
+		superblock.data_block_count = disk_superblock->data_block_count;
+		superblock.fat_block_count = disk_superblock->fat_block_count;
+		superblock.features = disk_superblock->features;
+		superblock.root_directory_blocks = 1;
+	}
+	else if (strncmp(block, "ECS150V2", 8) == 0)
+	{
+		Disk_Superblock_V2 *disk_superblock = (Disk_Superblock_V2 *)block;
+		superblock.version = 2;
+		superblock.total_blocks = disk_superblock->total_blocks;
+		superblock.root_directory_index = disk_superblock->root_directory_index;
+		superblock.data_block_start_index = disk_superblock->data_block_start_index;
+		superblock.data_block_count = disk_superblock->data_block_count;
+		superblock.fat_block_count = disk_superblock->fat_block_count;
+		superblock.features = disk_superblock->features;
+		block_shift = disk_superblock->block_shift;
+		superblock.root_directory_blocks = disk_superblock->root_directory_blocks ? disk_superblock->root_directory_blocks : 1;
+		entry_shift = disk_superblock->entry_shift;
+	}
+
+	if (superblock.version == 0 || (int)superblock.total_blocks != block_disk_count() || block_shift > BLOCK_SHIFT_MAX || entry_shift > ENTRY_SHIFT_MAX ||
+		superblock.root_directory_index + (uint64_t)superblock.root_directory_blocks > superblock.data_block_start_index)
+	{
+		block_disk_close();
+		return -1; // invalid signature
+	}
+	if (superblock.features & FEATURE_CHECKSUMS)
+	{
+		uint64_t disk_blocks = (uint64_t)superblock.data_block_count << block_shift;
+		superblock.checksum_blocks = (disk_blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+		if (superblock.root_directory_index + (uint64_t)superblock.root_directory_blocks + superblock.checksum_blocks > superblock.data_block_start_index)
+		{
+			block_disk_close();
+			return -1; // no room for the checksum area
+		}
+	}
+	superblock.entry_size = sizeof(Disk_Entry) << entry_shift;
+	superblock.entries_per_block = DIR_ENTRIES_MAX >> entry_shift;
+	superblock.inline_size = superblock.entry_size - sizeof(Disk_Entry);
+	superblock.entry_count = superblock.root_directory_blocks * superblock.entries_per_block;
+	superblock.cluster_blocks = 1 << block_shift;
+	superblock.cluster_size = (size_t)BLOCK_SIZE << block_shift;
+	superblock.index_entries = superblock.version == 1 ? BLOCK_SIZE / sizeof(uint16_t) : superblock.cluster_size / sizeof(uint32_t);
+
+	/*
+	 * Make sure first entry is FAT_EOC
+	 */
+	if (block_read(1, block) == -1)
+	{
+		block_disk_close();
+		return -1;
+	}
+	if (superblock.version == 1)
+	{
+		((uint16_t *)block)[0] = FAT_EOC_V1;
+	}
+	else
+	{
+		((uint32_t *)block)[0] = FAT_EOC;
+	}
+	if (block_write(1, block) == -1)
+	{
+		block_disk_close();
+		return -1;
+	}
+	mountedSuperblock = superblock;
+
+	free_fd_table();
+	free_dir_streams();
+	openFiles = 0;
+
+	cache_invalidate();
+
+	free(blockShares);
+	blockShares = NULL;
+	free(blockChecksums);
+	blockChecksums = NULL;
+	free(dedupTable);
+	dedupTable = NULL;
+	free(dedupListed);
+	dedupListed = NULL;
+	free(blockFrozen);
+	blockFrozen = NULL;
+	free(snapshotMeta);
+	snapshotMeta = NULL;
+	free_dir_index();
+
+	/*
+	 * fs_sendfile(), fs_recvfile() and fs_mmap() have the kernel move data
+	 * blocks in and out of the image through a descriptor of its own
+	 */
+	imageFd = open(diskname, O_RDWR);
+	if (imageFd == -1 || arena_init(&superblock) == -1 || load_checksums(&superblock) == -1 || build_share_table(&superblock) == -1 ||
+		build_dir_index(&superblock) == -1 || build_frozen(&superblock) == -1)
+	{
+		if (imageFd != -1)
+		{
+			close(imageFd);
+			imageFd = -1;
+		}
+		free(blockChecksums);
+		blockChecksums = NULL;
+		free(blockFrozen);
+		blockFrozen = NULL;
+		free_dir_index();
+		arena_destroy();
+		mountedSuperblock.version = 0;
+		block_disk_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+int fs_umount(void)
+{
+	if (block_disk_count() == -1)
+	{
+		return -1;
+	}
+
+	/*
+	 * The disk goes away even if some buffered bytes couldn't be flushed, but
+	 * the caller gets to know they're lost
+	 */
+	int ret = fs_sync();
+
+	if (block_disk_close() == -1)
+	{
+		return -1;
+	}
+	if (imageFd != -1)
+	{
+		close(imageFd);
+		imageFd = -1;
+	}
+
+	/*
+	 * reset fd arrays
+	 */
+	free_fd_table();
+	free_dir_streams();
+	openFiles = 0;
+
+	cache_invalidate();
+
+	free(blockShares);
+	blockShares = NULL;
+	free(blockChecksums);
+	blockChecksums = NULL;
+	free(dedupTable);
+	dedupTable = NULL;
+	free(dedupListed);
+	dedupListed = NULL;
+	free(blockFrozen);
+	blockFrozen = NULL;
+	free(snapshotMeta);
+	snapshotMeta = NULL;
+	free_dir_index();
+	arena_destroy();
+	mountedSuperblock.version = 0;
+
+	return ret;
+}
+
+int fs_info(void)
+{
+	/*
+	 * Buffered writes go out first, so that the free blocks shown count them
+	 */
+	fs_sync();
+
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	int filesWritten = files_written();
+	int fatBlocksWritten = fat_blocks_written();
+
+	printf("FS Info:\ntotal_blk_count=%u\nfat_blk_count=%u\nrdir_blk=%u\ndata_blk=%u\ndata_blk_count=%u\nfat_free_ratio=%u/%u\nrdir_free_ratio=%i/%i\n",
+		   superblock.total_blocks, superblock.fat_block_count, superblock.root_directory_index, superblock.data_block_start_index,
+		   superblock.data_block_count, superblock.data_block_count - fatBlocksWritten, superblock.data_block_count, superblock.entry_count - filesWritten, superblock.entry_count);
+	if (superblock.version != 1)
+	{
+		printf("data_blk_size=%zu\n", superblock.cluster_size);
+	}
+
+	return 0;
+}
+
+int fs_snapshot(const char *name)
+{
+	/*
+	 * Buffered writes are part of the snapshot. Flushing can turn file flags
+	 * on in the superblock, so it goes first.
+	 */
+	if (snapshotMeta != NULL || fs_sync() == -1)
+	{
+		return -1;
+	}
+
+	Superblock superblock;
+	uint32_t parent;
+	char snapshot_name[FS_FILENAME_LEN];
+	if (load_superblock_rw(&superblock) == -1 || resolve_path(name, &parent, snapshot_name) == -1 || parent != PARENT_ROOT)
+	{
+		return -1;
+	}
+	if (enable_file_flags(&superblock) == -1 || lookup(PARENT_SNAPSHOT, snapshot_name) != -1)
+	{
+		return -1;
+	}
+	int rdir_index = find_free_entry(&superblock);
+	if (rdir_index == -1)
+	{
+		return -1;
+	}
+
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+	uint8_t *frozen = calloc(superblock.data_block_count, sizeof(uint8_t));
+	if (frozen == NULL)
+	{
+		arena_free(fatBlocks);
+		return -1;
+	}
+	for (uint32_t b = 0; b < superblock.data_block_count; ++b)
+	{
+		frozen[b] = (fatBlocks[b] != 0 && fatBlocks[b] != FAT_FROZEN) || (blockFrozen != NULL && blockFrozen[b]);
+	}
+
+	/*
+	 * Copy the FAT and rdir as they are on disk, so without the chain of the
+	 * copy itself, which is only stored after it. The entry goes last: a crash
+	 * before it leaks the chain at worst.
+	 */
+	Root_Directory entry;
+	memset(&entry, 0, sizeof(Root_Directory));
+	strcpy(entry.filename, snapshot_name);
+	entry.parent = PARENT_SNAPSHOT;
+	entry.first_data_block_index = FAT_EOC;
+	size_t count = snapshot_blocks(&superblock);
+	entry.size = count * BLOCK_SIZE;
+	int ret = extend_chain(fatBlocks, superblock.data_block_count, &entry, (count + superblock.cluster_blocks - 1) / superblock.cluster_blocks);
+	char *cluster = arena_cluster();
+	if (cluster == NULL)
+	{
+		ret = -1;
+	}
+	size_t copied = 0;
+	for (uint32_t i = entry.first_data_block_index; ret == 0 && i != FAT_EOC; i = fatBlocks[i])
+	{
+		memset(cluster, 0, superblock.cluster_size);
+		for (size_t j = 0; j < superblock.cluster_blocks && copied < count && ret == 0; ++j)
+		{
+			ret = block_read(++copied, cluster + j * BLOCK_SIZE);
+		}
+		if (ret == 0)
+		{
+			ret = cluster_write(&superblock, i, cluster);
+		}
+		frozen[i] = 0;
+	}
+	if (ret == 0 && (store_fat(&superblock, fatBlocks) == -1 || store_entry(&superblock, rdir_index, &entry) == -1))
+	{
+		ret = -1;
+	}
+	if (ret == 0)
+	{
+		free(blockFrozen);
+		blockFrozen = frozen;
+	}
+	else
+	{
+		free(frozen);
+	}
+
+	arena_free(cluster);
+	arena_free(fatBlocks);
+	return ret;
+}
+
+int fs_snapshot_mount(const char *diskname, const char *name)
+{
+	if (fs_mount(diskname) == -1)
+	{
+		return -1;
+	}
+
+	Superblock superblock = mountedSuperblock;
+	uint32_t parent;
+	char snapshot_name[FS_FILENAME_LEN];
+	int rdir_index = -1;
+	if (resolve_path(name, &parent, snapshot_name) == 0 && parent == PARENT_ROOT)
+	{
+		rdir_index = lookup(PARENT_SNAPSHOT, snapshot_name);
+	}
+	Root_Directory entry;
+	uint32_t *fatBlocks = NULL;
+	uint32_t *map = NULL;
+	if (rdir_index != -1 && load_entry(&superblock, rdir_index, &entry) == 0 && (fatBlocks = load_fat(&superblock)) != NULL)
+	{
+		map = snapshot_map(&superblock, fatBlocks, &entry);
+	}
+	arena_free(fatBlocks);
+	if (map == NULL)
+	{
+		fs_umount();
+		return -1;
+	}
+
+	/*
+	 * From now on the FAT and rdir come from the copy, which nothing changes
+	 */
+	snapshotMeta = map;
+	free(blockFrozen);
+	blockFrozen = NULL;
+	free(blockShares);
+	blockShares = NULL;
+	free_dir_index();
+	if (build_share_table(&superblock) == -1 || build_dir_index(&superblock) == -1)
+	{
+		fs_umount();
+		return -1;
+	}
+	return 0;
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	Superblock superblock;
+	uint32_t parent;
+	char snapshot_name[FS_FILENAME_LEN];
+	if (load_superblock_rw(&superblock) == -1 || resolve_path(name, &parent, snapshot_name) == -1 || parent != PARENT_ROOT)
+	{
+		return -1;
+	}
+	int rdir_index = lookup(PARENT_SNAPSHOT, snapshot_name);
+	Root_Directory entry;
+	if (rdir_index == -1 || load_entry(&superblock, rdir_index, &entry) == -1)
+	{
+		return -1;
+	}
+
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+	free_chain(fatBlocks, entry.first_data_block_index);
+	memset(&entry, 0, sizeof(Root_Directory));
+
+	// rdir first so a crash in between only leaks blocks
+	int ret = 0;
+	if (store_entry(&superblock, rdir_index, &entry) == -1 || store_fat(&superblock, fatBlocks) == -1 || build_frozen(&superblock) == -1)
+	{
+		ret = -1;
+	}
+
+	arena_free(fatBlocks);
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+
+	/*
+	 * Obtain superblock
+	 */
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
+	/*
+	 * Proper file init and err checking
+	 */
+	uint32_t parent;
+	char fileStore[FS_FILENAME_LEN];
+	if (resolve_path(filename, &parent, fileStore) == -1)
+	{
+		return -1; // invalid name, or no such directory
+	}
+
+	/*
+	 * See if filename already exists, and find a spot for it
+	 */
+	if (lookup(parent, fileStore) != -1)
+	{
+		return -1;
+	}
+	int rdir_index = find_free_entry(&superblock);
+	if (rdir_index == -1)
+	{
+		return -1; // too many files
+	}
+
+	/*
+	 * Create new rdir entry
+	 */
+	Root_Directory new_dir_entry;
+	memset(&new_dir_entry, 0, sizeof(Root_Directory));
+	strcpy(new_dir_entry.filename, fileStore);
+	new_dir_entry.size = 0;
+	new_dir_entry.first_data_block_index = FAT_EOC;
+	new_dir_entry.parent = parent;
+	if (superblock.features & FEATURE_EXTENTS)
+	{
+		new_dir_entry.flags = FILE_EXTENTS;
+	}
+	if (superblock.features & FEATURE_INLINE)
+	{
+		new_dir_entry.flags |= FILE_INLINE;
+	}
+
+	if (store_entry(&superblock, rdir_index, &new_dir_entry) == -1)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int fs_delete(const char *filename)
+{
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	/*
+	 * Fetch the rdir entry from disk, directories go through fs_rmdir()
+	 */
+	Root_Directory dirRemoval;
+	int rdir_index = find_file(filename);
+	if (rdir_index == -1 || dirIsDirectory[rdir_index] || load_entry(&superblock, rdir_index, &dirRemoval) == -1)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < fdCount; ++i)
+	{
+		if (fdArray[i] == rdir_index)
+		{
+			return -1; // file is still open
+		}
+	}
+
+	/*
+	 * Fetch fat blocks from disk and free the whole chain in one pass
+	 */
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+	free_blocks_from(&superblock, fatBlocks, &dirRemoval, 0);
+
+	memset(&dirRemoval, 0, sizeof(Root_Directory)); // effectively removes the file
+
+	// write both back into disk, rdir first so a crash in between only leaks blocks
+	if (store_entry(&superblock, rdir_index, &dirRemoval) == -1 || store_fat(&superblock, fatBlocks) == -1)
+	{
+		arena_free(fatBlocks);
+		return -1;
+	}
+
+	arena_free(fatBlocks);
+
+	return 0;
+}
+
+/*
+ * Common part of fs_copy() and fs_clone(): check both names, load the source
+ * entry into @from and the FAT, and pick a free rdir entry for @dst, set up
+ * in @copy named @dst and otherwise zeroed. Returns the index of that entry,
+ * or -1.
+ */
+static int prepare_copy(Superblock *superblock, uint32_t **fatBlocks, const char *src, int *src_idx, const char *dst, Root_Directory *from, Root_Directory *copy)
+{
+	if (load_superblock_rw(superblock) == -1)
+	{
+		return -1;
+	}
+	uint32_t parent;
+	char name[FS_FILENAME_LEN];
+	if (resolve_path(dst, &parent, name) == -1)
+	{
+		return -1;
+	}
+
+	*src_idx = find_file(src);
+	if (*src_idx == -1 || dirIsDirectory[*src_idx] || lookup(parent, name) != -1)
+	{
+		return -1; // no source, or destination already exists
+	}
+
+	/*
+	 * Pending writes to the source have to be part of the copy
+	 */
+	flush_file(*src_idx);
+	if (load_superblock(superblock) == -1 || load_entry(superblock, *src_idx, from) == -1)
+	{
+		return -1;
+	}
+
+	int dst_idx = find_free_entry(superblock);
+	if (dst_idx == -1)
+	{
+		return -1; // too many files
+	}
+
+	*fatBlocks = load_fat(superblock);
+	if (*fatBlocks == NULL)
+	{
+		return -1;
+	}
+
+	memset(copy, 0, sizeof(Root_Directory));
+	strcpy(copy->filename, name);
+	copy->parent = parent;
+	copy->first_data_block_index = FAT_EOC;
+	return dst_idx;
+}
+
+/*
+ * Finish copying (or cloning) inline file @from, rdir entry @src_idx, as
+ * @copy, rdir entry @dst_idx: there are no blocks to copy or share, just the
+ * inline area to carry over
+ */
+static int copy_inline(Superblock *superblock, int src_idx, Root_Directory *from, int dst_idx, Root_Directory *copy)
+{
+	char data[INLINE_SIZE_MAX];
+	if (load_inline(superblock, src_idx, data) == -1)
+	{
+		return -1;
+	}
+	copy->flags = from->flags;
+	copy->size = from->size;
+	return store_entry_inline(superblock, dst_idx, copy, data);
+}
+
+int fs_copy(const char *src, const char *dst)
+{
+	Superblock superblock;
+	Root_Directory source;
+	Root_Directory copy; // its rdir entry stays free until the copy is done
+	uint32_t *fatBlocks;
+	int src_idx;
+	int dst_idx = prepare_copy(&superblock, &fatBlocks, src, &src_idx, dst, &source, &copy);
+	if (dst_idx == -1)
+	{
+		return -1;
+	}
+	Root_Directory *from = &source;
+	if (file_flags(&superblock, from) & FILE_INLINE)
+	{
+		arena_free(fatBlocks);
+		return copy_inline(&superblock, src_idx, from, dst_idx, &copy);
+	}
+
+	/*
+	 * Lay out the copy like the source: one chain for a chain file, extents
+	 * for an extent one, the same holes for an indexed one. Data blocks come
+	 * in one contiguous run if the disk has one. Compressed units are copied
+	 * as they are stored, so whole units.
+	 */
+	size_t cluster_size = superblock.cluster_size;
+	size_t count = (from->size + cluster_size - 1) / cluster_size;
+	if (file_flags(&superblock, from) & FS_FLAG_COMPRESS)
+	{
+		count = (count + COMPRESS_UNIT - 1) / COMPRESS_UNIT * COMPRESS_UNIT;
+	}
+	uint32_t *src_blocks = malloc(sizeof(uint32_t) * (count + 1));
+	uint32_t *dst_blocks = malloc(sizeof(uint32_t) * (count + 1));
+	char *staging = malloc(cluster_size * COPY_BATCH);
+	int ret = -1;
+	if (src_blocks == NULL || dst_blocks == NULL || staging == NULL ||
+		map_blocks(&superblock, fatBlocks, from, 0, count, src_blocks) == -1)
+	{
+		goto out;
+	}
+
+	if (!(file_flags(&superblock, from) & FILE_INDEXED))
+	{
+		copy.flags = from->flags;
+		if (extend_file(&superblock, fatBlocks, &copy, count) == -1 ||
+			map_blocks(&superblock, fatBlocks, &copy, 0, count, dst_blocks) == -1)
+		{
+			goto out;
+		}
+	}
+	else
+	{
+		copy.flags = from->flags;
+		size_t data_blocks = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			data_blocks += src_blocks[i] != INDEX_HOLE && src_blocks[i] != INDEX_COMPRESSED;
+		}
+		size_t free_blocks = 0;
+		for (uint32_t i = 1; i < superblock.data_block_count; ++i)
+		{
+			free_blocks += fatBlocks[i] == 0;
+		}
+		if (free_blocks < data_blocks + (count + superblock.index_entries - 1) / superblock.index_entries ||
+			ensure_index(&superblock, fatBlocks, &copy, count) == -1)
+		{
+			goto out;
+		}
+		uint32_t run = data_blocks > 0 ? find_free_run(fatBlocks, superblock.data_block_count, data_blocks, 1) : FAT_EOC;
+		for (size_t i = 0; i < count; ++i)
+		{
+			dst_blocks[i] = src_blocks[i] == INDEX_COMPRESSED ? INDEX_COMPRESSED : INDEX_HOLE;
+			if (src_blocks[i] != INDEX_HOLE && src_blocks[i] != INDEX_COMPRESSED)
+			{
+				dst_blocks[i] = run == FAT_EOC ? fs_allocate_block(fatBlocks, superblock.data_block_count) : run++;
+				fatBlocks[dst_blocks[i]] = FAT_EOC;
+			}
+		}
+	}
+
+	/*
+	 * Move the data COPY_BATCH blocks at a time, straight from block to
+	 * block, without going through the cache
+	 */
+	for (size_t i = 0; i < count; i += COPY_BATCH)
+	{
+		size_t batch = count - i < COPY_BATCH ? count - i : COPY_BATCH;
+		for (size_t j = 0; j < batch * superblock.cluster_blocks; ++j)
+		{
+			uint32_t src_block = src_blocks[i + j / superblock.cluster_blocks];
+			size_t disk_block = cluster_block(&superblock, src_block) + j % superblock.cluster_blocks;
+			if (src_block != INDEX_HOLE && src_block != INDEX_COMPRESSED &&
+				(block_read(disk_block, staging + j * BLOCK_SIZE) == -1 || checksum_verify(disk_block, staging + j * BLOCK_SIZE) == -1))
+			{
+				goto out;
+			}
+		}
+		for (size_t j = 0; j < batch; ++j)
+		{
+			if (dst_blocks[i + j] != INDEX_HOLE && dst_blocks[i + j] != INDEX_COMPRESSED && cluster_write(&superblock, dst_blocks[i + j], staging + j * cluster_size) == -1)
+			{
+				goto out;
+			}
+		}
+	}
+
+	if ((file_flags(&superblock, &copy) & FILE_INDEXED) && store_index(&superblock, fatBlocks, &copy, 0, count, dst_blocks) == -1)
+	{
+		goto out;
+	}
+	copy.size = from->size;
+
+	/*
+	 * FAT first so a crash in between only leaks blocks
+	 */
+	if (store_fat(&superblock, fatBlocks) == 0 && store_entry(&superblock, dst_idx, &copy) == 0)
+	{
+		ret = 0;
+	}
+
+out:
+	free(staging);
+	free(dst_blocks);
+	free(src_blocks);
+	arena_free(fatBlocks);
+	return ret;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	Superblock superblock;
+	Root_Directory source;
+	Root_Directory copy; // its rdir entry stays free until the clone is done
+	uint32_t *fatBlocks;
+	int src_idx;
+	int dst_idx = prepare_copy(&superblock, &fatBlocks, src, &src_idx, dst, &source, &copy);
+	if (dst_idx == -1)
+	{
+		return -1;
+	}
+	Root_Directory *from = &source;
+	if (file_flags(&superblock, from) & FILE_INLINE)
+	{
+		arena_free(fatBlocks);
+		return copy_inline(&superblock, src_idx, from, dst_idx, &copy);
+	}
+
+	/*
+	 * Sharing needs both files indexed: the clone gets its own index blocks
+	 * pointing at the source's data blocks, whole units of them if compressed
+	 */
+	size_t count = (from->size + superblock.cluster_size - 1) / superblock.cluster_size;
+	if (file_flags(&superblock, from) & FS_FLAG_COMPRESS)
+	{
+		count = (count + COMPRESS_UNIT - 1) / COMPRESS_UNIT * COMPRESS_UNIT;
+	}
+	uint32_t *blocks = malloc(sizeof(uint32_t) * (count + 1));
+	int ret = -1;
+	if (blocks == NULL || convert_to_indexed(&superblock, fatBlocks, src_idx, from) == -1 ||
+		map_blocks(&superblock, fatBlocks, from, 0, count, blocks) == -1)
+	{
+		goto out;
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (blocks[i] != INDEX_HOLE && blocks[i] != INDEX_COMPRESSED && blockShares[blocks[i]] == UINT16_MAX)
+		{
+			goto out; // too many clones of this block already
+		}
+	}
+
+	copy.flags = from->flags;
+	if (ensure_index(&superblock, fatBlocks, &copy, count) == -1 ||
+		store_index(&superblock, fatBlocks, &copy, 0, count, blocks) == -1)
+	{
+		free_chain(fatBlocks, copy.first_data_block_index);
+		goto out;
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (blocks[i] != INDEX_HOLE && blocks[i] != INDEX_COMPRESSED)
+		{
+			blockShares[blocks[i]]++;
+		}
+	}
+	copy.size = from->size;
+
+	if (store_fat(&superblock, fatBlocks) == 0 && store_entry(&superblock, dst_idx, &copy) == 0)
+	{
+		ret = 0;
+	}
+
+out:
+	free(blocks);
+	arena_free(fatBlocks);
+	return ret;
+}
+
+int fs_ls(void)
+{
+	/*
+	 * Buffered writes go out first, so that sizes agree with fs_stat()
+	 */
+	fs_sync();
+
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	printf("FS Ls:\n");
+	Root_Directory rdir[DIR_ENTRIES_MAX];
+	for (int i = 0; i < superblock.entry_count; ++i)
+	{
+		/*
+		 * Fetch each rdir block from disk as the listing reaches it
+		 */
+		if (i % superblock.entries_per_block == 0 && load_dir_block(&superblock, i / superblock.entries_per_block, rdir) == -1)
+		{
+			return -1;
+		}
+		Root_Directory *entry = &rdir[i % superblock.entries_per_block];
+		if (entry->filename[0] != 0 && entry->parent == PARENT_ROOT)
+		{
+			if (file_flags(&superblock, entry) & FILE_DIRECTORY)
+			{
+				printf("dir: %s\n", entry->filename);
+				continue;
+			}
+			uint32_t data_blk = entry->first_data_block_index;
+			if (data_blk == FAT_EOC && superblock.version == 1)
+			{
+				data_blk = FAT_EOC_V1; // what older versions printed
+			}
+			printf("file: %s, size: %u, data_blk: %u\n", entry->filename, entry->size, data_blk);
+		}
+	}
+
+	return 0;
+}
+
+int fs_mkdir(const char *path)
+{
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	uint32_t parent;
+	char name[FS_FILENAME_LEN];
+	if (resolve_path(path, &parent, name) == -1 || lookup(parent, name) != -1)
+	{
+		return -1; // invalid name, no such parent, or already exists
+	}
+	int rdir_index = find_free_entry(&superblock);
+	if (rdir_index == -1)
+	{
+		return -1; // too many files
+	}
+
+	/*
+	 * Entries only remember their parent with file flags on
+	 */
+	if (enable_file_flags(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	Root_Directory new_dir_entry;
+	memset(&new_dir_entry, 0, sizeof(Root_Directory));
+	strcpy(new_dir_entry.filename, name);
+	new_dir_entry.first_data_block_index = FAT_EOC;
+	new_dir_entry.flags = FILE_DIRECTORY;
+	new_dir_entry.parent = parent;
+	return store_entry(&superblock, rdir_index, &new_dir_entry);
+}
+
+int fs_rmdir(const char *path)
+{
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	int rdir_index = find_file(path);
+	if (rdir_index == -1 || !dirIsDirectory[rdir_index] || dirChildren[rdir_index] != 0)
+	{
+		return -1; // no such directory, or not empty
+	}
+	for (int i = 0; i < dirStreamCount; ++i)
+	{
+		if (dirStreamNext[i] != -1 && dirStreamDir[i] == (uint32_t)rdir_index + 1)
+		{
+			return -1; // still being listed
+		}
+	}
+
+	Root_Directory dirRemoval;
+	memset(&dirRemoval, 0, sizeof(Root_Directory));
+	return store_entry(&superblock, rdir_index, &dirRemoval);
+}
+
+int fs_opendir(const char *path)
+{
+	if (is_mounted() < 0)
+	{
+		return -1;
+	}
+
+	/*
+	 * An empty path, or only slashes, is the root directory
+	 */
+	uint32_t dir = PARENT_ROOT;
+	if (path == NULL)
+	{
+		return -1;
+	}
+	if (path[strspn(path, "/")] != 0)
+	{
+		int rdir_index = find_file(path);
+		if (rdir_index == -1 || !dirIsDirectory[rdir_index])
+		{
+			return -1;
+		}
+		dir = rdir_index + 1;
+	}
+
+	int dd = -1;
+	for (int i = 0; i < dirStreamCount && dd == -1; ++i)
+	{
+		if (dirStreamNext[i] == -1)
+		{
+			dd = i;
+		}
+	}
+	if (dd == -1)
+	{
+		int newCount = dirStreamCount ? dirStreamCount * 2 : FS_OPEN_MAX_COUNT;
+		if (grow_array(&dirStreamDir, sizeof(*dirStreamDir), newCount) == -1 ||
+			grow_array(&dirStreamNext, sizeof(*dirStreamNext), newCount) == -1)
+		{
+			return -1;
+		}
+		for (int i = dirStreamCount; i < newCount; ++i)
+		{
+			dirStreamNext[i] = -1;
+		}
+		dd = dirStreamCount;
+		dirStreamCount = newCount;
+	}
+
+	dirStreamDir[dd] = dir;
+	dirStreamNext[dd] = 0;
+	return dd;
+}
+
+/*
+ * Fill @dirent from rdir entry @idx, read as @entry
+ */
+static int fill_dirent(Superblock *superblock, uint32_t *fatBlocks, int idx, Root_Directory *entry, struct fs_dirent *dirent)
+{
+	if (file_layout(superblock, fatBlocks, entry, &dirent->block_count, &dirent->fragments) == -1)
+	{
+		return -1;
+	}
+	strcpy(dirent->name, entry->filename);
+	dirent->size = entry->size;
+	dirent->is_directory = dirIsDirectory[idx];
+	dirent->first_block = entry->first_data_block_index == FAT_EOC ? -1 : (long)entry->first_data_block_index;
+	return 0;
+}
+
+int fs_readdir(int dd, struct fs_dirent *dirent)
+{
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+	if ((dd < 0) || (dd >= dirStreamCount) || (dirStreamNext[dd] == -1) || (dirent == NULL))
+	{
+		return -1; // its closed or invalid
+	}
+
+	/*
+	 * Names come from the directory index, only the size and blocks need the
+	 * rdir and the FAT
+	 */
+	for (int i = dirStreamNext[dd]; i < superblock.entry_count; ++i)
+	{
+		if (dirNames[i][0] == 0 || dirParents[i] != dirStreamDir[dd])
+		{
+			continue;
+		}
+
+		flush_file(i);
+		Root_Directory entry;
+		if (load_entry(&superblock, i, &entry) == -1)
+		{
+			return -1;
+		}
+		uint32_t *fatBlocks = load_fat(&superblock);
+		if (fatBlocks == NULL)
+		{
+			return -1;
+		}
+		int ret = fill_dirent(&superblock, fatBlocks, i, &entry, dirent);
+		arena_free(fatBlocks);
+		if (ret == -1)
+		{
+			return -1;
+		}
+		dirStreamNext[dd] = i + 1;
+		return 1;
+	}
+
+	dirStreamNext[dd] = superblock.entry_count;
+	return 0;
+}
+
+int fs_closedir(int dd)
+{
+	if (is_mounted() < 0)
+	{
+		return -1;
+	}
+	if ((dd < 0) || (dd >= dirStreamCount) || (dirStreamNext[dd] == -1))
+	{
+		return -1; // its already closed or invalid!
+	}
+	dirStreamNext[dd] = -1;
+	return 0;
+}
+
+int fs_stat_all(const char *path, struct fs_dirent *dirents, int count)
+{
+	if (is_mounted() < 0 || path == NULL || (dirents == NULL && count != 0))
+	{
+		return -1;
+	}
+
+	/*
+	 * An empty path, or only slashes, is the root directory
+	 */
+	uint32_t dir = PARENT_ROOT;
+	if (path[strspn(path, "/")] != 0)
+	{
+		int rdir_index = find_file(path);
+		if (rdir_index == -1 || !dirIsDirectory[rdir_index])
+		{
+			return -1;
+		}
+		dir = rdir_index + 1;
+	}
+
+	/*
+	 * Flushing can turn file flags on in the superblock and moves blocks
+	 * around, so it all goes before anything is loaded
+	 */
+	for (int i = 0; i < mountedSuperblock.entry_count; ++i)
+	{
+		if (dirNames[i][0] != 0 && dirParents[i] == dir)
+		{
+			flush_file(i);
+		}
+	}
+
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+
+	/*
+	 * Entries are picked out of the directory index, and each rdir block is
+	 * only read once the first of them that is wanted comes up
+	 */
+	Root_Directory rdir[DIR_ENTRIES_MAX];
+	long loaded = -1;
+	int found = 0;
+	for (int i = 0; i < superblock.entry_count; ++i)
+	{
+		if (dirNames[i][0] == 0 || dirParents[i] != dir)
+		{
+			continue;
+		}
+		if (found < count)
+		{
+			long n = i / superblock.entries_per_block;
+			if (n != loaded && load_dir_block(&superblock, n, rdir) == -1)
+			{
+				arena_free(fatBlocks);
+				return -1;
+			}
+			loaded = n;
+			if (fill_dirent(&superblock, fatBlocks, i, &rdir[i % superblock.entries_per_block], &dirents[found]) == -1)
+			{
+				arena_free(fatBlocks);
+				return -1;
+			}
+		}
+		found++;
+	}
+
+	arena_free(fatBlocks);
+	return found;
+}
+
+int fs_stat_name(const char *filename, struct fs_dirent *dirent)
+{
+	if (is_mounted() < 0 || filename == NULL || dirent == NULL)
+	{
+		return -1;
+	}
+
+	/*
+	 * The directory index finds the entry, without an fd or any rdir read
+	 */
+	int rdir_index = find_file(filename);
+	if (rdir_index == -1)
+	{
+		return -1;
+	}
+	flush_file(rdir_index);
+
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+	Root_Directory entry;
+	if (load_entry(&superblock, rdir_index, &entry) == -1)
+	{
+		return -1;
+	}
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+	int ret = fill_dirent(&superblock, fatBlocks, rdir_index, &entry, dirent);
+	arena_free(fatBlocks);
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_flags(filename, 0);
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	if (flags & ~FS_OPEN_APPEND)
+	{
+		return -1; // unknown flags
+	}
+
+	/*
+	 * Open superblock
+	 */
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	/*
+	 * Search for file name
+	 */
+	int rdir_idx = find_file(filename);
+	if (rdir_idx == -1 || dirIsDirectory[rdir_idx])
+	{
+		return -1; // no such file
+	}
+
+	/*
+	 * Pick out open file descriptor, growing the fd arrays when all are taken
+	 */
+	if (openFiles == fdCount && grow_fd_table() == -1)
+	{
+		return -1; // too many files open
+	}
+	int fd = -1;
+	for (int i = 0; i < fdCount; ++i)
+	{
+		if (fdArray[i] == -1)
+		{
+			fd = i;
+			break;
+		}
+	}
+
+	writeBuffer[fd] = malloc(superblock.cluster_size);
+	if (writeBuffer[fd] == NULL)
+	{
+		return -1;
+	}
+	fdArray[fd] = rdir_idx;
+	offsetArray[fd] = 0;
+	appendArray[fd] = flags & FS_OPEN_APPEND;
+	openFiles++;
+	return fd;
+}
+
+int fs_close(int fd)
+{
+	if (is_mounted() < 0)
+	{
+		return -1; // disk hasnt been mounted yet
+	}
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1))
+	{
+		return -1; // its already closed or invalid!
+	}
+	else
+	{
+		int ret = flush_fd(fd); // report writes that were lost on the way out
+		fdArray[fd] = -1;	 // defacto close
+		offsetArray[fd] = 0; // reset offset
+		readAheadNext[fd] = 0;
+		readAheadWindow[fd] = 0;
+		writeError[fd] = 0;
+		free(writeBuffer[fd]);
+		writeBuffer[fd] = NULL;
+		openFiles--;
+		return ret;
+	}
+}
+
+int fs_stat(int fd)
+{
+	/*
+	 * Open superblock
+	 */
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1))
+	{
+		return -1; // its closed or invalid
+	}
+
+	flush_file(fdArray[fd]);
+
+	/*
+	 * Open rdir entry
+	 */
+	Root_Directory entry;
+	if (load_entry(&superblock, fdArray[fd], &entry) == -1)
+	{
+		return -1;
+	}
+
+	return entry.size;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+
+	if (is_mounted() < 0)
+	{
+		return -1; // disk hasnt been mounted yet
+	}
+
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1))
+	{
+		return -1; // its closed or invalid
+	}
+
+	if (offset != offsetArray[fd])
+	{
+		flush_fd(fd);
+	}
+	offsetArray[fd] = offset;
+
+	return 0;
+}
+
+int fs_sync(void)
+{
+	if (is_mounted() < 0)
+	{
+		return -1; // disk hasnt been mounted yet
+	}
+
+	int ret = 0;
+	for (int i = 0; i < fdCount; ++i)
+	{
+		if (fdArray[i] != -1 && flush_fd(i) == -1)
+		{
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int fs_truncate(int fd, size_t size)
+{
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1))
+	{
+		return -1; // its closed or invalid
+	}
+	if (size > UINT32_MAX)
+	{
+		return -1; // rdir entries hold 32-bit sizes
+	}
+
+	/*
+	 * Flushing can turn file flags on in the superblock, so it goes first
+	 */
+	flush_file(fdArray[fd]);
+
+	/*
+	 * Open superblock
+	 */
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	/*
+	 * Open rdir and fat blocks
+	 */
+	Root_Directory file_entry;
+	if (load_entry(&superblock, fdArray[fd], &file_entry) == -1)
+	{
+		return -1;
+	}
+	Root_Directory *entry = &file_entry;
+
+	/*
+	 * An inline file that still fits only changes in its rdir entry, one that
+	 * no longer does moves out to data blocks first
+	 */
+	int inline_file = file_flags(&superblock, entry) & FILE_INLINE;
+	if (inline_file && size <= superblock.inline_size)
+	{
+		return write_inline(&superblock, fdArray[fd], entry, 0, NULL, 0, size);
+	}
+
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+	if ((inline_file && spill_inline(&superblock, fatBlocks, fdArray[fd], entry) == -1) || thaw_file(&superblock, fatBlocks, fdArray[fd], entry) == -1)
+	{
+		arena_free(fatBlocks);
+		return -1;
+	}
+
+	size_t cluster_size = superblock.cluster_size;
+	size_t new_blocks = (size + cluster_size - 1) / cluster_size;
+	int compressed = file_flags(&superblock, entry) & FS_FLAG_COMPRESS;
+
+	/*
+	 * Units of a compressed file are zero past EOF and never preallocated, so
+	 * only shrinking into the middle of a unit has bytes to zero, by storing
+	 * that unit again. Whole units go or stay.
+	 */
+	size_t unit_size = COMPRESS_UNIT * cluster_size;
+	if (compressed && size < entry->size && size % unit_size)
+	{
+		uint32_t slots[COMPRESS_UNIT];
+		char *data = arena_alloc(unit_size);
+		char *scratch = arena_alloc(unit_size);
+		int ret = data == NULL || scratch == NULL ? -1 : 0;
+		size_t u = size / unit_size;
+		if (ret == 0)
+		{
+			ret = map_blocks(&superblock, fatBlocks, entry, u * COMPRESS_UNIT, COMPRESS_UNIT, slots);
+		}
+		if (ret == 0 && !is_hole_unit(slots))
+		{
+			ret = load_unit(&superblock, slots, data, scratch);
+			if (ret == 0)
+			{
+				memset(data + size % unit_size, 0, unit_size - size % unit_size);
+				ret = store_unit(&superblock, fatBlocks, slots, data, scratch, 1);
+			}
+			if (ret == 0)
+			{
+				ret = store_index(&superblock, fatBlocks, entry, u * COMPRESS_UNIT, COMPRESS_UNIT, slots);
+			}
+		}
+		arena_free(scratch);
+		arena_free(data);
+		if (ret == -1)
+		{
+			arena_free(fatBlocks);
+			return -1;
+		}
+	}
+	if (compressed)
+	{
+		new_blocks = (size + unit_size - 1) / unit_size * COMPRESS_UNIT;
+	}
+
+	/*
+	 * Growing leaves holes, so a chain file that doesn't already have the
+	 * blocks (preallocated) becomes an indexed one
+	 */
+	if (size > entry->size && !(file_flags(&superblock, entry) & FILE_INDEXED))
+	{
+		long chain_length = file_blocks(&superblock, fatBlocks, entry);
+		if (chain_length == -1 || ((size_t)chain_length < new_blocks && convert_to_indexed(&superblock, fatBlocks, fdArray[fd], entry) == -1))
+		{
+			arena_free(fatBlocks);
+			return -1; // no room for the index
+		}
+	}
+
+	/*
+	 * Zero whatever lies between the old and the new end of file that is
+	 * backed by a block: the bytes past EOF of the block the smaller of the two
+	 * falls in, and when growing, any block that was preallocated
+	 */
+	size_t zero_from = size < entry->size ? size : entry->size;
+	size_t lo = zero_from / cluster_size;
+	size_t hi = size > entry->size ? new_blocks : (zero_from % cluster_size ? lo + 1 : lo);
+	if (hi > lo && !compressed)
+	{
+		uint32_t *blocks = arena_alloc(sizeof(uint32_t) * (hi - lo));
+		char *data_block = arena_cluster();
+		int failed = blocks == NULL || data_block == NULL || map_blocks(&superblock, fatBlocks, entry, lo, hi - lo, blocks) == -1;
+		int remapped = 0;
+		for (size_t i = lo; i < hi && !failed; ++i)
+		{
+			if (blocks[i - lo] == INDEX_HOLE || blocks[i - lo] == FAT_EOC)
+			{
+				continue;
+			}
+			size_t from = i == lo ? zero_from % cluster_size : 0;
+			if (from > 0 && cluster_read(&superblock, blocks[i - lo], data_block) == -1)
+			{
+				failed = 1;
+				break;
+			}
+			memset(data_block + from, 0, cluster_size - from);
+
+			if (is_shared_block(blocks[i - lo]))
+			{
+				uint32_t new_idx = fs_allocate_block(fatBlocks, superblock.data_block_count);
+				if (new_idx == FAT_EOC)
+				{
+					failed = 1;
+					break;
+				}
+				release_block(fatBlocks, blocks[i - lo]);
+				blocks[i - lo] = new_idx;
+				remapped = 1;
+			}
+			cluster_write(&superblock, blocks[i - lo], data_block);
+		}
+		if (remapped && !failed)
+		{
+			store_index(&superblock, fatBlocks, entry, lo, hi - lo, blocks);
+		}
+		arena_free(data_block);
+		arena_free(blocks);
+		if (failed)
+		{
+			arena_free(fatBlocks);
+			return -1;
+		}
+	}
+
+	size_t old_size = entry->size;
+	entry->size = size;
+
+	/*
+	 * The rdir must never claim blocks the FAT has already given back: when
+	 * shrinking, the new size goes out before the freed blocks, and before an
+	 * extent list that no longer covers the old size
+	 */
+	int ret = 0;
+	if (size < old_size)
+	{
+		ret = store_entry(&superblock, fdArray[fd], entry);
 	}
 
 	/*
-	 * See if filename already exists
+	 * Shrinking (or truncating to the same size) drops everything past the
+	 * new last block, preallocated blocks included
 	 */
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	if (ret == 0 && size <= old_size)
 	{
-		if (strcmp(rdir[i].filename, fileStore) == 0)
+		uint32_t first_index = entry->first_data_block_index;
+		ret = free_blocks_from(&superblock, fatBlocks, entry, new_blocks);
+		if (ret == 0 && first_index != entry->first_data_block_index)
 		{
-			return -1;
+			ret = store_entry(&superblock, fdArray[fd], entry);
 		}
 	}
+	if (ret == 0)
+	{
+		ret = store_fat(&superblock, fatBlocks);
+	}
+	if (ret == 0 && size > old_size)
+	{
+		ret = store_entry(&superblock, fdArray[fd], entry);
+	}
+
+	arena_free(fatBlocks);
+	return ret;
+}
 
+int fs_fallocate(int fd, size_t size)
+{
 	/*
-	 * Create new rdir entry
+	 * Open superblock
 	 */
-	Root_Directory new_dir_entry;
-	strcpy(new_dir_entry.filename, fileStore);
-	new_dir_entry.size = 0;
-	new_dir_entry.first_data_block_index = FAT_EOC;
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1))
 	{
-		if (rdir[i].filename[0] == 0)
-		{							 // first letter is null terminated
-			rdir[i] = new_dir_entry; // add new directory entry if empty
-			break;
-		}
+		return -1; // its closed or invalid
+	}
+	if (size > UINT32_MAX)
+	{
+		return -1; // rdir entries hold 32-bit sizes
 	}
 
-	if (block_write(superblock.root_directory_index, &rdir) == -1)
+	/*
+	 * Open rdir and fat blocks
+	 */
+	Root_Directory file_entry;
+	if (load_entry(&superblock, fdArray[fd], &file_entry) == -1)
 	{
 		return -1;
 	}
+	Root_Directory *entry = &file_entry;
+	uint32_t first_index = entry->first_data_block_index;
 
-	return 0;
+	/*
+	 * Inline files have room for inline_size bytes without any block, past
+	 * that they move out to data blocks first
+	 */
+	int inline_file = file_flags(&superblock, entry) & FILE_INLINE;
+	if (inline_file && size <= superblock.inline_size)
+	{
+		return 0;
+	}
+
+	/*
+	 * Compressed files get their blocks when written, as many as each unit
+	 * compresses to
+	 */
+	if (file_flags(&superblock, entry) & FS_FLAG_COMPRESS)
+	{
+		return 0;
+	}
+
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
+	if ((inline_file && spill_inline(&superblock, fatBlocks, fdArray[fd], entry) == -1) || thaw_file(&superblock, fatBlocks, fdArray[fd], entry) == -1)
+	{
+		arena_free(fatBlocks);
+		return -1;
+	}
+
+	size_t want = (size + superblock.cluster_size - 1) / superblock.cluster_size;
+	int ret;
+	if (!(file_flags(&superblock, entry) & FILE_INDEXED))
+	{
+		ret = extend_file(&superblock, fatBlocks, entry, want);
+	}
+	else
+	{
+		ret = fill_holes(&superblock, fatBlocks, entry, want);
+	}
+	if (ret == 0 && store_fat(&superblock, fatBlocks) == -1)
+	{
+		ret = -1;
+	}
+	if (ret == 0 && (entry->first_data_block_index != first_index || inline_file))
+	{
+		ret = store_entry(&superblock, fdArray[fd], entry);
+	}
+
+	arena_free(fatBlocks);
+	return ret;
 }
 
-int fs_delete(const char *filename)
+int fs_getflags(int fd)
 {
+	/*
+	 * Open superblock
+	 */
 	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	if (load_superblock(&superblock) == -1)
 	{
 		return -1;
 	}
 
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1))
+	{
+		return -1; // its closed or invalid
+	}
+
+	Root_Directory entry;
+	if (load_entry(&superblock, fdArray[fd], &entry) == -1)
+	{
+		return -1;
+	}
+
+	return file_flags(&superblock, &entry) & FS_FLAG_MASK;
+}
+
+int fs_setflags(int fd, int flags)
+{
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1) || (flags & ~FS_FLAG_MASK))
+	{
+		return -1; // its closed or invalid
+	}
+
+	/*
+	 * Flushing can turn file flags on in the superblock, so it goes first
+	 */
+	flush_file(fdArray[fd]);
+
 	/*
-	 * Check for valid file
+	 * Open superblock
 	 */
-	char fileStore[16];
-	memset(fileStore, 0, 16);
-	strcpy(fileStore, filename);
-	if (fileStore[15] != 0)
+	Superblock superblock;
+	if (load_superblock_rw(&superblock) == -1)
+	{
+		return -1;
+	}
+
+	Root_Directory file_entry;
+	if (load_entry(&superblock, fdArray[fd], &file_entry) == -1)
 	{
-		return -1; // invalid size
+		return -1;
+	}
+	Root_Directory *entry = &file_entry;
+
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
 	}
 
 	/*
-	 * Fetch rdir block from disk
+	 * Only indexed files can have holes or share blocks, so sparse, compressed
+	 * and deduplicated ones have to be, moving out of their rdir entry first if they are inline. Toggling
+	 * compression recodes every unit already written.
 	 */
-	Root_Directory rdir[FS_FILE_MAX_COUNT];
-	Root_Directory dirRemoval;
-	int file_exists = 0;
-	int rdir_index;
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	int ret = enable_file_flags(&superblock);
+	if (ret == 0)
 	{
-		return -1;
+		ret = thaw_file(&superblock, fatBlocks, fdArray[fd], entry);
+	}
+	int compress = flags & FS_FLAG_COMPRESS;
+	int compressed = file_flags(&superblock, entry) & FS_FLAG_COMPRESS;
+	if (ret == 0 && (flags & (FS_FLAG_SPARSE | FS_FLAG_COMPRESS | FS_FLAG_DEDUP)))
+	{
+		ret = spill_inline(&superblock, fatBlocks, fdArray[fd], entry);
+	}
+	if (ret == 0 && (flags & (FS_FLAG_SPARSE | FS_FLAG_COMPRESS | FS_FLAG_DEDUP)))
+	{
+		ret = convert_to_indexed(&superblock, fatBlocks, fdArray[fd], entry);
 	}
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+	/*
+	 * Raw units read fine in a compressed file but not the other way around,
+	 * so the flag goes to disk before any unit gets compressed, and a file
+	 * left half expanded stays compressed. Compressed units read as zeros
+	 * past EOF, which blocks preallocated there may not be, so those go.
+	 */
+	if (ret == 0 && compress && !compressed)
 	{
-		if (strcmp(rdir[i].filename, fileStore) == 0)
+		ret = free_blocks_from(&superblock, fatBlocks, entry, (entry->size + superblock.cluster_size - 1) / superblock.cluster_size);
+		entry->flags |= FS_FLAG_COMPRESS;
+		if (ret == 0 && (store_fat(&superblock, fatBlocks) == -1 || store_entry(&superblock, fdArray[fd], entry) == -1))
 		{
-			file_exists = 1;
-			dirRemoval = rdir[i];
-			rdir_index = i;
-			break;
+			ret = -1;
+		}
+	}
+	if (ret == 0 && compress != compressed && recode_units(&superblock, fatBlocks, entry, compress != 0) == -1)
+	{
+		flags |= FS_FLAG_COMPRESS;
+		ret = 1;
+	}
+	if (ret >= 0)
+	{
+		entry->flags = (entry->flags & ~FS_FLAG_MASK) | flags;
+		if (store_fat(&superblock, fatBlocks) == -1 || store_entry(&superblock, fdArray[fd], entry) == -1 || ret == 1)
+		{
+			ret = -1;
 		}
 	}
 
-	if (!file_exists)
+	arena_free(fatBlocks);
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	if (is_mounted() < 0 || snapshotMeta != NULL)
 	{
-		return -1;
+		return -1; // disk hasnt been mounted yet, or only a snapshot is
 	}
 
-	int blockSpan = ceil(dirRemoval.size / BLOCK_SIZE); // number of blocks the data will be written to
-	Root_Directory empty_directory;
-	strcpy(empty_directory.filename, "\0");
-	rdir[rdir_index] = empty_directory; // effectively removes size zero file
-	
-	// write block back into disk
-	block_write(superblock.root_directory_index, &rdir); 
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1) || buf == NULL)
+	{
+		return -1; // its closed or invalid
+	}
 
 	/*
-	 * Fetch fat blocks from disk
+	 * Bytes another fd buffered for the same file have to land first, or they
+	 * would overwrite this write when flushed later
 	 */
+	for (int i = 0; i < fdCount; ++i)
+	{
+		if (i != fd && fdArray[i] == fdArray[fd])
+		{
+			flush_fd(i);
+		}
+	}
 
-	uint16_t *fatBlocks = (uint16_t *)malloc(sizeof(uint16_t) * (BLOCK_SIZE * superblock.fat_block_count));
-	uint16_t tempFatBlock[BLOCK_SIZE];
-	for (int i = 1; i < superblock.root_directory_index; ++i)
+	/*
+	 * Appends go to the end of file. Bytes still in the buffer of an append fd
+	 * are always the last ones of the file, as any other write to it would
+	 * have flushed them; otherwise the rdir has the size.
+	 */
+	if (appendArray[fd])
 	{
-		if (block_read(i, &tempFatBlock) == -1)
+		if (writeBufferLen[fd] > 0)
 		{
-			return -1;
+			offsetArray[fd] = writeBufferStart[fd] + writeBufferLen[fd];
+		}
+		else
+		{
+			Superblock superblock;
+			Root_Directory entry;
+			if (load_superblock(&superblock) == -1 || load_entry(&superblock, fdArray[fd], &entry) == -1)
+			{
+				return -1;
+			}
+			offsetArray[fd] = entry.size;
 		}
+	}
 
-		memcpy(fatBlocks + (i - 1) * BLOCK_SIZE, tempFatBlock, BLOCK_SIZE);
+	/*
+	 * rdir entries hold 32-bit sizes, so a write ending past UINT32_MAX could
+	 * never be flushed
+	 */
+	if (offsetArray[fd] > UINT32_MAX || count > UINT32_MAX - offsetArray[fd])
+	{
+		return 0;
 	}
 
-	int fat_index = dirRemoval.first_data_block_index;
-	int temp_index;
-	char dataBlock[BLOCK_SIZE]; // empty datablock cell
-	for (int i = 0; i < blockSpan; ++i)
+	/*
+	 * Block sized writes skip the buffer entirely
+	 */
+	size_t cluster_size = mountedSuperblock.cluster_size;
+	if (count >= cluster_size)
 	{
-		if (block_write(fat_index + superblock.data_block_start_index, &dataBlock) == -1)
-		{ // override data block
-			return -1;
+		flush_fd(fd);
+		int written = write_through(fd, offsetArray[fd], buf, count);
+		if (written > 0)
+		{
+			offsetArray[fd] += written;
 		}
-		temp_index = fatBlocks[fat_index]; // perform swap
-		fatBlocks[fat_index] = 0;		   // perform vanquish
-		fat_index = temp_index;
+		return written;
 	}
 
-	free(fatBlocks);
+	if (writeBufferLen[fd] > 0 && writeBufferStart[fd] + writeBufferLen[fd] != offsetArray[fd])
+	{
+		flush_fd(fd);
+	}
 
-	return 0;
+	/*
+	 * Gather into the buffer, flushing whenever it reaches a block boundary
+	 */
+	size_t accepted = 0;
+	while (accepted < count)
+	{
+		if (writeBufferLen[fd] == 0)
+		{
+			writeBufferStart[fd] = offsetArray[fd];
+		}
+		size_t room = cluster_size - (writeBufferStart[fd] + writeBufferLen[fd]) % cluster_size;
+		size_t chunk = count - accepted < room ? count - accepted : room;
+
+		memcpy(writeBuffer[fd] + writeBufferLen[fd], buf + accepted, chunk);
+		writeBufferLen[fd] += chunk;
+		offsetArray[fd] += chunk;
+		accepted += chunk;
+
+		if (chunk == room)
+		{
+			/*
+			 * A write smaller than a block fills the buffer at most once, so
+			 * everything accepted so far is in it, behind earlier writes'
+			 * bytes. On a full disk, only what made it out of this call
+			 * counts and the fd ends up where the data did.
+			 */
+			size_t earlier = writeBufferLen[fd] - accepted;
+			int written = write_through(fd, writeBufferStart[fd], writeBuffer[fd], writeBufferLen[fd]);
+			if (written < (int)writeBufferLen[fd])
+			{
+				written = written < 0 ? 0 : written;
+				if ((size_t)written < earlier)
+				{
+					writeError[fd] = 1; // lost bytes an earlier call was told about
+				}
+				offsetArray[fd] = writeBufferStart[fd] + written;
+				writeBufferLen[fd] = 0;
+				return (size_t)written > earlier ? (int)(written - earlier) : 0;
+			}
+			writeBufferLen[fd] = 0;
+		}
+	}
+
+	return (int)accepted;
 }
 
-int fs_ls(void)
+int fs_read(int fd, void *buf, size_t count)
 {
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1) || (buf == NULL))
+	{
+		return -1; // its closed or invalid size
+	}
 
+	/*
+	 * Flushing can turn file flags on in the superblock, so it goes first
+	 */
+	flush_file(fdArray[fd]);
+
+	/*
+	 * Open superblock
+	 */
 	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	if (load_superblock(&superblock) == -1)
 	{
 		return -1;
 	}
 
 	/*
-	 * Fetch rdir block from disk
+	 * Open rdir entry
 	 */
-	Root_Directory rdir[FS_FILE_MAX_COUNT];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	Root_Directory entry;
+	if (load_entry(&superblock, fdArray[fd], &entry) == -1)
 	{
 		return -1;
 	}
 
-	printf("FS Ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+	/*
+	 * Never read past the end of the file
+	 */
+	if (offsetArray[fd] >= entry.size)
+	{
+		return 0;
+	}
+	if (count > entry.size - offsetArray[fd])
+	{
+		count = entry.size - offsetArray[fd];
+	}
+
+	/*
+	 * Inline files are read straight out of their rdir entry
+	 */
+	if (file_flags(&superblock, &entry) & FILE_INLINE)
 	{
-		if (rdir[i].filename[0] != 0)
+		char data[INLINE_SIZE_MAX];
+		if (load_inline(&superblock, fdArray[fd], data) == -1)
 		{
-			printf("file: %s, size: %i, data_blk: %i\n", rdir[i].filename, rdir[i].size, rdir[i].first_data_block_index);
+			return -1;
 		}
+		memcpy(buf, data + offsetArray[fd], count);
+		offsetArray[fd] += count;
+		return (int)count;
 	}
 
-	return 0;
-}
+	/*
+	 * Adapt the read-ahead window to the access pattern
+	 */
+	if (offsetArray[fd] == readAheadNext[fd])
+	{
+		if (readAheadWindow[fd] == 0)
+		{
+			readAheadWindow[fd] = READ_AHEAD_MIN;
+		}
+	}
+	else
+	{
+		readAheadWindow[fd] = 0; // random access, don't prefetch
+	}
 
-int fs_open(const char *filename)
-{
 	/*
-	 * Open superblock
+	 * Open fat blocks
 	 */
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
 	{
 		return -1;
 	}
 
-	if (openFiles > FS_OPEN_MAX_COUNT)
+	/*
+	 * Compressed files are read a whole unit at a time, no read-ahead needed
+	 */
+	if (file_flags(&superblock, &entry) & FS_FLAG_COMPRESS)
 	{
-		return -1; // too many files open
+		int bytes_read = read_compressed(&superblock, fatBlocks, &entry, offsetArray[fd], buf, count);
+		arena_free(fatBlocks);
+		if (bytes_read > 0)
+		{
+			offsetArray[fd] += bytes_read;
+		}
+		readAheadNext[fd] = offsetArray[fd];
+		return bytes_read == 0 && count > 0 ? -1 : bytes_read;
+	}
+
+	/*
+	 * Map the blocks to read plus the read-ahead window in one go
+	 */
+	size_t cluster_size = superblock.cluster_size;
+	size_t offset = offsetArray[fd] % cluster_size;
+	size_t first = offsetArray[fd] / cluster_size;
+	size_t mapped = (offset + count + cluster_size - 1) / cluster_size + (readAheadWindow[fd] ? READ_AHEAD_MAX : 0);
+	uint32_t *blocks = arena_alloc(sizeof(uint32_t) * mapped);
+	if (blocks == NULL || map_blocks(&superblock, fatBlocks, &entry, first, mapped, blocks) == -1)
+	{
+		arena_free(blocks);
+		arena_free(fatBlocks);
+		return -1;
+	}
+
+	/*
+	 * Begin piping in data through the block cache one disk block at a time,
+	 * prefetching ahead of sequential readers whenever they run into a block
+	 * that isn't cached. Holes read as zeros.
+	 */
+	Cache_Block *slot;
+	int bytes_read = 0;
+	for (size_t i = 0; count > 0 && blocks[i] != FAT_EOC; ++i)
+	{
+		size_t chunk = cluster_size - offset;
+		if (chunk > count)
+		{
+			chunk = count;
+		}
+
+		if (blocks[i] == INDEX_HOLE)
+		{
+			memset(buf + bytes_read, 0, chunk);
+			bytes_read += (int)chunk;
+			count -= chunk;
+			offset = 0;
+			continue;
+		}
+
+		size_t done = 0;
+		while (done < chunk)
+		{
+			size_t disk_block = cluster_block(&superblock, blocks[i]) + (offset + done) / BLOCK_SIZE;
+			size_t in_block = (offset + done) % BLOCK_SIZE;
+			size_t piece = BLOCK_SIZE - in_block < chunk - done ? BLOCK_SIZE - in_block : chunk - done;
+
+			slot = cache_lookup(disk_block);
+			if (slot == NULL && readAheadWindow[fd] > 0)
+			{
+				read_ahead(&superblock, blocks + i, mapped - i, readAheadWindow[fd]);
+				if (readAheadWindow[fd] < READ_AHEAD_MAX)
+				{
+					readAheadWindow[fd] *= 2;
+				}
+			}
+			slot = cache_fill(disk_block);
+			if (slot == NULL)
+			{
+				break; // I/O error or bad checksum
+			}
+			memcpy(buf + bytes_read + done, slot->data + in_block, piece);
+			done += piece;
+		}
+
+		bytes_read += (int)done;
+		count -= done;
+		offset = 0;
+		if (done < chunk)
+		{
+			break;
+		}
+	}
+
+	arena_free(blocks);
+	arena_free(fatBlocks);
+	offsetArray[fd] += bytes_read;
+	readAheadNext[fd] = offsetArray[fd];
+	return bytes_read == 0 && count > 0 ? -1 : bytes_read;
+}
+
+/*
+ * Read @count bytes of the file open as @fd from @offset into @buf through
+ * fs_read(), leaving the file offset of @fd alone. Returns the number of bytes
+ * read, -1 if none could be.
+ */
+static int read_at(int fd, size_t offset, void *buf, size_t count)
+{
+	size_t saved_offset = offsetArray[fd];
+	offsetArray[fd] = offset;
+	int ret = fs_read(fd, buf, count);
+	offsetArray[fd] = saved_offset;
+	return ret;
+}
+
+/*
+ * Send @count bytes of the file open as @fd from @offset to @host_fd through
+ * fs_read(), for the files whose data has to go through memory anyway
+ */
+static int send_read(int fd, int host_fd, size_t offset, size_t count)
+{
+	char *data = arena_cluster();
+	if (data == NULL)
+	{
+		return -1;
+	}
+	size_t cluster_size = mountedSuperblock.cluster_size;
+	size_t sent = 0;
+	int ret = 0;
+	while (sent < count)
+	{
+		size_t chunk = count - sent < cluster_size ? count - sent : cluster_size;
+		ret = read_at(fd, offset + sent, data, chunk);
+		if (ret <= 0)
+		{
+			break;
+		}
+		size_t written = host_write(host_fd, data, ret);
+		sent += written;
+		if (written < (size_t)ret)
+		{
+			ret = -1;
+			break;
+		}
 	}
+	arena_free(data);
+	return sent == 0 && ret == -1 ? -1 : (int)sent;
+}
 
-	char fileStore[FS_FILENAME_LEN];
-	memset(fileStore, 0, FS_FILENAME_LEN);
-	strcpy(fileStore, filename);
-	if (fileStore[FS_FILENAME_LEN - 1] != 0)
+int fs_sendfile(int fd, int host_fd, size_t offset, size_t count)
+{
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1) || (host_fd < 0))
 	{
-		return -1; // invalid size
+		return -1; // its closed or invalid
 	}
 
 	/*
-	 * Pick out open file descriptor
+	 * Flushing can turn file flags on in the superblock, so it goes first
 	 */
-	int fd;
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
-	{
-		if (fdArray[i] == -1)
-		{
-			fd = i;
-			break;
-		}
-	}
+	flush_file(fdArray[fd]);
 
 	/*
-	 * Open root directory and add dir index to array
+	 * Open superblock and rdir entry
 	 */
-	Root_Directory rdir[FS_FILE_MAX_COUNT];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	Superblock superblock;
+	if (load_superblock(&superblock) == -1)
 	{
 		return -1;
 	}
-
-	/*
-	 * Search for file name
-	 */
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	Root_Directory entry;
+	if (load_entry(&superblock, fdArray[fd], &entry) == -1)
 	{
-		if (strcmp(rdir[i].filename, fileStore) == 0)
-		{
-			fdArray[fd] = i;
-			break;
-		}
+		return -1;
 	}
-	openFiles++;
-	return fd;
-}
 
-int fs_close(int fd)
-{
-	if (is_mounted() < 0)
+	/*
+	 * Never send past the end of the file
+	 */
+	if (offset >= entry.size)
 	{
-		return -1; // disk hasnt been mounted yet
+		return 0;
 	}
-	if ((fdArray[fd] == -1) || (fd > 31) || (fd < 0))
+	if (count > entry.size - offset)
 	{
-		return -1; // its already closed or invalid!
+		count = entry.size - offset;
 	}
-	else
+	if (count > INT_MAX)
 	{
-		fdArray[fd] = -1;	 // defacto close
-		offsetArray[fd] = 0; // reset offset
-		openFiles--;
-		return 0;
+		count = INT_MAX;
 	}
-}
 
-int fs_stat(int fd)
-{
 	/*
-	 * Open superblock
+	 * Inline files go out of their rdir entry. Compressed files have to be
+	 * expanded and disks with checksums have every block checked, so that data
+	 * can only go through the block cache.
 	 */
-	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	if (file_flags(&superblock, &entry) & FILE_INLINE)
 	{
-		return -1;
+		char data[INLINE_SIZE_MAX];
+		if (load_inline(&superblock, fdArray[fd], data) == -1)
+		{
+			return -1;
+		}
+		size_t sent = host_write(host_fd, data + offset, count);
+		return sent == 0 ? -1 : (int)sent;
+	}
+	if (imageFd == -1 || (superblock.features & FEATURE_CHECKSUMS) || (file_flags(&superblock, &entry) & FS_FLAG_COMPRESS))
+	{
+		return send_read(fd, host_fd, offset, count);
 	}
 
-	if ((fdArray[fd] == -1) || (fd > 31) || (fd < 0))
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
 	{
-		return -1; // its closed or invalid
+		return -1;
 	}
 
 	/*
-	 * Open rdir
+	 * Hand every run of consecutive data blocks to the kernel in one go,
+	 * holes go out as zeros
 	 */
-	Root_Directory rdir[FS_FILE_MAX_COUNT];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	size_t cluster_size = superblock.cluster_size;
+	size_t first = offset / cluster_size;
+	size_t in_cluster = offset % cluster_size;
+	uint32_t blocks[SENDFILE_BATCH];
+	char zeros[BLOCK_SIZE];
+	memset(zeros, 0, BLOCK_SIZE);
+	size_t sent = 0;
+	int stop = 0;
+	while (sent < count && !stop)
 	{
-		return -1;
-	}
+		if (map_blocks(&superblock, fatBlocks, &entry, first, SENDFILE_BATCH, blocks) == -1)
+		{
+			break;
+		}
+		for (size_t i = 0; i < SENDFILE_BATCH && sent < count && !stop;)
+		{
+			if (blocks[i] == FAT_EOC)
+			{
+				stop = 1; // chain shorter than the file
+				break;
+			}
+			size_t run = 1;
+			uint32_t step = blocks[i] == INDEX_HOLE ? 0 : 1;
+			while (i + run < SENDFILE_BATCH && blocks[i + run] == blocks[i] + step * run)
+			{
+				++run;
+			}
+			size_t len = run * cluster_size - in_cluster;
+			if (len > count - sent)
+			{
+				len = count - sent;
+			}
+
+			size_t moved = 0;
+			if (blocks[i] == INDEX_HOLE)
+			{
+				while (moved < len)
+				{
+					size_t chunk = len - moved < BLOCK_SIZE ? len - moved : BLOCK_SIZE;
+					size_t written = host_write(host_fd, zeros, chunk);
+					moved += written;
+					if (written < chunk)
+					{
+						break;
+					}
+				}
+			}
+			else
+			{
+				off_t image_offset = cluster_block(&superblock, blocks[i]) * BLOCK_SIZE + in_cluster;
+				while (moved < len)
+				{
+					ssize_t copied = host_copy(imageFd, &image_offset, host_fd, NULL, len - moved);
+					if (copied <= 0)
+					{
+						break;
+					}
+					moved += copied;
+				}
+			}
 
+			sent += moved;
+			stop = moved < len;
+			i += run;
+			first += run;
+			in_cluster = 0;
+		}
+	}
 
-	return rdir[fdArray[fd]].size;
+	arena_free(fatBlocks);
+	return sent == 0 ? -1 : (int)sent;
 }
 
-int fs_lseek(int fd, size_t offset)
+/*
+ * Write @count bytes from @host_fd to the file open as @fd at @offset through
+ * write_through(), a data block at a time
+ */
+static int recv_write(int fd, int host_fd, size_t offset, size_t count)
 {
-
-	if (is_mounted() < 0)
+	char *data = arena_cluster();
+	if (data == NULL)
 	{
-		return -1; // disk hasnt been mounted yet
+		return -1;
 	}
-
-	if ((fdArray[fd] == -1) || (fd > 31) || (fd < 0))
+	size_t cluster_size = mountedSuperblock.cluster_size;
+	size_t received = 0;
+	int ret = 0;
+	while (received < count)
 	{
-		return -1; // its closed or invalid
+		size_t chunk = cluster_size - (offset + received) % cluster_size;
+		if (chunk > count - received)
+		{
+			chunk = count - received;
+		}
+		size_t got = 0;
+		while (got < chunk)
+		{
+			ssize_t bytes = read(host_fd, data + got, chunk - got);
+			if (bytes <= 0)
+			{
+				ret = bytes;
+				break;
+			}
+			got += bytes;
+		}
+		if (got == 0)
+		{
+			break;
+		}
+		int written = write_through(fd, offset + received, data, got);
+		if (written > 0)
+		{
+			received += written;
+		}
+		if (written < (int)got)
+		{
+			lseek(host_fd, (off_t)(written > 0 ? written : 0) - (off_t)got, SEEK_CUR); // leave the rest to be read again, if it can
+			ret = written < 0 ? -1 : 0; // disk full
+			break;
+		}
 	}
-
-	offsetArray[fd] = offset;
-
-	return 0;
+	arena_free(data);
+	return received == 0 && ret == -1 ? -1 : (int)received;
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_recvfile(int fd, int host_fd, size_t offset, size_t count)
 {
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1) || (host_fd < 0))
+	{
+		return -1; // its closed or invalid
+	}
 
 	/*
-	 * Open superblock
+	 * Flushing can turn file flags on in the superblock, so it goes first
+	 */
+	flush_file(fdArray[fd]);
+
+	/*
+	 * Open superblock and rdir entry
 	 */
 	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	if (load_superblock_rw(&superblock) == -1)
 	{
 		return -1;
 	}
-
-	if ((fdArray[fd] == -1) || (fd > 31) || (fd < 0) || buf == NULL)
-	{
-		return -1; // its closed or invalid
-	}
-
-	/*
-	 * Open rdir
-	 */
-	Root_Directory rdir[FS_FILE_MAX_COUNT];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	Root_Directory entry;
+	if (load_entry(&superblock, fdArray[fd], &entry) == -1)
 	{
 		return -1;
 	}
-
-	int rdir_idx = fdArray[fd];
-
-	if(count == 0){
-		return 0;
+	if (count > INT_MAX)
+	{
+		count = INT_MAX;
 	}
-
-	/*
-	 * Open fat blocks
-	 */
-	uint16_t *fatBlocks = (uint16_t *)malloc(sizeof(uint16_t) * (BLOCK_SIZE * superblock.fat_block_count));
-	uint16_t tempFatBlock[BLOCK_SIZE];
-	for (int i = 1; i < superblock.root_directory_index; ++i)
+	if (offset > UINT32_MAX || count > UINT32_MAX - offset)
 	{
-		block_read(i, &tempFatBlock);
-		memcpy(fatBlocks + (i - 1) * BLOCK_SIZE, tempFatBlock, BLOCK_SIZE);
+		return 0; // rdir entries hold 32-bit sizes
 	}
 
 	/*
-	 * Need to determine where exactly to begin writing.. do so by checking whether or not
-	 * current index is FAT_EOC => we need a new spot. We can do some basic arithmetic with the
-	 * size of the file to determine whether or not we need a new fat cell.
+	 * The kernel can only copy into blocks that need no checksum, dedup or
+	 * compression on the way in and that nothing shares: those of a chain or
+	 * extent file on a disk without checksums, from a regular host file and
+	 * for no more than it holds. The blocks are reserved up front, which may
+	 * also turn an inline file into a chain one or a file holding snapshot
+	 * blocks into an indexed one. Everything else, writes leaving a gap past
+	 * the end of file included, goes through write_through().
 	 */
-	// int size = rdir[rdir_idx].size;
-	int amtLeft = (int)count;
-	int prev_idx;
-	int block_index;
-	if (rdir[rdir_idx].first_data_block_index == FAT_EOC)
+	struct stat st;
+	off_t position = -1;
+	int direct = imageFd != -1 && !(superblock.features & FEATURE_CHECKSUMS) && !(file_flags(&superblock, &entry) & FILE_INDEXED) && offset <= entry.size;
+	if (direct && fstat(host_fd, &st) == 0 && S_ISREG(st.st_mode))
 	{
-		int set_rdir_idx = 1;
-		for (int i = 0; i < BLOCK_SIZE * superblock.fat_block_count; ++i)
-		{ // find free spot!
-			if (fatBlocks[i] == 0)
-			{
-				if (set_rdir_idx)
-				{
-					rdir[rdir_idx].first_data_block_index = i;
-					fatBlocks[i] = FAT_EOC;
-					prev_idx = i;
-					set_rdir_idx = 0;
-				}
-				else
-				{
-					fatBlocks[prev_idx] = i;
-					fatBlocks[i] = FAT_EOC;
-					prev_idx = i;
-				}
-				amtLeft -= BLOCK_SIZE;
-				if (amtLeft > 0)
-				{
-					continue;
-				}
-				else
-				{
-					break;
-				}
-			}
-		}
-		if (set_rdir_idx == 1)
-		{ // theres no space for anything
-			return 0;
-		}
+		position = lseek(host_fd, 0, SEEK_CUR);
 	}
-	else
+	if (position != -1)
 	{
-		size_t num_fat_blocks = 0;
-		block_index = rdir[rdir_idx].first_data_block_index;
-		while (block_index != FAT_EOC)
-		{ // find last index
-			num_fat_blocks++;
-			prev_idx = block_index;
-			block_index = fatBlocks[block_index];
+		if (position >= st.st_size)
+		{
+			return 0;
 		}
-		amtLeft = num_fat_blocks * BLOCK_SIZE - count;
-		if (count > num_fat_blocks * BLOCK_SIZE)
+		if (count > (size_t)(st.st_size - position))
 		{
-			for (int i = 0; i < BLOCK_SIZE * superblock.fat_block_count; ++i)
-			{ // find free spot!
-				if (fatBlocks[i] == 0)
-				{
-					fatBlocks[prev_idx] = i;
-					fatBlocks[i] = FAT_EOC;
-					prev_idx = i;
-
-					amtLeft -= BLOCK_SIZE;
-					if (amtLeft > 0)
-					{
-						continue;
-					}
-					else
-					{
-						break;
-					}
-				}
-			}
+			count = st.st_size - position;
 		}
 	}
-	for(int i = 1; i < superblock.fat_block_count; ++i){
-		block_write(i, fatBlocks + (i-1)*BLOCK_SIZE);
+	if (count == 0)
+	{
+		return 0;
+	}
+	if (position == -1 || fs_fallocate(fd, offset + count) == -1 || load_superblock(&superblock) == -1 ||
+		load_entry(&superblock, fdArray[fd], &entry) == -1 || (file_flags(&superblock, &entry) & (FILE_INDEXED | FILE_INLINE)))
+	{
+		return recv_write(fd, host_fd, offset, count);
 	}
 
-	/*
-	 * Given the first index in rdir, go to data block of file
-	 */
-	block_index = rdir[rdir_idx].first_data_block_index; // first index of block array, as provided in FAT
-	// printf("%p %ld %i", buf, count, block_index);
-	int next_index;
-	size_t offset = offsetArray[fd];
+	uint32_t *fatBlocks = load_fat(&superblock);
+	if (fatBlocks == NULL)
+	{
+		return -1;
+	}
 
 	/*
-	* Go to position in FAT array - seek to the offset -
-	  break with desired index.
-	*/
-	while (1)
+	 * Hand every run of consecutive data blocks to the kernel in one go
+	 */
+	size_t cluster_size = superblock.cluster_size;
+	size_t first = offset / cluster_size;
+	size_t in_cluster = offset % cluster_size;
+	uint32_t blocks[SENDFILE_BATCH];
+	uint32_t last_block = FAT_EOC;
+	size_t received = 0;
+	int stop = 0;
+	while (received < count && !stop)
 	{
-		if (offset >= BLOCK_SIZE)
+		if (map_blocks(&superblock, fatBlocks, &entry, first, SENDFILE_BATCH, blocks) == -1)
 		{
-			// if offset >= block size --> go to the next index
-			next_index = fatBlocks[block_index];
-			if (next_index == FAT_EOC)
-			{			  // offset exceeds space for file
-				return 0; // 0 bytes read
-			}
-			block_index = next_index;
-			offset -= BLOCK_SIZE;
+			break;
 		}
-		else
+		for (size_t i = 0; i < SENDFILE_BATCH && received < count && !stop;)
 		{
-			// if offset < block size --> we are ready to read
-			break; // block_index is where we want to start
+			if (blocks[i] == FAT_EOC)
+			{
+				stop = 1; // fs_fallocate() came up short
+				break;
+			}
+			size_t run = 1;
+			while (i + run < SENDFILE_BATCH && blocks[i + run] == blocks[i] + run)
+			{
+				++run;
+			}
+			size_t len = run * cluster_size - in_cluster;
+			if (len > count - received)
+			{
+				len = count - received;
+			}
+
+			off_t image_offset = cluster_block(&superblock, blocks[i]) * BLOCK_SIZE + in_cluster;
+			size_t moved = 0;
+			while (moved < len)
+			{
+				ssize_t copied = host_copy(host_fd, NULL, imageFd, &image_offset, len - moved);
+				if (copied <= 0)
+				{
+					break;
+				}
+				moved += copied;
+			}
+			cache_drop(cluster_block(&superblock, blocks[i]), run * superblock.cluster_blocks);
+			if (moved > 0)
+			{
+				last_block = blocks[i + (in_cluster + moved - 1) / cluster_size];
+			}
+
+			received += moved;
+			stop = moved < len;
+			i += run;
+			first += run;
+			in_cluster = 0;
 		}
 	}
 
 	/*
-	 * Begin piping in data through temp data blocks, memcpy buffer to data block, write block back into disk
+	 * Bytes past the end of file have to read as zeros, but the blocks
+	 * fs_fallocate() added hold whatever was on disk before
 	 */
-
-	char data_block[BLOCK_SIZE];
-	int bytes_written = 0;
-	while (1)
+	int ret = 0;
+	size_t end = offset + received;
+	if (end > entry.size)
 	{
-		block_read(block_index + superblock.data_block_start_index, &data_block); // read block from disk
-		if (count > BLOCK_SIZE - offset)										  // if the count is bigger than the number of remaining blocks
+		if (end % cluster_size != 0)
 		{
-			memcpy(data_block + offset, buf + bytes_written, BLOCK_SIZE - offset);
-			block_write(block_index + superblock.data_block_start_index, &data_block);
-			bytes_written += (int)(BLOCK_SIZE - offset);
-			count -= BLOCK_SIZE - offset;
-			offset = 0;
-			block_index = fatBlocks[block_index];
-			if (block_index == FAT_EOC)
+			char *data_block = arena_cluster();
+			ret = data_block == NULL ? -1 : cluster_read(&superblock, last_block, data_block);
+			if (ret == 0)
 			{
-				break;
+				memset(data_block + end % cluster_size, 0, cluster_size - end % cluster_size);
+				ret = cluster_write(&superblock, last_block, data_block);
 			}
+			arena_free(data_block);
 		}
-		else
+		entry.size = end;
+		if (ret == 0)
 		{
-			memcpy(data_block + offset, buf + bytes_written, count);
-			block_write(block_index + superblock.data_block_start_index, &data_block);
-			bytes_written += (int)count;
-			break;
+			ret = store_entry(&superblock, fdArray[fd], &entry);
 		}
 	}
 
-	rdir[rdir_idx].size = fs_stat(fd) + bytes_written;
-	block_write(superblock.root_directory_index, &rdir);
-	free(fatBlocks);
-	return bytes_written;
+	arena_free(fatBlocks);
+	return received == 0 || ret == -1 ? -1 : (int)received;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_mmap(int fd, const void **view)
 {
+	if ((fd < 0) || (fd >= fdCount) || (fdArray[fd] == -1) || (view == NULL))
+	{
+		return -1; // its closed or invalid
+	}
+
 	/*
-	 * Open superblock
+	 * Flushing can turn file flags on in the superblock, so it goes first
+	 */
+	flush_file(fdArray[fd]);
+
+	/*
+	 * Open superblock and rdir entry
 	 */
 	Superblock superblock;
-	if (block_read(0, &superblock) == -1)
+	if (load_superblock(&superblock) == -1)
 	{
 		return -1;
 	}
-
-	if ((fdArray[fd] == -1) || (fd > 31) || (fd < 0) || (buf == NULL))
+	Root_Directory entry;
+	if (load_entry(&superblock, fdArray[fd], &entry) == -1)
 	{
-		return -1; // its closed or invalid size
+		return -1;
 	}
-
-	/*
-	 * Open rdir
-	 */
-	Root_Directory rdir[FS_FILE_MAX_COUNT];
-	if (block_read(superblock.root_directory_index, &rdir) == -1)
+	*view = NULL;
+	if (entry.size == 0)
 	{
-		return -1;
+		return 0;
+	}
+	if (entry.size > INT_MAX)
+	{
+		return -1; // the size couldn't be returned
 	}
-
-	int rdir_idx = fdArray[fd];
 
 	/*
-	 * Open fat blocks
+	 * Reserve address space for the whole file, to be filled in below
 	 */
-	uint16_t *fatBlocks = (uint16_t *)malloc(sizeof(uint16_t) * (BLOCK_SIZE * superblock.fat_block_count));
-	uint16_t tempFatBlock[BLOCK_SIZE];
-	for (int i = 1; i < superblock.root_directory_index; ++i)
+	size_t length = (entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	char *base = mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
 	{
-		block_read(i, &tempFatBlock);
-		memcpy(fatBlocks + (i - 1) * BLOCK_SIZE, tempFatBlock, BLOCK_SIZE);
+		return -1;
 	}
 
 	/*
-	 * Initialize variables for current idx, next idx, and offset
+	 * Inline and compressed files have no blocks to map, and on disks with
+	 * checksums every block has to be checked: those are read into anonymous
+	 * memory instead, and so is everything when pages and disk blocks differ
+	 * in size
 	 */
-	int block_index = rdir[rdir_idx].first_data_block_index;
-
-	int next_index;
-	size_t offset = offsetArray[fd]; // temp variable that serves as a counter
-	/*
-	* Go to position in FAT array - seek to the offset -
-	  break with desired index.
-	*/
-	while (1)
+	uint32_t *fatBlocks = NULL;
+	if (imageFd == -1 || sysconf(_SC_PAGESIZE) != BLOCK_SIZE || (superblock.features & FEATURE_CHECKSUMS) ||
+		(file_flags(&superblock, &entry) & (FILE_INLINE | FS_FLAG_COMPRESS)) || (fatBlocks = load_fat(&superblock)) == NULL)
 	{
-		if (offset >= BLOCK_SIZE)
-		{
-			// if offset >= block size --> go to the next index
-			next_index = fatBlocks[block_index];
-			if (next_index == FAT_EOC)
-			{			  // offset exceeds space for file
-				return 0; // 0 bytes read
-			}
-			block_index = next_index;
-			offset -= BLOCK_SIZE;
-		}
-		else
+		if (mprotect(base, length, PROT_READ | PROT_WRITE) == -1 || read_at(fd, 0, base, entry.size) != (int)entry.size ||
+			mprotect(base, length, PROT_READ) == -1)
 		{
-			// if offset < block size --> we are ready to read
-			break; // block_index is where we want to start
+			munmap(base, length);
+			return -1;
 		}
+		*view = base;
+		return (int)entry.size;
 	}
 
 	/*
-	 * Begin piping in data through temp data blocks
+	 * Map every run of consecutive data blocks of the image over its part of
+	 * the range, holes get zero pages. Pages only get read in as the caller
+	 * touches them.
 	 */
-
-	char data_block[BLOCK_SIZE];
-	int bytes_read = 0;
-	while (1)
+	size_t cluster_size = superblock.cluster_size;
+	size_t clusters = (entry.size + cluster_size - 1) / cluster_size;
+	uint32_t blocks[SENDFILE_BATCH];
+	int ret = 0;
+	for (size_t first = 0; first < clusters && ret == 0;)
 	{
-		block_read(block_index + superblock.data_block_start_index, &data_block);
-		if (count > BLOCK_SIZE - offset)
+		if (map_blocks(&superblock, fatBlocks, &entry, first, SENDFILE_BATCH, blocks) == -1)
 		{
-			memcpy(buf + bytes_read, data_block + offset, BLOCK_SIZE - offset);
-			bytes_read += (int)(BLOCK_SIZE - offset);
-			count -= BLOCK_SIZE - offset;
-			offset = 0;
-			block_index = fatBlocks[block_index];
-			if (block_index == FAT_EOC)
+			ret = -1;
+			break;
+		}
+		for (size_t i = 0; i < SENDFILE_BATCH && first < clusters;)
+		{
+			if (blocks[i] == FAT_EOC)
 			{
+				ret = -1; // chain shorter than the file
 				break;
 			}
-		}
-		else
-		{
-			memcpy(buf + bytes_read, data_block + offset, count);
-			bytes_read += (int)count;
-			break;
+			size_t run = 1;
+			uint32_t step = blocks[i] == INDEX_HOLE ? 0 : 1;
+			while (i + run < SENDFILE_BATCH && first + run < clusters && blocks[i + run] == blocks[i] + step * run)
+			{
+				++run;
+			}
+			size_t start = first * cluster_size;
+			size_t len = run * cluster_size < length - start ? run * cluster_size : length - start;
+			void *mapped;
+			if (blocks[i] == INDEX_HOLE)
+			{
+				mapped = mmap(base + start, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+			}
+			else
+			{
+				off_t image_offset = cluster_block(&superblock, blocks[i]) * BLOCK_SIZE;
+				mapped = mmap(base + start, len, PROT_READ, MAP_SHARED | MAP_FIXED, imageFd, image_offset);
+			}
+			if (mapped == MAP_FAILED)
+			{
+				ret = -1;
+				break;
+			}
+			i += run;
+			first += run;
 		}
 	}
 
-	offsetArray[fd] += bytes_read;
-	return bytes_read;
+	arena_free(fatBlocks);
+	if (ret == -1)
+	{
+		munmap(base, length);
+		return -1;
+	}
+	*view = base;
+	return (int)entry.size;
+}
+
+int fs_munmap(const void *view, size_t size)
+{
+	if (view == NULL)
+	{
+		return size == 0 ? 0 : -1;
+	}
+	return munmap((void *)view, size);
 }
@@ -7,22 +7,106 @@
 
 #include <stddef.h> /* for size_t definition */
 
-/** Maximum filename length (including the NULL character) */
+/**
+ * Maximum filename length (including the NULL character). File names may be
+ * paths such as "a/b/c", each '/'-separated component at most this long.
+ */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum number of files in the root directory of an original format disk */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Number of open files before the file descriptor table has to grow */
 #define FS_OPEN_MAX_COUNT 32
 
+/** File flag: store all-zero blocks as holes (see fs_setflags()) */
+#define FS_FLAG_SPARSE 0x01
+
+/** File flag: store data compressed (see fs_setflags()) */
+#define FS_FLAG_COMPRESS 0x02
+
+/** File flag: share blocks identical to ones already written (see fs_setflags()) */
+#define FS_FLAG_DEDUP 0x04
+
+/** All file flags that can be set with fs_setflags() */
+#define FS_FLAG_MASK (FS_FLAG_SPARSE | FS_FLAG_COMPRESS | FS_FLAG_DEDUP)
+
+/** Open flag: every write goes to the end of the file (see fs_open_flags()) */
+#define FS_OPEN_APPEND 0x01
+
+/** Format flag: lay files out as extents (see fs_format()) */
+#define FS_FORMAT_EXTENTS 0x01
+
+/** Format flag: keep small files in their directory entry (see fs_format()) */
+#define FS_FORMAT_INLINE 0x02
+
+/** Format flag: checksum every data block (see fs_format()) */
+#define FS_FORMAT_CHECKSUMS 0x04
+
+/**
+ * fs_format - Create an empty file system
+ * @diskname: Name of the virtual disk file
+ * @data_blocks: Number of data blocks
+ * @block_size: Size of a data block in bytes
+ * @max_files: Number of files the root directory must hold
+ * @flags: Format flags
+ *
+ * Create (or overwrite) the virtual disk file @diskname, sized to hold an empty
+ * file system with @data_blocks data blocks of @block_size bytes each.
+ * @block_size must be a power of two between 4096 and 65536. Disks with 4096
+ * byte data blocks and fewer than 65535 of them use the original ECS150FS
+ * layout, larger ones a layout with 32-bit FAT entries that older versions of
+ * this library cannot mount.
+ *
+ * The root directory holds at least @max_files files, rounded up to a whole
+ * block of entries. More than %FS_FILE_MAX_COUNT files also need the larger
+ * layout.
+ *
+ * With %FS_FORMAT_EXTENTS in @flags, files created on the disk keep their data
+ * as a short list of runs of consecutive blocks (extents) instead of a chain
+ * through the FAT, so that finding the blocks of a file takes a lookup per run
+ * rather than per block. Older versions of this library cannot read such
+ * files.
+ *
+ * With %FS_FORMAT_INLINE in @flags, directory entries are 256 bytes instead
+ * of 32 and files created on the disk keep up to their first 224 bytes in
+ * their own entry, so reading or writing a file that small takes no data
+ * block at all. A file moves out to data blocks once it grows past that.
+ * Such a disk always uses the larger layout, and fits 16 entries per block
+ * instead of 128 when sizing the root directory for @max_files.
+ *
+ * With %FS_FORMAT_CHECKSUMS in @flags, a CRC32C of every disk block of the
+ * data area is kept in a checksum area between the root directory and the data
+ * blocks, updated on every write and checked whenever a block is read from
+ * the disk. A block that doesn't match fails the read. Older versions of this
+ * library ignore the checksums, and leave them stale if they write to the
+ * disk.
+ *
+ * Return: -1 if a FS is currently mounted, or if @block_size or @flags is
+ * invalid, or if the file system would be too large, or if @diskname cannot be
+ * written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, size_t block_size, size_t max_files, int flags);
+
+/** Directory entry, as returned by fs_readdir(), fs_stat_all() and fs_stat_name() */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	int is_directory;
+	long first_block; /* head of the file's block chain, -1 if it has none */
+	size_t block_count; /* data blocks the file holds, preallocated ones included */
+	size_t fragments; /* runs of consecutive data blocks they make up */
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). The file is opened twice,
+ * once more for fs_sendfile(), fs_recvfile() and fs_mmap(), and both stay
+ * open until fs_umount().
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
@@ -36,31 +120,89 @@ int fs_mount(const char *diskname);
  * disk file.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
+ * closed, or if there are still open file descriptors, or if some buffered
+ * bytes that fs_write() reported as written could not be flushed, in which
+ * case the FS is unmounted all the same. 0 otherwise.
  */
 int fs_umount(void);
 
 /**
  * fs_info - Display information about file system
  *
- * Display some information about the currently mounted file system.
+ * Display some information about the currently mounted file system. Writes
+ * buffered by open files are flushed first.
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
 int fs_info(void);
 
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Save the current state of every file and directory of the mounted file
+ * system as snapshot @name, which fs_snapshot_mount() can mount later on. Only
+ * the FAT and the root directory get copied: the data blocks they point to are
+ * kept as they are for as long as the snapshot exists, and writing to them
+ * afterwards writes to new blocks instead (copy-on-write). A file with some of
+ * its data held by a snapshot is switched to a block index, as fs_clone()
+ * does, on its next change. Writes buffered by open files are flushed first.
+ *
+ * Snapshot names don't clash with file names, and snapshots don't show in
+ * fs_ls() or fs_readdir(). Each takes an entry of the root directory. Older
+ * versions of this library see each snapshot as an ordinary file named @name
+ * that holds the saved FAT and root directory, which they can open, overwrite
+ * or delete. They don't know about the data blocks it holds either, and can
+ * free and overwrite those.
+ *
+ * Return: -1 if no FS is currently mounted or only a snapshot is, or if @name
+ * is invalid, or if a snapshot named @name already exists, or if the root
+ * directory is full, or if the disk doesn't have room for the copy. 0
+ * otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_mount - Mount a snapshot
+ * @diskname: Name of the virtual disk file
+ * @name: Name of the snapshot
+ *
+ * Like fs_mount(), but the files and directories seen are the ones snapshot
+ * @name saved. Nothing can be changed while a snapshot is mounted: every
+ * function that would returns -1. fs_umount() unmounts it.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located, or if it has no snapshot named @name. 0
+ * otherwise.
+ */
+int fs_snapshot_mount(const char *diskname, const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
+ *
+ * Delete snapshot @name, giving back the blocks of its copy and any data block
+ * that only it still held.
+ *
+ * Return: -1 if no FS is currently mounted or only a snapshot is, or if there
+ * is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
  *
  * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
+ * mounted file system, or in the directory @filename leads to if it is a path.
+ * String @filename must be NULL-terminated and the length of each of its
+ * components cannot exceed %FS_FILENAME_LEN characters (including the NULL
  * character).
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if a directory on its path doesn't exist, or if the root directory is full.
+ * 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -69,7 +211,8 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system, or from the directory @filename leads to if it is a path.
+ * Directories are removed with fs_rmdir() instead.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -77,15 +220,136 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_copy - Copy a file
+ * @src: Name of the file to copy
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst (a name or a path) with the same content and
+ * flags as file @src. The data is copied block by block inside the file system,
+ * and a file with holes keeps them in the copy.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src or @dst is invalid, or
+ * if there is no file named @src, or if a file named @dst already exists, or if
+ * the root directory is full, or if the disk doesn't have enough free blocks
+ * for the copy. 0 otherwise.
+ */
+int fs_copy(const char *src, const char *dst);
+
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Like fs_copy(), but @dst shares the data blocks of @src instead of getting
+ * copies of them. Writing to a shared block through either file gives that
+ * file its own copy of the block first (copy-on-write), so the two files never
+ * see each other's changes. Only a block index per 2048 data blocks is
+ * allocated up front.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src or @dst is invalid, or
+ * if there is no file named @src, or if a file named @dst already exists, or if
+ * the root directory is full, or if the disk doesn't have room for the block
+ * indexes. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files located in the root directory. Writes
+ * buffered by open files are flushed first.
  *
  * Return: -1 if no FS is currently mounted. 0 otherwise.
  */
 int fs_ls(void);
 
+/**
+ * fs_mkdir - Create a directory
+ * @path: Path of the new directory
+ *
+ * Create an empty directory at @path. Every directory on the way must already
+ * exist. Directories share the root directory's room for entries: each one
+ * and each file in it takes an entry from the total set by fs_format().
+ *
+ * Return: -1 if no FS is currently mounted, or if @path is invalid, or if a
+ * file or directory at @path already exists, or if the root directory is
+ * full. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Remove a directory
+ * @path: Path of the directory
+ *
+ * Remove the empty directory at @path.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory at
+ * @path, or if it is not empty, or if it is open with fs_opendir(). 0
+ * otherwise.
+ */
+int fs_rmdir(const char *path);
+
+/**
+ * fs_opendir - Open a directory for listing
+ * @path: Path of the directory, "" or "/" for the root directory
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory at
+ * @path. Otherwise, a directory descriptor for fs_readdir().
+ */
+int fs_opendir(const char *path);
+
+/**
+ * fs_readdir - Read a directory entry
+ * @dd: Directory descriptor
+ * @dirent: Where to store the entry
+ *
+ * Fill @dirent with the next file or subdirectory of the directory open as
+ * @dd. Entries come in no particular order.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dd is invalid, or if
+ * @dirent is NULL. 0 if every entry has been read already. 1 otherwise.
+ */
+int fs_readdir(int dd, struct fs_dirent *dirent);
+
+/**
+ * fs_closedir - Close a directory descriptor
+ * @dd: Directory descriptor
+ *
+ * Return: -1 if no FS is currently mounted, or if @dd is invalid. 0 otherwise.
+ */
+int fs_closedir(int dd);
+
+/**
+ * fs_stat_all - Read every entry of a directory at once
+ * @path: Path of the directory, "" or "/" for the root directory
+ * @dirents: Array to fill
+ * @count: Number of entries @dirents has room for
+ *
+ * Fill @dirents with up to @count of the files and subdirectories of the
+ * directory at @path, as fs_readdir() would one at a time, in a single pass
+ * over the root directory and the FAT. Entries come in no particular order.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory at
+ * @path, or if @dirents is NULL while @count isn't 0. Otherwise return the
+ * number of entries in the directory, which can be more than @count.
+ */
+int fs_stat_all(const char *path, struct fs_dirent *dirents, int count);
+
+/**
+ * fs_stat_name - Get file details by name
+ * @filename: File name
+ * @dirent: Where to store the details
+ *
+ * Fill @dirent for the file or directory @filename as fs_readdir() would, size
+ * and block layout included, without opening it. A file that isn't fragmented
+ * has all its data blocks in a single run.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named
+ * @filename, or if @dirent is NULL. 0 otherwise.
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *dirent);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -95,24 +359,48 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. There is no fixed limit on the number of files open
+ * simultaneously: file descriptors are numbered from 0 up, and the table
+ * holding them grows from %FS_OPEN_MAX_COUNT entries as needed.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
- * descriptor.
+ * there is no file named @filename to open, or if there is no memory left for
+ * another file descriptor. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_flags - Open a file with open flags
+ * @filename: File name
+ * @flags: Combination of %FS_OPEN_* flags
+ *
+ * Open file named @filename like fs_open(). With %FS_OPEN_APPEND, every
+ * fs_write() to the returned file descriptor first moves its offset to the end
+ * of the file, past whatever any other file descriptor wrote to it so far,
+ * buffered bytes included. The whole write then lands there, so appenders
+ * sharing a file never overwrite each other's records, without having to
+ * fs_stat() and fs_lseek() before each write. Reads still start at the file
+ * offset, which fs_lseek() moves as usual.
+ *
+ * Like every other call, fs_write() must not run at the same time as another
+ * libfs call: appenders on different threads still take turns, but each only
+ * needs to hold the turn for the one call.
+ *
+ * Return: -1 if @flags has unknown bits set, otherwise as fs_open().
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
  * Close file descriptor @fd.
  *
+ * Any bytes still sitting in the write buffer of @fd are flushed to disk first.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if buffered bytes that an
+ * earlier fs_write() reported as written could not be flushed. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -137,12 +425,101 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset may be past the end of the file: reads from there return 0 bytes,
+ * and a write from there leaves a hole between the old end of file and
+ * @offset that reads as zeros without taking up data blocks.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * invalid (i.e., out of bounds, or not currently open). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_sync - Flush buffered writes
+ *
+ * Write the buffered bytes of every open file descriptor to disk.
+ *
+ * Return: -1 if no FS is currently mounted, or if some buffered bytes that
+ * fs_write() reported as written could not be flushed. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @size: New file size
+ *
+ * Shrink or grow the file referenced by file descriptor @fd to exactly @size
+ * bytes. Shrinking frees every block past the new end of file, including
+ * blocks reserved with fs_fallocate(). Growing doesn't allocate anything: the
+ * added bytes are a hole that reads as zeros. The file offset is left
+ * unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @size is past
+ * UINT32_MAX, the largest size a file can have, or if the disk doesn't have
+ * room for the block index a file with holes needs. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t size);
+
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @size: Number of bytes to reserve
+ *
+ * Make sure the file referenced by file descriptor @fd has enough data blocks
+ * to hold @size bytes, so that later writes up to @size don't have to allocate.
+ * Missing blocks are taken in one contiguous run when the disk has one. The
+ * file size is left unchanged and no data is written, except for zeroing the
+ * blocks that fill holes inside the file. Compressed files (see
+ * fs_setflags()) only take blocks when written, so this does nothing for them.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @size is past
+ * UINT32_MAX, the largest size a file can have, or if the disk doesn't have
+ * enough free blocks. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
+/**
+ * fs_getflags - Get file flags
+ * @fd: File descriptor
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). Otherwise return the
+ * %FS_FLAG_* flags of the file.
+ */
+int fs_getflags(int fd);
+
+/**
+ * fs_setflags - Set file flags
+ * @fd: File descriptor
+ * @flags: Combination of %FS_FLAG_* flags
+ *
+ * Replace the flags of the file referenced by file descriptor @fd with @flags.
+ * With %FS_FLAG_SPARSE set, any block that a write leaves entirely zero is
+ * given back to the disk and reads as a hole from then on.
+ *
+ * With %FS_FLAG_COMPRESS set, the file is stored in units of 8 data blocks,
+ * each compressed into as few blocks as it fits in. Every write rewrites the
+ * units it touches, so the flag suits files written once or appended to in
+ * large chunks. Setting or clearing it recompresses or expands what the file
+ * already holds.
+ *
+ * With %FS_FLAG_DEDUP set, a block written to the file whose content matches a
+ * block written to a file with the flag earlier since the disk was mounted
+ * isn't written again: the file shares that block instead, as with
+ * fs_clone(), until one of the two files changes it. Blocks the file already
+ * holds are left as they are, and compressed files aren't deduplicated.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @flags has unknown bits
+ * set, or if the disk doesn't have room for the block index a sparse,
+ * compressed or deduplicated file needs or for recoding its data, in which
+ * case a file left partly compressed keeps %FS_FLAG_COMPRESS. 0 otherwise.
+ */
+int fs_setflags(int fd, int flags);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -158,6 +535,15 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * The file offset of the file descriptor is implicitly incremented by the
+ * number of bytes that were actually written. A write that would end past
+ * UINT32_MAX, the largest size a file can have, writes nothing and returns 0.
+ *
+ * Writes smaller than %BLOCK_SIZE are gathered in a per-descriptor buffer and
+ * only reach the disk once the buffer fills up to a block boundary, or on
+ * fs_close(), fs_lseek(), fs_sync(), fs_umount(), or a read or stat of the same
+ * file. Running out of space while flushing such a buffer is reported by
+ * fs_close(), fs_sync() or fs_umount().
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
@@ -179,11 +565,89 @@ int fs_write(int fd, void *buf, size_t count);
  * @count bytes until the end of the file (it can even be 0 if the file offset
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
+ * On a disk with checksums, reading stops short of a block that fails its
+ * checksum.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually read.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * first block to read cannot be read or fails its checksum. Otherwise return
+ * the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_sendfile - Copy file data to a host file descriptor
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to write to
+ * @offset: File offset to start from
+ * @count: Number of bytes of data to be copied
+ *
+ * Write up to @count bytes of the file referenced by file descriptor @fd,
+ * starting at @offset, to host file descriptor @host_fd at its current
+ * position. Runs of contiguous data blocks are copied by the kernel straight
+ * from the disk image (copy_file_range() or sendfile()) rather than through
+ * user space, except for compressed files and on disks with checksums, whose
+ * data is read as with fs_read(). The file offset of @fd is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @host_fd is negative,
+ * or if nothing could be copied. Otherwise return the number of bytes copied,
+ * 0 if @offset is at or past the end of the file.
+ */
+int fs_sendfile(int fd, int host_fd, size_t offset, size_t count);
+
+/**
+ * fs_recvfile - Copy data from a host file descriptor into a file
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to read from
+ * @offset: File offset to start at
+ * @count: Number of bytes of data to be copied
+ *
+ * Read up to @count bytes from host file descriptor @host_fd at its current
+ * position and write them into the file referenced by file descriptor @fd at
+ * @offset, extending it as fs_write() does. From a regular host file into a
+ * file stored as a chain of blocks, the blocks are reserved first (see
+ * fs_fallocate()) and filled by the kernel with copy_file_range(), without
+ * going through user space. The file offset of @fd is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @host_fd is negative,
+ * or if nothing could be copied because of an error. Otherwise return the
+ * number of bytes copied, which is less than @count at the end of @host_fd or
+ * if the disk runs out of space, and 0 if the copy would end past UINT32_MAX.
+ */
+int fs_recvfile(int fd, int host_fd, size_t offset, size_t count);
+
+/**
+ * fs_mmap - Map a file into memory
+ * @fd: File descriptor
+ * @view: Address of the pointer to set to the mapping
+ *
+ * Make the content of the file referenced by file descriptor @fd readable as
+ * one contiguous read-only array at *@view. The data blocks of the file are
+ * mapped from the disk image as they are, a run of consecutive blocks at a
+ * time, so nothing is copied and pages are only read in once accessed. Holes
+ * read as zeros. Inline and compressed files, and every file on a disk with
+ * checksums, are read into memory up front instead.
+ *
+ * The mapping stays valid until fs_munmap(), even past fs_close() and
+ * fs_umount(), but only shows the file as it was when mapped while nothing
+ * writes to, truncates or deletes it.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @view is NULL, or if
+ * the file couldn't be mapped. Otherwise return the size of the file, with
+ * *@view set to NULL if it is empty.
+ */
+int fs_mmap(int fd, const void **view);
+
+/**
+ * fs_munmap - Unmap a file
+ * @view: Mapping set up by fs_mmap()
+ * @size: Size fs_mmap() returned
+ *
+ * Return: -1 if @view and @size don't describe a mapping. 0 otherwise.
+ */
+int fs_munmap(const void *view, size_t size);
+
 #endif /* _FS_H */